@@ -0,0 +1,182 @@
+/*
+ Si_large_fitting.cpp
+
+ This is an example to fit a design matrix with more than 2^32 elements
+ by the streaming solvers, which never store the matrix, or by the
+ out-of-core mode, which places the matrix in a scratch file.
+
+ The forces of random displacements in the 64-atom cell of Si are given by
+ central springs between the nearest neighbors, so that the fitting error
+ should vanish. With NORDER = 2 and the cubic cutoff of 7.3 bohr, there are
+ N = 62 parameters, and the default 380000 snapshots give
+ M = 192 * 380000 rows, i.e., M * N = 4.5e+9 > 2^32.
+ The displacements and forces take 2.3 GB, and the peak memory is about
+ 3.5 GB while they are copied to ALM.
+
+ With SCRATCH, the matrix is written to si_large.scratch in the scratch
+ directory (the current directory by default), which takes M * (N + 1)
+ doubles, i.e., 37 GB for the default ndata.
+
+ With ndata = large, the 11200000 snapshots give M = 2150400000 > 2^31 - 1
+ rows. This case needs about 70 GB of memory, and 1.1 TB of disk with
+ SCRATCH.
+
+ The program returns 1 unless the rank of the matrix is N and the fitting
+ error is below 1e-8 %, so that it can be used as a regression test.
+ The tests are added by cmake -DALM_LARGE_TESTS=ON and run by ctest.
+
+ Usage:
+   g++ -O2 -fopenmp -I../include Si_large_fitting.cpp -L../_build -lalmcxx -o Si_large_fitting
+   ./Si_large_fitting [TSQR|CHOLESKY|SCRATCH] [ndata|large] [scratch directory]
+*/
+
+#include "alm.h"
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+int main(int argc, char **argv)
+{
+    const std::string solver = (argc > 1) ? argv[1] : "TSQR";
+    const std::string str_ndata = (argc > 2) ? argv[2] : "380000";
+    const std::string scratch_dir = (argc > 3) ? argv[3] : ".";
+    const int ndata = (str_ndata == "large") ? 11200000 : std::atoi(str_ndata.c_str());
+    const int nparam_expected = 62;
+    const double error_tolerance = 1.0e-8; // %
+    const int nat = 64;
+    const double alat = 20.406;
+    const double kspring = 0.1;
+
+    double lavec[3][3] = {{alat, 0, 0},
+                          {0, alat, 0},
+                          {0, 0, alat}};
+    double xcoord[64][3];
+    int kd[64];
+    std::string kdname[1] = {"Si"};
+
+    // Diamond structure in the 2x2x2 conventional cells
+
+    const double basis[8][3] = {{0.0, 0.0, 0.0}, {0.0, 0.5, 0.5},
+                                {0.5, 0.0, 0.5}, {0.5, 0.5, 0.0},
+                                {0.25, 0.25, 0.25}, {0.25, 0.75, 0.75},
+                                {0.75, 0.25, 0.75}, {0.75, 0.75, 0.25}};
+    int iat = 0;
+    for (int ix = 0; ix < 2; ++ix) {
+        for (int iy = 0; iy < 2; ++iy) {
+            for (int iz = 0; iz < 2; ++iz) {
+                for (int ib = 0; ib < 8; ++ib) {
+                    xcoord[iat][0] = 0.5 * (ix + basis[ib][0]);
+                    xcoord[iat][1] = 0.5 * (iy + basis[ib][1]);
+                    xcoord[iat][2] = 0.5 * (iz + basis[ib][2]);
+                    kd[iat] = 1;
+                    ++iat;
+                }
+            }
+        }
+    }
+
+    // Unit vectors of the nearest-neighbor bonds (minimum image)
+
+    const double dist_nn = std::sqrt(3.0) / 8.0 * alat;
+    std::vector<int> nn_i, nn_j;
+    std::vector<double> nn_e;
+
+    for (int i = 0; i < nat; ++i) {
+        for (int j = i + 1; j < nat; ++j) {
+            double dx[3], d2 = 0.0;
+            for (int k = 0; k < 3; ++k) {
+                dx[k] = xcoord[j][k] - xcoord[i][k];
+                dx[k] -= std::round(dx[k]);
+                dx[k] *= alat;
+                d2 += dx[k] * dx[k];
+            }
+            if (std::abs(std::sqrt(d2) - dist_nn) < 1.0e-6) {
+                nn_i.push_back(i);
+                nn_j.push_back(j);
+                for (int k = 0; k < 3; ++k) nn_e.push_back(dx[k] / std::sqrt(d2));
+            }
+        }
+    }
+
+    // Random displacements and the forces of the springs
+
+    std::vector<double> u(static_cast<size_t>(ndata) * nat * 3);
+    std::vector<double> f(static_cast<size_t>(ndata) * nat * 3, 0.0);
+    std::mt19937 rng(12345);
+    std::normal_distribution<double> gauss(0.0, 0.02);
+
+    for (size_t i = 0; i < u.size(); ++i) u[i] = gauss(rng);
+
+    for (int idata = 0; idata < ndata; ++idata) {
+        const double *us = &u[static_cast<size_t>(idata) * nat * 3];
+        double *fs = &f[static_cast<size_t>(idata) * nat * 3];
+        for (size_t ib = 0; ib < nn_i.size(); ++ib) {
+            const int i = nn_i[ib];
+            const int j = nn_j[ib];
+            const double *e = &nn_e[3 * ib];
+            double stretch = 0.0;
+            for (int k = 0; k < 3; ++k) stretch += e[k] * (us[3 * j + k] - us[3 * i + k]);
+            for (int k = 0; k < 3; ++k) {
+                fs[3 * i + k] += kspring * stretch * e[k];
+                fs[3 * j + k] -= kspring * stretch * e[k];
+            }
+        }
+    }
+
+    std::cout << "Number of snapshots : " << ndata << std::endl;
+    std::cout << "Number of rows M    : " << 3L * 2 * 32 * ndata;
+    if (3L * 2 * 32 * ndata > INT_MAX) std::cout << " (> 2^31 - 1)";
+    std::cout << std::endl;
+
+    ALM_NS::ALM *alm = new ALM_NS::ALM();
+
+    alm->set_verbose(true);
+    alm->set_run_mode("fitting");
+    alm->set_output_filename_prefix("si_large");
+    alm->set_cell(nat, lavec, xcoord, kd, kdname);
+    alm->set_norder(2);
+
+    // rcs[maxorder, nkd, nkd] to be flattened.
+    double rcs[2] = {-1.0, 7.3};
+    alm->set_cutoff_radii(rcs);
+
+    alm->set_fitting_constraint_type(0);
+    if (solver == "SCRATCH") {
+        // The out-of-core TSQR is used for SOLVER = SVD with SCRATCH.
+        // The panels of the matrix take 256 MB each.
+        alm->set_fitting_solver("SVD");
+        alm->set_fitting_scratch(scratch_dir, 256.0);
+    } else {
+        alm->set_fitting_solver(solver);
+    }
+
+    alm->set_displacement_and_force(&u[0], &f[0], nat, ndata);
+
+    // ALM keeps its own copy of the data.
+    std::vector<double>().swap(u);
+    std::vector<double>().swap(f);
+
+    alm->run();
+
+    const int nrank = alm->get_matrix_rank();
+    const double fitting_error = alm->get_fitting_error();
+
+    delete alm;
+
+    std::cout << "RANK of the matrix  : " << nrank
+        << " (expected " << nparam_expected << ")" << std::endl;
+    std::cout << "Fitting error (%)   : " << fitting_error
+        << " (tolerance " << error_tolerance << ")" << std::endl;
+
+    if (nrank != nparam_expected || fitting_error < 0.0 || fitting_error > error_tolerance) {
+        std::cout << "FAILED" << std::endl;
+        return 1;
+    }
+    std::cout << "PASSED" << std::endl;
+
+    return 0;
+}
@@ -46,10 +46,45 @@ namespace ALM_NS
                                               const double *f_in,
                                               const int nat,
                                               const int ndata_used);
+        const void set_displacement_and_force_sets(const double *u_in,
+                                                   const double *f_in,
+                                                   const int nat,
+                                                   const int ndata_used,
+                                                   const int nset);
+        const void append_displacement_and_force(const double *u_in,
+                                                 const double *f_in,
+                                                 const int nat,
+                                                 const int ndata_add);
         const void set_fitting_constraint_type(const int constraint_flag);
         const void set_fitting_constraint_rotation_axis
         (const std::string rotation_axis);
         const void set_multiplier_option(const int multiply_data);
+        const void set_fitting_solver(const std::string solver);
+        const void set_fitting_block_size(const int nblock);
+        const void set_fitting_sparse(const int use_sparse);
+        const void set_fitting_sparse_solver(const std::string sparse_solver);
+        const void set_fitting_iteration(const double tol_iter,
+                                         const int maxiter);
+        const void set_fitting_warm_start(const int warm_start);
+        const void set_fitting_scratch(const std::string scratch_dir,
+                                       const double maxmem);
+        const void set_fitting_cross_validation(const int nfold,
+                                                const double minalpha,
+                                                const double maxalpha,
+                                                const int nalpha);
+        const void set_fitting_lmodel(const std::string lmodel,
+                                      const double l1_alpha,
+                                      const double l1_ratio);
+        const void set_fitting_precision(const std::string precision);
+        const void set_fitting_memlimit(const double memlimit);
+        const void set_fitting_selection(const std::string selection,
+                                         const double select_cond);
+        const void set_fitting_parity(const int parity);
+        const void set_fitting_pin_threads(const int pin_threads);
+        const void set_number_of_data(const int ndata_used);
+        const void set_fitting_hierarchical(const int hierarchical,
+                                            const int *nstart_order,
+                                            const int *nend_order);
         const void set_fitting_filenames(const std::string dfile,
                                          const std::string ffile);
         const void set_norder(const int maxorder);
@@ -67,6 +102,14 @@ namespace ALM_NS
         const void get_fc(double *fc_value,
                           int *elem_indices, // (len(fc_value), fc_order) is flatten.
                           const int fc_order); // harmonic=2, ...
+        const void get_fc_set(double *fc_value,
+                              int *elem_indices, // (len(fc_value), fc_order) is flatten.
+                              const int fc_order, // harmonic=2, ...
+                              const int iset); // 0, ..., nset - 1
+        const int get_number_of_selected_snapshots();
+        const void get_selected_snapshots(int *indices); // data indices from 1
+        const int get_matrix_rank(); // of the last fit, -1 if not computed
+        const double get_fitting_error(); // (%) of the last fit
         const void run();
 
     private:
@@ -76,5 +119,6 @@ namespace ALM_NS
         std::streambuf *coutbuf;
         const void run_fitting();
         const void run_suggest();
+        const void run_plan();
     };
 }
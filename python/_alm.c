@@ -15,6 +15,7 @@ static PyObject * py_run_suggest(PyObject *self, PyObject *args);
 static PyObject * py_run_fitting(PyObject *self, PyObject *args);
 static PyObject * py_set_cell(PyObject *self, PyObject *args);
 static PyObject * py_set_displacement_and_force(PyObject *self, PyObject *args);
+static PyObject * py_append_displacement_and_force(PyObject *self, PyObject *args);
 static PyObject * py_set_fitting_constraint_type(PyObject *self, PyObject *args);
 static PyObject * py_set_norder(PyObject *self, PyObject *args);
 static PyObject * py_set_cutoff_radii(PyObject *self, PyObject *args);
@@ -53,6 +54,7 @@ static PyMethodDef _alm_methods[] = {
   {"run_fitting", py_run_fitting, METH_VARARGS, ""},
   {"set_cell", py_set_cell, METH_VARARGS, ""},
   {"set_displacement_and_force", py_set_displacement_and_force, METH_VARARGS, ""},
+  {"append_displacement_and_force", py_append_displacement_and_force, METH_VARARGS, ""},
   {"set_fitting_constraint_type", py_set_fitting_constraint_type, METH_VARARGS, ""},
   {"set_norder", py_set_norder, METH_VARARGS, ""},
   {"set_cutoff_radii", py_set_cutoff_radii, METH_VARARGS, ""},
@@ -221,6 +223,28 @@ static PyObject * py_set_displacement_and_force(PyObject *self, PyObject *args)
   Py_RETURN_NONE;
 }
 
+static PyObject * py_append_displacement_and_force(PyObject *self, PyObject *args)
+{
+  int id;
+  PyArrayObject* py_u;
+  PyArrayObject* py_f;
+  if (!PyArg_ParseTuple(args, "iOO",
+			&id,
+                        &py_u,
+                        &py_f)) {
+    return NULL;
+  }
+
+  const double* u = (double*)PyArray_DATA(py_u);
+  const double* f = (double*)PyArray_DATA(py_f);
+
+  const int ndata_add = PyArray_DIMS(py_f)[0];
+  const int nat = PyArray_DIMS(py_f)[1];
+  alm_append_displacement_and_force(id, u, f, nat, ndata_add);
+
+  Py_RETURN_NONE;
+}
+
 static PyObject * py_set_fitting_constraint_type(PyObject *self, PyObject *args)
 {
   int id, iconst;
@@ -57,6 +57,15 @@ class ALM:
             np.array(u, dtype='double', order='C'),
             np.array(f, dtype='double', order='C'))
 
+    def append_displacement_and_force(self, u, f):
+        if self._id is None:
+            self._show_error_message()
+
+        alm.append_displacement_and_force(
+            self._id,
+            np.array(u, dtype='double', order='C'),
+            np.array(f, dtype='double', order='C'))
+
     def set_fitting_constraint_type(self, iconst):
         alm.set_fitting_constraint_type(self._id, iconst)
     
@@ -132,6 +132,15 @@ extern "C" {
         alm[id]->set_displacement_and_force(u_in, f_in, nat, ndata_used);
     }
 
+    void alm_append_displacement_and_force(const int id,
+                                           const double* u_in,
+                                           const double* f_in,
+                                           const int nat,
+                                           const int ndata_add)
+    {
+        alm[id]->append_displacement_and_force(u_in, f_in, nat, ndata_add);
+    }
+
     void alm_set_fitting_constraint_type(const int id,
                                          const int constraint_flag) // ICONST
     {
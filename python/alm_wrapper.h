@@ -31,6 +31,11 @@ extern "C" {
                                         const double* f_in,
                                         const int nat,
                                         const int ndata_used);
+    void alm_append_displacement_and_force(const int id,
+                                           const double* u_in,
+                                           const double* f_in,
+                                           const int nat,
+                                           const int ndata_add);
     void alm_set_fitting_constraint_type(const int id,
                                          const int constraint_flag); // ICONST
     // void set_fitting_constraint_rotation_axis(const std::string rotation_axis) // ROTAXIS
@@ -22,6 +22,7 @@ if compile_with_sources:
                'fcs.cpp',
                'files.cpp',
                'fitting.cpp',
+               'fitting_kernels.cpp',
                'input_parser.cpp',
                'input_setter.cpp',
                'interaction.cpp',
@@ -11,6 +11,7 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <algorithm>
 #include "alm.h"
 #include "alm_core.h"
 #include "constraint.h"
@@ -231,8 +232,8 @@ const void ALM::set_displacement_and_force(const double *u_in,
 
     for (int i = 0; i < ndata_used; i++) {
         for (int j = 0; j < 3 * nat; j++) {
-            u[i][j] = u_in[i * nat * 3 + j];
-            f[i][j] = f_in[i * nat * 3 + j];
+            u[i][j] = u_in[static_cast<long>(i) * nat * 3 + j];
+            f[i][j] = f_in[static_cast<long>(i) * nat * 3 + j];
         }
     }
     alm_core->fitting->set_displacement_and_force(u, f, nat, ndata_used);
@@ -241,6 +242,73 @@ const void ALM::set_displacement_and_force(const double *u_in,
     deallocate(f);
 }
 
+const void ALM::set_displacement_and_force_sets(const double *u_in,
+                                                const double *f_in,
+                                                const int nat,
+                                                const int ndata_used,
+                                                const int nset)
+{
+    // nset force sets for the same displacements. f_in is (nset, ndata_used, nat, 3)
+    // flattened. The sets are fitted at once, and the force constants of
+    // each set are obtained by get_fc_set.
+
+    double **f;
+
+    set_displacement_and_force(u_in, f_in, nat, ndata_used);
+
+    if (nset > 1) {
+        allocate(f, (nset - 1) * ndata_used, 3 * nat);
+
+        for (int i = 0; i < (nset - 1) * ndata_used; i++) {
+            for (int j = 0; j < 3 * nat; j++) {
+                f[i][j] = f_in[static_cast<long>(ndata_used + i) * nat * 3 + j];
+            }
+        }
+        alm_core->fitting->set_extra_force_sets(f, nat, ndata_used, nset - 1);
+        deallocate(f);
+    }
+}
+
+const void ALM::append_displacement_and_force(const double *u_in,
+                                              const double *f_in,
+                                              const int nat,
+                                              const int ndata_add)
+{
+    // Update the force constants of the previous run() in the fitting mode
+    // with additional displacement-force data sets.
+
+    double **u;
+    double **f;
+
+    if (!verbose) {
+        ofs_alm = new std::ofstream("alm.log", std::ofstream::app);
+        coutbuf = std::cout.rdbuf();
+        std::cout.rdbuf(ofs_alm->rdbuf());
+    }
+
+    allocate(u, ndata_add, 3 * nat);
+    allocate(f, ndata_add, 3 * nat);
+
+    for (int i = 0; i < ndata_add; i++) {
+        for (int j = 0; j < 3 * nat; j++) {
+            u[i][j] = u_in[static_cast<long>(i) * nat * 3 + j];
+            f[i][j] = f_in[static_cast<long>(i) * nat * 3 + j];
+        }
+    }
+    alm_core->fitting->append_displacement_and_force(u, f, nat, ndata_add);
+
+    deallocate(u);
+    deallocate(f);
+
+    if (!verbose) {
+        ofs_alm->close();
+        delete ofs_alm;
+        ofs_alm = nullptr;
+        std::cout.rdbuf(coutbuf);
+        coutbuf = nullptr;
+    }
+}
+
 const void ALM::set_fitting_constraint_type(const int constraint_flag) // ICONST
 {
     alm_core->constraint->constraint_mode = constraint_flag;
@@ -252,6 +320,132 @@ const void ALM::set_fitting_constraint_rotation_axis
     alm_core->constraint->rotation_axis = rotation_axis;
 }
 
+const void ALM::set_fitting_solver(const std::string solver) // SOLVER
+{
+    std::string str_solver = solver;
+    std::transform(str_solver.begin(), str_solver.end(), str_solver.begin(), toupper);
+    alm_core->fitting->solver = str_solver;
+}
+
+const void ALM::set_fitting_block_size(const int nblock) // NBLOCK
+{
+    alm_core->fitting->nblock = nblock;
+}
+
+const void ALM::set_fitting_sparse(const int use_sparse) // SPARSE
+{
+    alm_core->fitting->use_sparse = use_sparse;
+}
+
+const void ALM::set_fitting_sparse_solver(const std::string sparse_solver) // SPARSESOLVER
+{
+    std::string str_solver = sparse_solver;
+    std::transform(str_solver.begin(), str_solver.end(), str_solver.begin(), toupper);
+    alm_core->fitting->sparse_solver = str_solver;
+}
+
+const void ALM::set_fitting_iteration(const double tol_iter, // TOL_ITER
+                                      const int maxiter) // MAXITER
+{
+    alm_core->fitting->tol_iter = tol_iter;
+    alm_core->fitting->maxiter = maxiter;
+}
+
+const void ALM::set_fitting_warm_start(const int warm_start)
+{
+    // Start LSQR/CGLS from the force constants of the previous fit.
+    alm_core->fitting->warm_start = warm_start;
+}
+
+const void ALM::set_fitting_scratch(const std::string scratch_dir, // SCRATCH
+                                    const double maxmem) // MAXMEM
+{
+    alm_core->fitting->scratch_dir = scratch_dir;
+    alm_core->fitting->maxmem = maxmem;
+}
+
+const void ALM::set_fitting_cross_validation(const int nfold, // CV
+                                             const double minalpha, // CV_MINALPHA
+                                             const double maxalpha, // CV_MAXALPHA
+                                             const int nalpha) // CV_NALPHA
+{
+    alm_core->fitting->cross_validation = nfold;
+    alm_core->fitting->cv_minalpha = minalpha;
+    alm_core->fitting->cv_maxalpha = maxalpha;
+    alm_core->fitting->cv_nalpha = nalpha;
+}
+
+const void ALM::set_fitting_lmodel(const std::string lmodel, // LMODEL
+                                   const double l1_alpha, // L1_ALPHA
+                                   const double l1_ratio) // L1_RATIO
+{
+    std::string str_lmodel = lmodel;
+    std::transform(str_lmodel.begin(), str_lmodel.end(), str_lmodel.begin(), toupper);
+    alm_core->fitting->lmodel = str_lmodel;
+    alm_core->fitting->l1_alpha = l1_alpha;
+    alm_core->fitting->l1_ratio = l1_ratio;
+}
+
+const void ALM::set_fitting_precision(const std::string precision) // PRECISION
+{
+    std::string str_precision = precision;
+    std::transform(str_precision.begin(), str_precision.end(), str_precision.begin(), toupper);
+    alm_core->fitting->precision = str_precision;
+}
+
+const void ALM::set_fitting_memlimit(const double memlimit) // MEMLIMIT
+{
+    alm_core->fitting->memlimit = memlimit;
+}
+
+const void ALM::set_fitting_selection(const std::string selection, // SELECT
+                                      const double select_cond) // SELECT_COND
+{
+    std::string str_selection = selection;
+    std::transform(str_selection.begin(), str_selection.end(), str_selection.begin(), toupper);
+    alm_core->fitting->selection = str_selection;
+    alm_core->fitting->select_cond = select_cond;
+}
+
+const void ALM::set_fitting_parity(const int parity) // PARITY
+{
+    alm_core->fitting->parity = parity;
+}
+
+const void ALM::set_fitting_pin_threads(const int pin_threads) // PIN_THREADS
+{
+    // Must be called before set_displacement_and_force so that the
+    // displacements and forces are placed by the pinned threads.
+    alm_core->fitting->pin_threads = pin_threads;
+}
+
+const void ALM::set_number_of_data(const int ndata_used)
+{
+    // Number of snapshots for the plan mode, where the displacements and
+    // forces are not given.
+    alm_core->system->ndata = ndata_used;
+    alm_core->system->nstart = 1;
+    alm_core->system->nend = ndata_used;
+}
+
+const void ALM::set_fitting_hierarchical(const int hierarchical, // HIERARCHICAL
+                                         const int *nstart_order, // NSTART_ORDER
+                                         const int *nend_order) // NEND_ORDER
+{
+    // nstart_order and nend_order have NORDER entries, or nullptr to use
+    // all the data for every order. set_norder must be called beforehand.
+    int maxorder = alm_core->interaction->maxorder;
+
+    alm_core->fitting->hierarchical = hierarchical;
+    alm_core->fitting->nstart_order.clear();
+    alm_core->fitting->nend_order.clear();
+    if (nstart_order) {
+        alm_core->fitting->nstart_order.assign(nstart_order, nstart_order + maxorder);
+    }
+    if (nend_order) {
+        alm_core->fitting->nend_order.assign(nend_order, nend_order + maxorder);
+    }
+}
 
 const void ALM::set_fitting_filenames(const std::string dfile, // DFILE
                                       const std::string ffile) // FFILE
@@ -415,6 +609,14 @@ const int ALM::get_number_of_fc_elements(const int fc_order) // harmonic=1, ...
 const void ALM::get_fc(double *fc_values,
                        int *elem_indices, // (len(fc_values), fc_order + 1) is flatten.
                        const int fc_order) // harmonic=1, ...
+{
+    get_fc_set(fc_values, elem_indices, fc_order, 0);
+}
+
+const void ALM::get_fc_set(double *fc_values,
+                           int *elem_indices, // (len(fc_values), fc_order + 1) is flatten.
+                           const int fc_order, // harmonic=1, ...
+                           const int iset) // 0, ..., nset - 1
 {
     int j, k, ip, id;
     int order, num_unique_elems, num_equiv_elems, maxorder;
@@ -425,6 +627,9 @@ const void ALM::get_fc(double *fc_values,
     fcs = alm_core->fcs;
     fitting = alm_core->fitting;
     maxorder = alm_core->interaction->maxorder;
+
+    const double *params = (fitting->nset > 1) ? fitting->params_set[iset] : fitting->params;
+
     ip = 0;
     for (order = 0; order < fc_order; ++order) {
         if (fcs->nequiv[order].size() < 1) { continue; }
@@ -432,7 +637,7 @@ const void ALM::get_fc(double *fc_values,
         num_unique_elems = fcs->nequiv[order].size();
         for (int iuniq = 0; iuniq < num_unique_elems; ++iuniq) {
             if (order == fc_order - 1) {
-                fc_elem = fitting->params[ip];
+                fc_elem = params[ip];
                 num_equiv_elems = fcs->nequiv[order][iuniq];
                 for (j = 0; j < num_equiv_elems; ++j) {
                     // sign is normally 1 or -1.
@@ -450,6 +655,28 @@ const void ALM::get_fc(double *fc_values,
     }
 }
 
+const int ALM::get_number_of_selected_snapshots()
+{
+    return alm_core->fitting->snapshots_selected.size();
+}
+
+const void ALM::get_selected_snapshots(int *indices)
+{
+    for (size_t i = 0; i < alm_core->fitting->snapshots_selected.size(); ++i) {
+        indices[i] = alm_core->fitting->snapshots_selected[i];
+    }
+}
+
+const int ALM::get_matrix_rank()
+{
+    return alm_core->fitting->fit_rank;
+}
+
+const double ALM::get_fitting_error()
+{
+    return alm_core->fitting->fit_error;
+}
+
 const void ALM::run()
 {
     if (!verbose) {
@@ -463,6 +690,8 @@ const void ALM::run()
         run_fitting();
     } else if (alm_core->mode == "suggest") {
         run_suggest();
+    } else if (alm_core->mode == "plan") {
+        run_plan();
     }
 
     if (!verbose) {
@@ -484,3 +713,9 @@ const void ALM::run_suggest()
 {
     alm_core->displace->gen_displacement_pattern();
 }
+
+const void ALM::run_plan()
+{
+    alm_core->constraint->setup();
+    alm_core->fitting->plan();
+}
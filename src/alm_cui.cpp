@@ -10,10 +10,14 @@
 
 #include <iostream>
 #include <iomanip>
+#include <vector>
 #include "alm.h"
 #include "alm_core.h"
 #include "alm_cui.h"
+#include "error.h"
+#include "fitting.h"
 #include "input_parser.h"
+#include "system.h"
 #include "writer.h"
 #include "version.h"
 #include "timer.h"
@@ -21,6 +25,9 @@
 #ifdef _OPENMP
 #include <omp.h>
 #endif
+#ifdef _USE_MPI
+#include <mpi.h>
+#endif
 
 using namespace ALM_NS;
 
@@ -30,6 +37,17 @@ ALMCUI::ALMCUI()
 
 void ALMCUI::run(int narg, char **arg)
 {
+    int my_rank = 0;
+
+#ifdef _USE_MPI
+    int nprocs;
+    MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+    MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+
+    // Only the root process prints the log and writes the output files.
+    if (my_rank > 0) std::cout.setstate(std::ios::failbit);
+#endif
+
     std::cout << " +-----------------------------------------------------------------+" << std::endl;
     std::cout << " +                         Program ALM                             +" << std::endl;
     std::cout << " +                             Ver.";
@@ -44,6 +62,10 @@ void ALMCUI::run(int narg, char **arg)
     std::cout << " Number of OpenMP threads = "
         << omp_get_max_threads() << std::endl << std::endl;
 #endif
+#ifdef _USE_MPI
+    std::cout << " Number of MPI processes = "
+        << nprocs << std::endl << std::endl;
+#endif
 
     ALMCore *alm_core = alm->get_alm_core();
     std::cout << " Job started at " << alm_core->timer->DateAndTime() << std::endl;
@@ -56,17 +78,42 @@ void ALMCUI::run(int narg, char **arg)
 
 
     if (alm_core->mode == "fitting") {
+#ifdef _USE_MPI
+        if (alm_core->fitting->online > 0 && nprocs > 1) {
+            alm_core->error->exit("run", "ONLINE > 0 does not support MPI.");
+        }
+#endif
         input_parser->parse_displacement_and_force(alm_core);
     }
-    delete input_parser;
 
     alm->run();
 
-    if (alm_core->mode == "fitting") {
-        writer->writeall(alm);
-    } else if (alm_core->mode == "suggest") {
-        writer->write_displacement_pattern(alm);
+    if (my_rank == 0) {
+        if (alm_core->mode == "fitting") {
+            writer->writeall(alm);
+        } else if (alm_core->mode == "suggest") {
+            writer->write_displacement_pattern(alm);
+        }
     }
+
+    if (alm_core->mode == "fitting" && alm_core->fitting->online > 0) {
+
+        // Online fitting: the force constants and the output files are
+        // updated with every ONLINE snapshots appended to DFILE and FFILE
+        // until no more data arrive.
+
+        int nread;
+        std::vector<double> u, f;
+
+        while ((nread = input_parser->parse_next_snapshots(alm_core, alm_core->fitting->online,
+                                                           u, f)) > 0) {
+            alm->append_displacement_and_force(&u[0], &f[0], alm_core->system->nat, nread);
+            writer->writeall(alm);
+        }
+        std::cout << " ONLINE: End of DFILE and FFILE after "
+            << alm_core->system->ndata << " snapshots." << std::endl;
+    }
+    delete input_parser;
     delete writer;
 
     std::cout << std::endl << " Job finished at "
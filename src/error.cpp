@@ -11,7 +11,11 @@
 #include <iostream>
 #include <cstdlib>
 #include <string>
+#include <sstream>
 #include "error.h"
+#ifdef _USE_MPI
+#include <mpi.h>
+#endif
 
 using namespace ALM_NS;
 
@@ -30,18 +34,58 @@ void Error::warn(const char *file, const char *message)
 
 void Error::exit(const char *file, const char *message)
 {
-    std::cout << " ERROR in " << file << "  MESSAGE: " << message << std::endl;
-    std::exit(EXIT_FAILURE);
+    std::ostringstream ss;
+    ss << " ERROR in " << file << "  MESSAGE: " << message;
+    print_error(ss.str());
+    abort_all();
 }
 
 void Error::exit(const char *file, const char *message, int info)
 {
-    std::cout << " ERROR in " << file << "  MESSAGE: " << message << info << std::endl;
-    std::exit(EXIT_FAILURE);
+    std::ostringstream ss;
+    ss << " ERROR in " << file << "  MESSAGE: " << message << info;
+    print_error(ss.str());
+    abort_all();
 }
 
 void Error::exit(const char *file, const char *message, const char *info)
 {
-    std::cout << " ERROR in " << file << "  MESSAGE: " << message << info << std::endl;
+    std::ostringstream ss;
+    ss << " ERROR in " << file << "  MESSAGE: " << message << info;
+    print_error(ss.str());
+    abort_all();
+}
+
+void Error::print_error(const std::string &message)
+{
+    std::cout << message << std::endl;
+
+#ifdef _USE_MPI
+    // The standard output is silenced on the processes other than the root,
+    // so that their errors are printed to the standard error instead.
+    int mpi_initialized, my_rank = 0;
+    MPI_Initialized(&mpi_initialized);
+    if (mpi_initialized) MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    if (my_rank > 0) {
+        // One write per line, so that the lines of the processes are not mixed.
+        std::ostringstream ss;
+        ss << message << " (MPI process " << my_rank << ")\n";
+        std::cerr << ss.str() << std::flush;
+    }
+#endif
+}
+
+void Error::abort_all()
+{
+    // Terminate all MPI processes, otherwise the others wait forever.
+#ifdef _USE_MPI
+    int mpi_initialized;
+    MPI_Initialized(&mpi_initialized);
+    if (mpi_initialized) {
+        std::cout.flush();
+        std::cerr.flush();
+        MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+    }
+#endif
     std::exit(EXIT_FAILURE);
 }
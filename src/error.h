@@ -25,5 +25,9 @@ namespace ALM_NS
         void warn(const char *, const char *);
         void exit(const char *, const char *, int);
         void exit(const char *, const char *, const char *);
+
+    private:
+        void print_error(const std::string &);
+        void abort_all();
     };
 }
@@ -35,6 +35,8 @@ void Files::init()
 
     file_fcs = job_title + ".fcs";
     file_hes = job_title + ".hessian";
+    file_cvscore = job_title + ".cvscore";
+    file_fcsets = job_title + ".fcsets";
 
     if (alm->mode == "suggest") {
 
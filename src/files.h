@@ -26,7 +26,7 @@ namespace ALM_NS
 
         bool print_hessian;
         std::string job_title;
-        std::string file_fcs, file_hes;
+        std::string file_fcs, file_hes, file_cvscore, file_fcsets;
         std::string file_disp, file_force;
         std::string *file_disp_pattern;
     };
@@ -13,8 +13,12 @@
 #include <cmath>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <chrono>
+#include <climits>
 #include <boost/lexical_cast.hpp>
 #include "fitting.h"
+#include "fitting_kernels.h"
 #include "files.h"
 #include "error.h"
 #include "memory.h"
@@ -27,10 +31,95 @@
 #include "constraint.h"
 #include "mathfunctions.h"
 #include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#define _HAVE_MMAP
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef _USE_MPI
+#include <mpi.h>
+#endif
+#ifdef _USE_EIGEN
+#include <Eigen/Sparse>
+#include <Eigen/SparseQR>
+#endif
+#if defined(__linux__) && defined(_OPENMP)
+#define _HAVE_AFFINITY
+#include <sched.h>
+#endif
 
 
 using namespace ALM_NS;
 
+#ifdef _USE_MPI
+// MPI takes the counts in int. Arrays longer than mpi_chunk elements are
+// communicated in chunks.
+static const long mpi_chunk = 1L << 27;
+
+static void allreduce_sum_in_chunks(double *a, const long n)
+{
+    for (long i = 0; i < n; i += mpi_chunk) {
+        MPI_Allreduce(MPI_IN_PLACE, a + i, static_cast<int>(std::min<long>(mpi_chunk, n - i)),
+                      MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    }
+}
+#endif
+
+// Zero the array a of n elements with the static schedule of OpenMP. On a
+// NUMA machine, the pages are then placed on the nodes of the threads that
+// touch them first instead of all on the node of the master thread.
+static void first_touch(double *a, const size_t n)
+{
+    long i;
+    const long nl = static_cast<long>(n);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (i = 0; i < nl; ++i) a[i] = 0.0;
+}
+
+// Number of nonzero diagonal elements of the upper triangular (or trapezoidal)
+// factor a, relative to the largest one.
+static int rank_from_diagonal(const int n,
+                              const double *a,
+                              const long lda,
+                              const double tolerance)
+{
+    int i, nrank = 0;
+    double diag_max = 0.0;
+
+    for (i = 0; i < n; ++i) diag_max = std::max<double>(diag_max, std::abs(a[i + static_cast<long>(lda) * i]));
+    for (i = 0; i < n; ++i) {
+        if (std::abs(a[i + static_cast<long>(lda) * i]) > tolerance * diag_max) ++nrank;
+    }
+    return nrank;
+}
+
+// Row (in [0, nrow_sketch)) and sign of the k-th nonzero element of the
+// column i of the sparse sign embedding used by SOLVER = SKETCH.
+// The elements are given by the splitmix64 hash of (i, k), so that the
+// embedding is reproducible and does not have to be stored.
+static inline void sparse_sign_element(const unsigned long i,
+                                       const int k,
+                                       const int nnz_col,
+                                       const int nrow_sketch,
+                                       int &irow,
+                                       double &sign)
+{
+    unsigned long long z = (static_cast<unsigned long long>(i) * nnz_col + k + 1)
+        * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    irow = static_cast<int>((z >> 1) % static_cast<unsigned long long>(nrow_sketch));
+    sign = (z & 1ULL) ? 1.0 : -1.0;
+}
+
 
 Fitting::Fitting(ALMCore *alm): Pointers(alm)
 {
@@ -42,11 +131,75 @@ Fitting::~Fitting()
     deallocate_variables();
 }
 
+static void scaled_gram_matrix(const int n,
+                               const double *gmat,
+                               const double *gsub,
+                               const double *dscale,
+                               const bool full,
+                               double *gout)
+{
+    // gout = D (G - G_sub) D from the upper triangle of G and G_sub.
+    // Only the upper triangle of gout is set unless full = true.
+    // G_sub is ignored if nullptr.
+
+    int i, j;
+    double g;
+
+    for (j = 0; j < n; ++j) {
+        for (i = 0; i <= j; ++i) {
+            g = gmat[i + static_cast<long>(j) * n];
+            if (gsub) g -= gsub[i + static_cast<long>(j) * n];
+            gout[i + static_cast<long>(j) * n] = g * dscale[i] * dscale[j];
+            if (full) gout[j + static_cast<long>(i) * n] = gout[i + static_cast<long>(j) * n];
+        }
+    }
+}
+
 void Fitting::set_default_variables()
 {
     params = nullptr;
     u_in = nullptr;
     f_in = nullptr;
+    ndata_capacity = 0;
+    nset = 1;
+    f_in_extra = nullptr;
+    params_set = nullptr;
+    solver = "SVD";
+    nblock = 0;
+    use_sparse = 0;
+    sparse_solver = "LSQR";
+    tol_iter = 1.0e-10;
+    maxiter = 0;
+    warm_start = 0;
+    scratch_dir = "";
+    maxmem = 0.0;
+    cross_validation = 0;
+    cv_minalpha = 1.0e-8;
+    cv_maxalpha = 1.0e-2;
+    cv_nalpha = 20;
+    cv_alpha_opt = 0.0;
+    fit_rank = -1;
+    fit_error = -1.0;
+    lmodel = "LS";
+    l1_alpha = 0.0;
+    l1_ratio = 1.0;
+    hierarchical = 0;
+    precision = "DOUBLE";
+    memlimit = 0.0;
+    selection = "NONE";
+    select_cond = 1.5;
+    parity = 0;
+    pin_threads = 0;
+    online = 0;
+    online_wait = 60.0;
+    threads_pinned = false;
+    nprocs = 1;
+    my_rank = 0;
+    snapshots_distributed = false;
+    rfactor = nullptr;
+    ncol_rfactor = 0;
+    f_square_rfactor = 0.0;
+    matrix_plan = nullptr;
 }
 
 void Fitting::deallocate_variables()
@@ -60,6 +213,18 @@ void Fitting::deallocate_variables()
     if (f_in) {
         deallocate(f_in);
     }
+    if (f_in_extra) {
+        deallocate(f_in_extra);
+    }
+    if (params_set) {
+        deallocate(params_set);
+    }
+    if (matrix_plan) {
+        deallocate(matrix_plan);
+    }
+    if (rfactor) {
+        deallocate(rfactor);
+    }
 }
 
 void Fitting::fitmain()
@@ -74,24 +239,21 @@ void Fitting::fitmain()
     int P = constraint->P;
     int ndata_used = nend - nstart + 1;
 
-    double **u, **f;
-    double **amat, *amat_1D, *fsum;
-    double *fsum_orig;
     double *param_tmp;
 
     int nmulti = symmetry->ntran;
 
-    amat = nullptr;
-    amat_1D = nullptr;
-    fsum = nullptr;
-    fsum_orig = nullptr;
     param_tmp = nullptr;
+    fit_rank = -1;
+    fit_error = -1.0;
 
     alm->timer->start_clock("fitting");
 
     std::cout << " FITTING" << std::endl;
     std::cout << " =======" << std::endl << std::endl;
 
+    if (pin_threads) bind_threads_to_cpus();
+
     std::cout << "  Reference files" << std::endl;
     std::cout << "   Displacement: " << files->file_disp << std::endl;
     std::cout << "   Force       : " << files->file_force << std::endl;
@@ -102,13 +264,9 @@ void Fitting::fitmain()
         << std::endl << std::endl;
 
 
-    if (nmulti > 0) {
-        allocate(u, ndata_used * nmulti, 3 * nat);
-        allocate(f, ndata_used * nmulti, 3 * nat);
-    } else {
+    if (nmulti <= 0) {
         error->exit("fitmain", "nmulti has to be larger than 0.");
     }
-    data_multiplier(u, f, nat, ndata_used, nmulti);
 
     N = 0;
     for (i = 0; i < maxorder; ++i) {
@@ -117,9 +275,9 @@ void Fitting::fitmain()
     std::cout << "  Total Number of Parameters : "
         << N << std::endl << std::endl;
 
-    // Calculate matrix elements for fitting
-
-    M = 3 * natmin * ndata_used * nmulti;
+    long nrow_total = static_cast<long>(3 * natmin) * ndata_used * nmulti;
+    M = static_cast<int>(std::min<long>(nrow_total, INT_MAX));
+    N_new = N;
 
     if (constraint->constraint_algebraic) {
         N_new = 0;
@@ -128,677 +286,5598 @@ void Fitting::fitmain()
         }
         std::cout << "  Total Number of Free Parameters : "
             << N_new << std::endl << std::endl;
+    }
 
-        allocate(amat, M, N_new);
-        allocate(fsum, M);
-        allocate(fsum_orig, M);
-
-        calc_matrix_elements_algebraic_constraint(M, N, N_new, nat, natmin, ndata_used,
-                                                  nmulti, maxorder, u, f, amat, fsum,
-                                                  fsum_orig);
-    } else {
-        allocate(amat, M, N);
-        allocate(fsum, M);
+    build_matrix_element_plan(maxorder, -1, nullptr);
 
-        calc_matrix_elements(M, N, nat, natmin, ndata_used,
-                             nmulti, maxorder, u, f, amat, fsum);
+    // The triangular factor of a previous fit is no longer valid.
+    if (rfactor) {
+        deallocate(rfactor);
+        rfactor = nullptr;
     }
 
-    deallocate(u);
-    deallocate(f);
+    std::string str_kernel;
+    select_matrix_kernel(str_kernel);
+    std::cout << "  SIMD kernel for matrix elements : " << str_kernel << std::endl << std::endl;
 
-    // Execute fitting
+    setup_translation_map(nat, nmulti);
 
     allocate(param_tmp, N);
 
+#ifdef _USE_MPI
+    int mpi_initialized;
+    MPI_Initialized(&mpi_initialized);
+    if (mpi_initialized) {
+        MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+        MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    }
+#endif
 
-    // Fitting with singular value decomposition or QR-Decomposition
+    // Fit to the subset of the snapshots chosen by the D-optimal design.
+    // u_in and f_in are restored after the fitting.
 
-    if (constraint->constraint_algebraic) {
-        fit_algebraic_constraints(N_new, M, amat, fsum, param_tmp,
-                                  fsum_orig, maxorder);
+    double **u_all = u_in;
+    double **f_all = f_in;
 
-    } else if (constraint->exist_constraint) {
-        fit_with_constraints(N, M, P, amat, fsum, param_tmp,
-                             constraint->const_mat,
-                             constraint->const_rhs);
-    } else {
-        fit_without_constraints(N, M, amat, fsum, param_tmp);
-    }
+    if (selection == "DOPT") {
 
+        if (nset > 1 || hierarchical || nprocs > 1) {
+            error->exit("fitmain",
+                        "SELECT = DOPT cannot be combined with multiple force sets, "
+                        "HIERARCHICAL = 1, or MPI.");
+        }
 
-    // Copy force constants to public variable "params"
-    if (params) {
-        deallocate(params);
-    }
-    allocate(params, N);
+        std::vector<int> isel;
 
-    if (constraint->constraint_algebraic) {
+        select_snapshots(constraint->constraint_algebraic ? N_new : N,
+                         nat, natmin, ndata_used, nmulti, maxorder, isel);
+        std::sort(isel.begin(), isel.end());
 
-        for (i = 0; i < N; ++i) {
-            params[i] = param_tmp[i];
+        allocate(u_in, isel.size(), 3 * nat);
+        allocate(f_in, isel.size(), 3 * nat);
+        snapshots_selected.clear();
+        for (size_t is = 0; is < isel.size(); ++is) {
+            for (int j = 0; j < 3 * nat; ++j) {
+                u_in[is][j] = u_all[isel[is]][j];
+                f_in[is][j] = f_all[isel[is]][j];
+            }
+            snapshots_selected.push_back(nstart + isel[is]);
         }
-        deallocate(fsum_orig);
+        ndata_used = isel.size();
+        nrow_total = static_cast<long>(3 * natmin) * ndata_used * nmulti;
+        M = static_cast<int>(std::min<long>(nrow_total, INT_MAX));
+    }
 
-    } else {
+    // SOLVER of this fit. MEMLIMIT may replace it, while the SOLVER given by
+    // the user is kept for the later fits and the output.
 
-        for (i = 0; i < N; ++i) params[i] = param_tmp[i];
+    std::string solver_fit = solver;
 
-    }
+    if (memlimit > 0.0 && (solver == "SVD" || solver == "SVD_DC" || solver == "QRP"
+                           || solver == "SKETCH" || solver == "AUTO")
+        && cross_validation == 0 && !hierarchical && lmodel == "LS" && !use_sparse
+        && scratch_dir.empty() && precision == "DOUBLE" && nset == 1) {
 
-    if (amat) {
-        deallocate(amat);
-    }
+        // Switch to a solver that does not store the matrix if the in-core
+        // fitting does not fit in MEMLIMIT.
 
-    if (fsum) {
-        deallocate(fsum);
+        const std::string solver_mem
+            = select_solver_for_memory(nrow_total, constraint->constraint_algebraic ? N_new : N, natmin);
+        if (solver_mem != solver) {
+            std::cout << "  The in-core fitting exceeds MEMLIMIT = " << memlimit
+                << " MB. SOLVER = " << solver_mem << " is used instead." << std::endl << std::endl;
+            solver_fit = solver_mem;
+        }
     }
 
-    if (param_tmp) {
-        deallocate(param_tmp);
-    }
+    // LAPACK takes the dimensions in int. The number of rows may exceed it
+    // only in the streaming modes, which never form the whole matrix, and
+    // in the out-of-core mode, which folds the panels into the (N+1)^2 factor.
 
-    std::cout << std::endl;
-    alm->timer->print_elapsed();
-    std::cout << " -------------------------------------------------------------------" << std::endl;
-    std::cout << std::endl;
+    if (nrow_total > INT_MAX && solver_fit != "TSQR" && solver_fit != "CHOLESKY" && !use_out_of_core()) {
+        error->exit("fitmain",
+                    "The number of rows of the design matrix exceeds 2^31 - 1. "
+                    "Use SOLVER = TSQR or CHOLESKY, or SCRATCH.");
+    }
 
-    alm->timer->stop_clock("fitting");
-}
+    if (nprocs > 1 && ((solver_fit != "TSQR" && solver_fit != "CHOLESKY") || nset > 1
+        || cross_validation > 0 || lmodel != "LS" || hierarchical || use_sparse)) {
+        error->exit("fitmain",
+                    "With more than one MPI process, SOLVER must be TSQR or CHOLESKY.");
+    }
 
-void Fitting::set_displacement_and_force(const double * const *disp_in,
-                                         const double * const *force_in,
-                                         const int nat,
-                                         const int ndata_used)
-{
-    if (u_in) {
-        deallocate(u_in);
+    if (nprocs > ndata_used) {
+        error->exit("fitmain",
+                    "The number of MPI processes exceeds the number of snapshots: ", ndata_used);
     }
-    allocate(u_in, ndata_used, 3 * nat);
 
-    if (f_in) {
-        deallocate(f_in);
+    if (nset > 1 && (cross_validation > 0 || lmodel != "LS" || hierarchical || use_sparse
+        || solver_fit != "SVD" || !scratch_dir.empty())) {
+        error->exit("fitmain",
+                    "Multiple force sets are supported only by the direct fitting with SOLVER = SVD.");
     }
-    allocate(f_in, ndata_used, 3 * nat);
 
-    for (int i = 0; i < ndata_used; i++) {
-        for (int j = 0; j < 3 * nat; j++) {
-            u_in[i][j] = disp_in[i][j];
-            f_in[i][j] = force_in[i][j];
-        }
+    if ((cross_validation > 0 || lmodel == "ENET")
+        && constraint->exist_constraint && !constraint->constraint_algebraic) {
+        error->exit("fitmain", "CV > 0 or LMODEL = ENET supports ICONST = 0 or ICONST >= 10 only.");
     }
-}
 
-void Fitting::fit_without_constraints(int N,
-                                      int M,
-                                      double **amat,
-                                      double *bvec,
-                                      double *param_out)
-{
-    int i, j;
-    unsigned long k;
-    int nrhs = 1, nrank, INFO, LWORK;
-    int LMIN, LMAX;
-    double rcond = -1.0;
-    double f_square = 0.0;
-    double *WORK, *S, *amat_mod, *fsum2;
+    if (cross_validation > 0) {
 
-    std::cout << "  Entering fitting routine: SVD without constraints" << std::endl;
+        // Ridge regression or elastic net with the parameter chosen by the cross validation
 
-    LMIN = std::min<int>(M, N);
-    LMAX = std::max<int>(M, N);
+        fit_cross_validation(N, N_new, nat, natmin, ndata_used,
+                             nmulti, maxorder, param_tmp);
 
-    LWORK = 3 * LMIN + std::max<int>(2 * LMIN, LMAX);
-    LWORK = 2 * LWORK;
+    } else if (hierarchical) {
 
-    allocate(WORK, LWORK);
-    allocate(S, LMIN);
+        if (constraint->exist_constraint && !constraint->constraint_algebraic) {
+            error->exit("fitmain", "HIERARCHICAL = 1 supports ICONST = 0 or ICONST >= 10 only.");
+        }
 
-    // transpose matrix A
-    allocate(amat_mod, M * N);
-    allocate(fsum2, LMAX);
+        fit_order_by_order(N, N_new, nat, natmin, nmulti, maxorder, param_tmp);
 
-    k = 0;
-    for (j = 0; j < N; ++j) {
-        for (i = 0; i < M; ++i) {
-            amat_mod[k++] = amat[i][j];
-        }
-    }
-    for (i = 0; i < M; ++i) {
-        fsum2[i] = bvec[i];
-        f_square += std::pow(bvec[i], 2);
-    }
-    for (i = M; i < LMAX; ++i) fsum2[i] = 0.0;
+    } else if (lmodel == "ENET") {
 
-    std::cout << "  SVD has started ... ";
+        fit_elastic_net(N, N_new, nat, natmin, ndata_used,
+                        nmulti, maxorder, param_tmp);
 
-    // Fitting with singular value decomposition
-    dgelss_(&M, &N, &nrhs, amat_mod, &M, fsum2, &LMAX,
-            S, &rcond, &nrank, WORK, &LWORK, &INFO);
+    } else if (use_sparse) {
 
-    std::cout << "finished !" << std::endl << std::endl;
+        if (solver_fit != "SVD") {
+            error->exit("fitmain", "SPARSE = 1 cannot be combined with SOLVER = ", solver_fit.c_str());
+        }
+        if (constraint->exist_constraint && !constraint->constraint_algebraic) {
+            error->exit("fitmain",
+                        "SPARSE = 1 supports ICONST = 0 or ICONST >= 10 only.");
+        }
 
-    std::cout << "  RANK of the matrix = " << nrank << std::endl;
-    if (nrank < N)
-        error->warn("fit_without_constraints",
-                    "Matrix is rank-deficient. Force constants could not be determined uniquely :(");
+        fit_sparse(N, N_new, nat, natmin, ndata_used,
+                   nmulti, maxorder, param_tmp);
 
-    if (nrank == N) {
-        double f_residual = 0.0;
-        for (i = N; i < M; ++i) {
-            f_residual += std::pow(fsum2[i], 2);
+    } else if (solver_fit == "LSQR" || solver_fit == "CGLS") {
+
+        // Matrix-free mode: only the displacements are kept in memory.
+
+        if (constraint->exist_constraint && !constraint->constraint_algebraic) {
+            error->exit("fitmain",
+                        "SOLVER = LSQR or CGLS supports ICONST = 0 or ICONST >= 10 only.");
         }
-        std::cout << std::endl << "  Residual sum of squares for the solution: "
-            << sqrt(f_residual) << std::endl;
-        std::cout << "  Fitting error (%) : "
-            << sqrt(f_residual / f_square) * 100.0 << std::endl;
-    }
 
-    for (i = 0; i < N; ++i) {
-        param_out[i] = fsum2[i];
-    }
+        fit_matrix_free(N, N_new, nat, natmin, ndata_used,
+                        nmulti, maxorder, param_tmp, solver_fit);
 
-    deallocate(WORK);
-    deallocate(S);
-    deallocate(fsum2);
-    deallocate(amat_mod);
-}
+    } else if (solver_fit == "TSQR") {
 
-void Fitting::fit_with_constraints(int N,
-                                   int M,
-                                   int P,
-                                   double **amat,
-                                   double *bvec,
-                                   double *param_out,
-                                   double **cmat,
-                                   double *dvec)
-{
-    int i, j;
-    unsigned long k;
-    int nrank;
-    double f_square, f_residual;
-    double *fsum2;
-    double *mat_tmp;
+        // Tall-skinny QR: the M x N matrix is never stored in memory.
 
-    std::cout << "  Entering fitting routine: QRD with constraints" << std::endl;
+        fit_tsqr(N, N_new, nat, natmin, ndata_used,
+                 nmulti, maxorder, param_tmp);
 
-    allocate(fsum2, M);
-    allocate(mat_tmp, (M + P) * N);
+    } else if (solver_fit == "CHOLESKY") {
 
-    k = 0;
+        // Streaming mode: the M x N matrix is never stored in memory.
 
-    for (j = 0; j < N; ++j) {
-        for (i = 0; i < M; ++i) {
-            mat_tmp[k++] = amat[i][j];
-        }
-        for (i = 0; i < P; ++i) {
-            mat_tmp[k++] = cmat[i][j];
-        }
-    }
+        fit_normal_equation(N, N_new, nat, natmin, ndata_used,
+                            nmulti, maxorder, param_tmp);
 
-    nrank = rankQRD((M + P), N, mat_tmp, eps12);
-    deallocate(mat_tmp);
+    } else if (!scratch_dir.empty()) {
 
-    if (nrank != N) {
-        std::cout << std::endl;
-        std::cout << " **************************************************************************" << std::endl;
-        std::cout << "  WARNING : rank deficient.                                                " << std::endl;
-        std::cout << "  rank ( (A) ) ! = N            A: Fitting matrix     B: Constraint matrix " << std::endl;
-        std::cout << "       ( (B) )                  N: The number of parameters                " << std::endl;
-        std::cout << "  rank = " << nrank << " N = " << N << std::endl << std::endl;
-        std::cout << "  This can cause a difficulty in solving the fitting problem properly      " << std::endl;
-        std::cout << "  with DGGLSE, especially when the difference is large. Please check if    " << std::endl;
-        std::cout << "  you obtain reliable force constants in the .fcs file.                    " << std::endl << std::endl;
-        std::cout << "  You may need to reduce the cutoff radii and/or increase NDATA            " << std::endl;
-        std::cout << "  by giving linearly-independent displacement patterns.                    " << std::endl;
-        std::cout << " **************************************************************************" << std::endl;
-        std::cout << std::endl;
-    }
+        // Out-of-core mode: the matrix is placed in a scratch file.
 
-    f_square = 0.0;
-    for (i = 0; i < M; ++i) {
-        fsum2[i] = bvec[i];
-        f_square += std::pow(bvec[i], 2);
-    }
-    std::cout << "  QR-Decomposition has started ...";
+        fit_out_of_core(N, N_new, nat, natmin, ndata_used,
+                        nmulti, maxorder, param_tmp);
 
-    double *amat_mod, *cmat_mod;
-    allocate(amat_mod, M * N);
-    allocate(cmat_mod, P * N);
+    } else if (precision == "MIXED") {
 
-    // transpose matrix A and C
-    k = 0;
-    for (j = 0; j < N; ++j) {
-        for (i = 0; i < M; ++i) {
-            amat_mod[k++] = amat[i][j];
-        }
-    }
-    k = 0;
-    for (j = 0; j < N; ++j) {
-        for (i = 0; i < P; ++i) {
-            cmat_mod[k++] = cmat[i][j];
+        // The matrix is stored and factorized in single precision.
+
+        if (constraint->exist_constraint && !constraint->constraint_algebraic) {
+            error->exit("fitmain",
+                        "PRECISION = MIXED supports ICONST = 0 or ICONST >= 10 only.");
         }
-    }
 
-    // Fitting
+        fit_mixed_precision(N, N_new, nat, natmin, ndata_used,
+                            nmulti, maxorder, param_tmp);
 
-    int LWORK = P + std::min<int>(M, N) + 10 * std::max<int>(M, N);
-    int INFO;
-    double *WORK, *x;
-    allocate(WORK, LWORK);
-    allocate(x, N);
+    } else if (maxorder == 1 && nset == 1
+               && fit_harmonic_direct(N, N_new, nat, natmin, ndata_used,
+                                      nmulti, param_tmp)) {
 
-    dgglse_(&M, &N, &P, amat_mod, &M, cmat_mod, &P,
-            fsum2, dvec, x, WORK, &LWORK, &INFO);
+        // Harmonic terms from the single-atom displacements of MODE = suggest
 
-    std::cout << " finished. " << std::endl;
+    } else if (parity && nset == 1
+               && fit_parity_split(N, N_new, nat, natmin, ndata_used,
+                                   nmulti, maxorder, param_tmp)) {
 
-    f_residual = 0.0;
-    for (i = N - P; i < M; ++i) {
-        f_residual += std::pow(fsum2[i], 2);
-    }
-    std::cout << std::endl << "  Residual sum of squares for the solution: "
-        << sqrt(f_residual) << std::endl;
-    std::cout << "  Fitting error (%) : "
-        << std::sqrt(f_residual / f_square) * 100.0 << std::endl;
+        // The data are pairs of +u and -u, and the problem is split by the parity.
 
-    // copy fcs to bvec
+    } else {
 
-    for (i = 0; i < N; ++i) {
-        param_out[i] = x[i];
-    }
+        if (parity && nset == 1) {
+            std::cout << "  PARITY = 1 is ignored since the data are not pairs of +u and -u" << std::endl;
+            std::cout << "  or the constraints relate the terms of different parities." << std::endl << std::endl;
+        }
 
-    deallocate(amat_mod);
-    deallocate(cmat_mod);
-    deallocate(WORK);
-    deallocate(x);
-    deallocate(fsum2);
-}
+        if (solver_fit != "SVD" && constraint->exist_constraint && !constraint->constraint_algebraic) {
+            error->exit("fitmain",
+                        "SOLVER = SVD_DC, QRP, SKETCH, or AUTO supports ICONST = 0 or ICONST >= 10 only.");
+        }
 
-void Fitting::fit_algebraic_constraints(int N,
-                                        int M,
-                                        double **amat,
-                                        double *bvec,
-                                        double *param_out,
-                                        double *bvec_orig,
-                                        const int maxorder)
-{
-    int i, j;
-    unsigned long k;
-    int nrhs = 1, nrank, INFO, LWORK;
-    int LMIN, LMAX;
-    double rcond = -1.0;
-    double f_square = 0.0;
-    double *WORK, *S, *amat_mod, *fsum2;
+        // Calculate matrix elements for fitting
 
-    std::cout << "  Entering fitting routine: SVD with constraints considered algebraically." << std::endl;
+        DesignMatrix dmat;
 
-    LMIN = std::min<int>(M, N);
-    LMAX = std::max<int>(M, N);
+        std::cout << "  Calculation of matrix elements for direct fitting started ... ";
 
-    LWORK = 3 * LMIN + std::max<int>(2 * LMIN, LMAX);
-    LWORK = 2 * LWORK;
+        if (constraint->constraint_algebraic) {
+            dmat.resize(M, N_new);
+            calc_matrix_elements(N_new, nat, natmin, 0, ndata_used,
+                                 nmulti, maxorder, dmat);
+        } else {
+            dmat.resize(M, N);
+            calc_matrix_elements(N, nat, natmin, 0, ndata_used,
+                                 nmulti, maxorder, dmat);
+        }
 
-    allocate(WORK, LWORK);
-    allocate(S, LMIN);
+        std::cout << "done!" << std::endl << std::endl;
 
-    // transpose matrix A
-    allocate(amat_mod, M * N);
-    allocate(fsum2, LMAX);
+        // Execute fitting
 
-    k = 0;
-    for (j = 0; j < N; ++j) {
-        for (i = 0; i < M; ++i) {
-            amat_mod[k++] = amat[i][j];
-        }
-    }
-    for (i = 0; i < M; ++i) {
-        fsum2[i] = bvec[i];
-        f_square += std::pow(bvec_orig[i], 2);
-    }
-    for (i = M; i < LMAX; ++i) fsum2[i] = 0.0;
+        // Fitting with singular value decomposition or QR-Decomposition
 
-    std::cout << "  SVD has started ... ";
+        if (nset > 1) {
+            if (params_set) {
+                deallocate(params_set);
+            }
+            allocate(params_set, nset, N);
 
-    // Fitting with singular value decomposition
-    dgelss_(&M, &N, &nrhs, amat_mod, &M, fsum2, &LMAX,
-            S, &rcond, &nrank, WORK, &LWORK, &INFO);
+            fit_multiple_force_sets(N, (constraint->constraint_algebraic ? N_new : N),
+                                    M, nat, natmin, ndata_used, nmulti, maxorder,
+                                    dmat, params_set);
 
-    std::cout << "finished !" << std::endl << std::endl;
+            for (i = 0; i < N; ++i) param_tmp[i] = params_set[0][i];
 
-    std::cout << "  RANK of the matrix = " << nrank << std::endl;
-    if (nrank < N)
-        error->warn("fit_without_constraints",
-                    "Matrix is rank-deficient. Force constants could not be determined uniquely :(");
+        } else if (constraint->constraint_algebraic) {
+            fit_algebraic_constraints(N_new, M, dmat, param_tmp, maxorder,
+                                      resolve_dense_solver(dmat));
 
-    if (nrank == N) {
-        double f_residual = 0.0;
-        for (i = N; i < M; ++i) {
-            f_residual += std::pow(fsum2[i], 2);
+        } else if (constraint->exist_constraint) {
+            fit_with_constraints(N, M, P, dmat, param_tmp,
+                                 constraint->const_mat,
+                                 constraint->const_rhs);
+        } else {
+            fit_without_constraints(N, M, dmat, param_tmp, resolve_dense_solver(dmat));
         }
-        std::cout << std::endl;
-        std::cout << "  Residual sum of squares for the solution: "
-            << sqrt(f_residual) << std::endl;
-        std::cout << "  Fitting error (%) : "
-            << sqrt(f_residual / f_square) * 100.0 << std::endl;
     }
 
-    int ishift = 0;
-    int iparam = 0;
-    double tmp;
-    int inew, iold;
+    if (selection == "DOPT") {
+        deallocate(u_in);
+        deallocate(f_in);
+        u_in = u_all;
+        f_in = f_all;
 
-    for (i = 0; i < maxorder; ++i) {
-        for (j = 0; j < constraint->const_fix[i].size(); ++j) {
-            param_out[constraint->const_fix[i][j].p_index_target + ishift]
-                = constraint->const_fix[i][j].val_to_fix;
+        // The triangular factor of the subset is not valid for appending data.
+        if (rfactor) {
+            deallocate(rfactor);
+            rfactor = nullptr;
         }
+    }
 
-        for (boost::bimap<int, int>::const_iterator it = constraint->index_bimap[i].begin();
-             it != constraint->index_bimap[i].end(); ++it) {
-            inew = (*it).left + iparam;
-            iold = (*it).right + ishift;
-
-            param_out[iold] = fsum2[inew];
+    // Copy force constants to public variable "params"
+    if (params) {
+        deallocate(params);
+    }
+    allocate(params, N);
+
+    for (i = 0; i < N; ++i) params[i] = param_tmp[i];
+
+    if (param_tmp) {
+        deallocate(param_tmp);
+    }
+
+    std::cout << std::endl;
+    alm->timer->print_elapsed();
+    std::cout << " -------------------------------------------------------------------" << std::endl;
+    std::cout << std::endl;
+
+    alm->timer->stop_clock("fitting");
+}
+
+void Fitting::plan()
+{
+    // Dry run of fitmain. The size of the problem, the memory of each stage,
+    // and the estimated time of the fitting are reported without reading the
+    // displacement-force data. The time is estimated from the rates of the
+    // matrix-element kernel and of DGEMM measured on this machine.
+
+    int i, order;
+    int nat = system->nat;
+    int natmin = symmetry->nat_prim;
+    int ndata_used = system->nend - system->nstart + 1;
+    int nmulti = symmetry->ntran;
+    int maxorder = interaction->maxorder;
+    int N, N_new, ncol, ncycle;
+    long M;
+    int nthreads = 1;
+    int nsnap, nrow_s;
+    double mem_stage[5];
+    double mem_setup, mem_fit, time_fit;
+    double time_chunk, time_build, time_gemm, flop_rate;
+    double dM, dN;
+    double *abuf, *bbuf;
+    double **u_save, **f_save, **u_dummy, **f_dummy;
+    std::vector<std::string> methods;
+    std::string solver_fit;
+
+    const bool algebraic = constraint->constraint_algebraic;
+    const bool constrained = constraint->exist_constraint && !algebraic;
+
+    std::cout << " PLAN" << std::endl;
+    std::cout << " ====" << std::endl << std::endl;
+
+    if (ndata_used <= 0) {
+        error->exit("plan", "NDATA must be given to plan the fitting.");
+    }
+
+#ifdef _OPENMP
+    nthreads = omp_get_max_threads();
+#endif
+
+    N = 0;
+    N_new = 0;
+    for (order = 0; order < maxorder; ++order) {
+        N += fcs->nequiv[order].size();
+        if (algebraic) N_new += constraint->index_bimap[order].size();
+    }
+    ncol = algebraic ? N_new : N;
+    ncycle = ndata_used * nmulti;
+    M = static_cast<long>(3 * natmin) * ncycle;
+    dM = static_cast<double>(M);
+    dN = static_cast<double>(ncol);
+
+    std::cout << "  Number of parameters:" << std::endl;
+    std::cout << "       Order   Irreducible          Free     FC table" << std::endl;
+    for (order = 0; order < maxorder; ++order) {
+        std::cout << "   " << std::setw(9) << interaction->str_order[order]
+            << std::setw(14) << fcs->nequiv[order].size()
+            << std::setw(14) << (algebraic ? constraint->index_bimap[order].size()
+                                           : fcs->nequiv[order].size())
+            << std::setw(13) << fcs->fc_table[order].size() << std::endl;
+    }
+    std::cout << std::endl;
+
+    if (constrained) {
+        std::cout << "  Number of constraints (P) : " << constraint->P << std::endl;
+    } else if (algebraic) {
+        std::cout << "  Number of algebraic constraints (fixed, related):" << std::endl;
+        for (order = 0; order < maxorder; ++order) {
+            std::cout << "   " << std::setw(9) << interaction->str_order[order]
+                << std::setw(14) << constraint->const_fix[order].size()
+                << std::setw(14) << constraint->const_relate[order].size() << std::endl;
+        }
+    } else {
+        std::cout << "  No constraints are imposed." << std::endl;
+    }
+    std::cout << std::endl;
+
+    std::cout << "  NDATA used = " << ndata_used << "; translations = " << nmulti << std::endl;
+    std::cout << "  Size of the design matrix : M = " << M << ", N = " << ncol << std::endl;
+    if (M > INT_MAX) {
+        std::cout << "  M exceeds 2^31 - 1. Use SOLVER = TSQR or CHOLESKY, or SCRATCH." << std::endl;
+    }
+    std::cout << std::endl;
+
+    build_matrix_element_plan(maxorder, -1, nullptr);
+    setup_translation_map(nat, nmulti);
+
+    // Memory of the setup stages
+
+    mem_setup = setup_memory(mem_stage);
+
+    std::cout << "  Memory of the setup stages (MB):" << std::endl;
+    std::cout << "   distall, mindist_pairs  : " << std::setw(12) << mem_stage[0] * 1.0e-6 << std::endl;
+    std::cout << "   fc_table                : " << std::setw(12) << mem_stage[1] * 1.0e-6 << std::endl;
+    std::cout << "   const_mat / constraints : " << std::setw(12) << mem_stage[2] * 1.0e-6 << std::endl;
+    std::cout << "   matrix_plan             : " << std::setw(12) << mem_stage[3] * 1.0e-6 << std::endl;
+    std::cout << "   u_in, f_in              : " << std::setw(12) << mem_stage[4] * 1.0e-6 << std::endl;
+    std::cout << std::endl;
+
+    if (!constrained && M <= INT_MAX) {
+        const double mem_amat = (dM * dN + 2.0 * std::max<double>(dM, dN)) * sizeof(double);
+        std::cout << "  Memory of the in-core fitting (MB):" << std::endl;
+        std::cout << "   amat, bvec              : " << std::setw(12) << mem_amat * 1.0e-6 << std::endl;
+        std::cout << "   LAPACK work (DGELSS)    : " << std::setw(12)
+            << lapack_workspace("SVD", static_cast<int>(M), ncol) * 1.0e-6 << std::endl;
+        std::cout << std::endl;
+    }
+
+    // Calibration of the matrix-element kernel with dummy snapshots
+
+    nsnap = std::min<int>(nsnap_chunk, ncycle);
+    if (3.0 * natmin * nsnap * dN * sizeof(double) > 2.56e+8) nsnap = 1;
+    nrow_s = 3 * natmin * nsnap;
+
+    u_save = u_in;
+    f_save = f_in;
+    allocate(u_dummy, nsnap, 3 * nat);
+    allocate(f_dummy, nsnap, 3 * nat);
+    for (i = 0; i < nsnap * 3 * nat; ++i) {
+        u_dummy[0][i] = 0.01 * std::sin(static_cast<double>(i + 1));
+        f_dummy[0][i] = 0.0;
+    }
+    u_in = u_dummy;
+    f_in = f_dummy;
+
+    allocate(abuf, static_cast<long>(nrow_s) * ncol);
+    allocate(bbuf, nrow_s);
+
+    std::chrono::steady_clock::time_point t_start = std::chrono::steady_clock::now();
+    calc_matrix_elements_chunk(ncol, nat, natmin, maxorder, 0, nsnap,
+                               abuf, nrow_s, bbuf, nullptr);
+    time_chunk = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+
+    deallocate(abuf);
+    deallocate(bbuf);
+    deallocate(u_dummy);
+    deallocate(f_dummy);
+    u_in = u_save;
+    f_in = f_save;
+
+    time_build = time_chunk * static_cast<double>(ncycle) / nsnap / nthreads;
+
+    // Calibration of the floating-point rate with DGEMM
+
+    {
+        int n = 400;
+        double one = 1.0, zero = 0.0;
+        double *amat, *bmat, *cmat;
+
+        allocate(amat, n * n);
+        allocate(bmat, n * n);
+        allocate(cmat, n * n);
+        for (i = 0; i < n * n; ++i) {
+            amat[i] = std::sin(static_cast<double>(i));
+            bmat[i] = std::cos(static_cast<double>(i));
+        }
+        t_start = std::chrono::steady_clock::now();
+        dgemm_("N", "N", &n, &n, &n, &one, amat, &n, bmat, &n, &zero, cmat, &n);
+        time_gemm = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+        flop_rate = 2.0 * n * n * n / std::max<double>(time_gemm, 1.0e-9);
+
+        deallocate(amat);
+        deallocate(bmat);
+        deallocate(cmat);
+    }
+
+    std::cout << "  Calibrated rates: matrix elements " << std::setw(12)
+        << static_cast<double>(nsnap) / std::max<double>(time_chunk, 1.0e-9)
+        << " snapshots/sec per thread, DGEMM " << flop_rate * 1.0e-9 << " GFLOPS" << std::endl;
+    std::cout << "  Estimated time to build the design matrix : "
+        << time_build << " sec." << std::endl << std::endl;
+
+    // Memory and time of the solvers
+
+    if (constrained) {
+        methods = {"SVD", "TSQR", "CHOLESKY", "SCRATCH"};
+    } else {
+        methods = {"SVD", "SVD_DC", "QRP", "SKETCH", "TSQR", "CHOLESKY", "SCRATCH", "LSQR"};
+    }
+
+    std::cout << "  Estimated memory and time of the fitting:" << std::endl;
+    std::cout << "   Solver       Memory (MB)     Time (sec)" << std::endl;
+
+    for (auto it = methods.begin(); it != methods.end(); ++it) {
+
+        if (M > INT_MAX && *it != "TSQR" && *it != "CHOLESKY" && *it != "SCRATCH") {
+            std::cout << "   " << std::setw(10) << std::left << *it << std::right
+                << "   not possible for M > 2^31 - 1" << std::endl;
+            continue;
+        }
+
+        mem_fit = fitting_memory(*it, M, ncol, natmin);
+
+        if (*it == "SVD" && constrained) {
+            time_fit = time_build + 2.0 * dM * dN * dN / flop_rate;
+        } else if (*it == "SVD") {
+            time_fit = time_build + (2.0 * dM * dN * dN + 12.0 * dN * dN * dN) / flop_rate;
+        } else if (*it == "SVD_DC") {
+            time_fit = time_build + (2.0 * dM * dN * dN + 8.0 * dN * dN * dN) / flop_rate;
+        } else if (*it == "QRP") {
+            // DGEQP3 is half BLAS-2.
+            time_fit = time_build + 4.0 * dM * dN * dN / flop_rate;
+        } else if (*it == "SKETCH") {
+            // QR of the 4N x N sketch, and about 30 iterations of the two
+            // memory-bound products with A, assumed at a tenth of the DGEMM rate.
+            time_fit = time_build + 8.0 * dN * dN * dN / flop_rate
+                + (16.0 + 30.0 * 4.0) * dM * dN / (0.1 * flop_rate);
+        } else if (*it == "TSQR" || *it == "SCRATCH") {
+            time_fit = time_build + 2.0 * dM * dN * dN / flop_rate;
+        } else if (*it == "CHOLESKY") {
+            time_fit = time_build + (dM * dN * dN + dN * dN * dN / 3.0) / flop_rate;
+        } else {
+            // Two matrix-free products per iteration
+            time_fit = 2.0 * time_build;
+        }
+
+        std::cout << "   " << std::setw(10) << std::left << *it << std::right
+            << std::setw(14) << (mem_setup + mem_fit) * 1.0e-6
+            << std::setw(15) << time_fit
+            << (*it == "LSQR" ? "  per iteration" : "")
+            << (*it == "SCRATCH" ? "  + I/O of the scratch file" : "") << std::endl;
+    }
+    std::cout << std::endl;
+
+    // The scratch file holds the whole (A b).
+
+    std::cout << "  Size of the scratch file of SCRATCH (MB) : "
+        << dM * (dN + 1.0) * sizeof(double) * 1.0e-6 << std::endl << std::endl;
+
+    // Same choice as fitmain: SCRATCH takes precedence over MEMLIMIT, and
+    // M > 2^31 - 1 stops the in-core solvers.
+
+    if (use_out_of_core()) {
+        solver_fit = "SCRATCH";
+    } else {
+        solver_fit = select_solver_for_memory(M, ncol, natmin);
+    }
+
+    if (solver_fit == "SCRATCH") {
+        std::cout << "  SOLVER for the fitting : TSQR out of core (SCRATCH = "
+            << scratch_dir << ")" << std::endl;
+    } else {
+        std::cout << "  SOLVER for the fitting : " << solver_fit << std::endl;
+    }
+    if (M > INT_MAX && solver_fit != "TSQR" && solver_fit != "CHOLESKY" && solver_fit != "SCRATCH") {
+        std::cout << "  The fitting will stop since M exceeds 2^31 - 1. "
+            "Use SOLVER = TSQR or CHOLESKY, or SCRATCH." << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+
+double Fitting::setup_memory(double *mem_stage) const
+{
+    // Bytes held before fitmain starts to allocate the design matrix.
+    // If mem_stage is given, it receives the bytes of the distance tables,
+    // the FC table, the constraints, the matrix plan, and the
+    // displacement-force data.
+
+    int i, order;
+    const int nat = system->nat;
+    const int maxorder = interaction->maxorder;
+    double mem[5] = {0.0, 0.0, 0.0, 0.0, 0.0};
+
+    for (i = 0; i < nat * nat; ++i) {
+        mem[0] += (interaction->distall[i / nat][i % nat].size()
+                   + interaction->mindist_pairs[i / nat][i % nat].size()) * sizeof(DistInfo)
+            + 2 * sizeof(std::vector<DistInfo>);
+    }
+    for (order = 0; order < maxorder; ++order) {
+        mem[1] += static_cast<double>(fcs->fc_table[order].size())
+            * (sizeof(FcProperty) + (order + 2) * sizeof(int));
+    }
+    if (constraint->exist_constraint && !constraint->constraint_algebraic) {
+        int N = 0;
+        for (order = 0; order < maxorder; ++order) N += fcs->nequiv[order].size();
+        mem[2] = static_cast<double>(constraint->P) * (N + 1) * sizeof(double);
+    } else if (constraint->constraint_algebraic) {
+        for (order = 0; order < maxorder; ++order) {
+            mem[2] += constraint->const_fix[order].size() * sizeof(ConstraintTypeFix);
+            for (auto it = constraint->const_relate[order].begin();
+                 it != constraint->const_relate[order].end(); ++it) {
+                mem[2] += sizeof(ConstraintTypeRelate)
+                    + (*it).alpha.size() * (sizeof(double) + sizeof(unsigned int));
+            }
+        }
+    }
+    if (matrix_plan) {
+        for (order = 0; order < maxorder; ++order) {
+            mem[3] += static_cast<double>(matrix_plan[order].row.size())
+                * (2 * sizeof(int) + sizeof(double) + matrix_plan[order].nelem * sizeof(int));
+        }
+    }
+    mem[4] = 2.0 * system->ndata * 3 * nat * sizeof(double);
+
+    if (mem_stage) {
+        for (i = 0; i < 5; ++i) mem_stage[i] = mem[i];
+    }
+
+    return mem[0] + mem[1] + mem[2] + mem[3] + mem[4];
+}
+
+
+double Fitting::fitting_memory(const std::string method,
+                               const long M,
+                               const int ncol,
+                               const int natmin) const
+{
+    // Bytes allocated by the fitting with the given solver for the M x ncol
+    // design matrix, including the LAPACK workspace.
+
+    int nthreads = 1;
+    const int nc1 = ncol + 1;
+    const double dM = static_cast<double>(M);
+    const double dN = static_cast<double>(ncol);
+    const double mem_chunk = 3.0 * natmin * nsnap_chunk * (dN + 2.0) * sizeof(double);
+    double mem;
+
+#ifdef _OPENMP
+    nthreads = omp_get_max_threads();
+#endif
+
+    if (method == "TSQR") {
+        const int ncycle = static_cast<int>(M / (3 * natmin));
+        const int nsnap_panel = snapshots_per_panel(nc1, natmin, ncycle);
+        const int nfactor = std::min<int>(nthreads, (ncycle + nsnap_panel - 1) / nsnap_panel);
+        const double nrow_panel = 3.0 * natmin * nsnap_panel;
+        mem = (nfactor + 2.0) * nc1 * nc1 * sizeof(double)
+            + nfactor * nrow_panel * (nc1 + 1.0) * sizeof(double);
+    } else if (method == "SCRATCH") {
+        // One panel of the scratch file is resident at a time, and it is
+        // folded into the nc1 x nc1 factor by DTPQRT.
+        const int ncycle = static_cast<int>(M / (3 * natmin));
+        const double nrow_panel = 3.0 * natmin * snapshots_per_panel(nc1, natmin, ncycle);
+        const double nb = std::min<int>(nc1, 64);
+        mem = 2.0 * nc1 * nc1 * sizeof(double)
+            + nrow_panel * (nc1 + 1.0) * sizeof(double)
+            + 2.0 * nb * nc1 * sizeof(double);
+    } else if (method == "CHOLESKY") {
+        const int nat = system->nat;
+        const int ndata_block = (nblock > 0) ? nblock : std::max<int>(1, ncol / (3 * nat));
+        const double nrow_block = std::min<double>(dM, 3.0 * natmin * ndata_block * symmetry->ntran);
+        mem = 2.0 * dN * dN * sizeof(double) + nrow_block * (dN + 2.0) * sizeof(double);
+    } else if (method == "LSQR" || method == "CGLS") {
+        mem = (3.0 * dM + 6.0 * dN) * sizeof(double) + nthreads * mem_chunk;
+    } else if (method == "SKETCH") {
+        const double nrow_s = std::min<double>(dM, 4.0 * dN);
+        mem = (dM * dN + 2.0 * std::max<double>(dM, dN)) * sizeof(double)
+            + nrow_s * (dN + 1.0) * sizeof(double)
+            + (3.0 * dM + 8.0 * dN) * sizeof(double);
+    } else if (method == "MIXED") {
+        mem = dM * dN * sizeof(float) + dN * dN * sizeof(double)
+            + 4.0 * dM * sizeof(double) + nthreads * mem_chunk;
+    } else {
+        // LAPACK cannot take M > 2^31 - 1. The matrix alone is reported then.
+        mem = (dM * dN + 2.0 * std::max<double>(dM, dN)) * sizeof(double);
+        if (M <= INT_MAX) mem += lapack_workspace(method, static_cast<int>(M), ncol);
+    }
+
+    return mem;
+}
+
+
+double Fitting::lapack_workspace(const std::string method,
+                                 const int M,
+                                 const int N) const
+{
+    // Bytes of the workspace of the in-core solver obtained by the
+    // workspace query of LAPACK. The matrix is not referenced by the query.
+
+    int m = M, n = N, nrhs = 1, nrank, INFO;
+    int LWORK = -1;
+    int lmin = std::min<int>(M, N);
+    int lmax = std::max<int>(M, N);
+    int iwork_query = 0;
+    double rcond = -1.0;
+    double work_query = 0.0, work_query2 = 0.0;
+    double dummy[1];
+    int idummy[1];
+
+    if (M == 0 || N == 0) return 0.0;
+
+    if (method == "SVD_DC") {
+        dgelsd_(&m, &n, &nrhs, dummy, &m, dummy, &lmax, dummy, &rcond, &nrank,
+                &work_query, &LWORK, &iwork_query, &INFO);
+        return work_query * sizeof(double) + iwork_query * sizeof(int)
+            + lmin * sizeof(double);
+    } else if (method == "QRP") {
+        dgeqp3_(&m, &n, dummy, &m, idummy, dummy, &work_query, &LWORK, &INFO);
+        dormqr_("L", "T", &m, &nrhs, &lmin, dummy, &m, dummy, dummy, &m,
+                &work_query2, &LWORK, &INFO);
+        return std::max<double>(work_query, work_query2) * sizeof(double)
+            + lmin * sizeof(double) + N * sizeof(int);
+    } else if (constraint->exist_constraint && !constraint->constraint_algebraic) {
+        int P = constraint->P;
+        dgglse_(&m, &n, &P, dummy, &m, dummy, &P, dummy, dummy, dummy,
+                &work_query, &LWORK, &INFO);
+        return (work_query + static_cast<double>(P) * N + N) * sizeof(double);
+    } else {
+        dgelss_(&m, &n, &nrhs, dummy, &m, dummy, &lmax, dummy, &rcond, &nrank,
+                &work_query, &LWORK, &INFO);
+        return (work_query + lmin) * sizeof(double);
+    }
+}
+
+
+std::string Fitting::select_solver_for_memory(const long M,
+                                              const int ncol,
+                                              const int natmin)
+{
+    // Keep the in-core solver if the whole job fits in MEMLIMIT. Otherwise,
+    // return the first of TSQR, CHOLESKY, and LSQR that fits, where the
+    // matrix is never stored. Without MEMLIMIT, the current SOLVER is kept.
+
+    const bool constrained = constraint->exist_constraint && !constraint->constraint_algebraic;
+    const double mem_setup = setup_memory(nullptr);
+    const double mem_limit = memlimit * 1.0e+6;
+    std::vector<std::string> methods;
+    std::string method_min;
+    double mem, mem_min = -1.0;
+
+    if (memlimit <= 0.0) return solver;
+
+    // Only the streaming solvers can take more than 2^31 - 1 rows.
+
+    const std::string solver_incore = (solver == "AUTO") ? "SVD" : solver;
+    if (M <= INT_MAX) methods.push_back(solver_incore);
+    methods.push_back("TSQR");
+    methods.push_back("CHOLESKY");
+    if (!constrained && M <= INT_MAX) methods.push_back("LSQR");
+
+    for (auto it = methods.begin(); it != methods.end(); ++it) {
+        mem = mem_setup + fitting_memory(*it, M, ncol, natmin);
+        if (mem <= mem_limit) {
+            return (*it == solver_incore) ? solver : *it;
+        }
+        if (mem_min < 0.0 || mem < mem_min) {
+            mem_min = mem;
+            method_min = *it;
+        }
+    }
+
+    error->warn("select_solver_for_memory",
+                "No solver fits in MEMLIMIT. The one with the least memory is chosen.");
+    return method_min;
+}
+
+
+bool Fitting::use_out_of_core() const
+{
+    // True if fitmain places the design matrix in the scratch file, i.e.,
+    // SCRATCH is given and no mode that precedes it in fitmain is chosen.
+
+    return !scratch_dir.empty() && cross_validation == 0 && !hierarchical
+        && lmodel != "ENET" && !use_sparse && solver != "LSQR" && solver != "CGLS"
+        && solver != "TSQR" && solver != "CHOLESKY";
+}
+
+
+void Fitting::snapshot_block(const int ndata_used,
+                             const int nprocs_in,
+                             const int rank,
+                             int &idata_begin,
+                             int &idata_end)
+{
+    // Contiguous block idata_begin .. idata_end-1 of the snapshots
+    // assigned to the MPI process rank of nprocs_in.
+
+    idata_begin = static_cast<int>(static_cast<long>(ndata_used) * rank / nprocs_in);
+    idata_end = static_cast<int>(static_cast<long>(ndata_used) * (rank + 1) / nprocs_in);
+}
+
+
+void Fitting::set_displacement_and_force(const double * const *disp_in,
+                                         const double * const *force_in,
+                                         const int nat,
+                                         const int ndata_used)
+{
+    if (u_in) {
+        deallocate(u_in);
+    }
+    allocate(u_in, ndata_used, 3 * nat);
+
+    if (f_in) {
+        deallocate(f_in);
+    }
+    allocate(f_in, ndata_used, 3 * nat);
+    ndata_capacity = ndata_used;
+    snapshots_distributed = false;
+
+    // The snapshots are copied with the static schedule, so that each one is
+    // first touched by the thread that computes its matrix elements.
+
+    if (pin_threads) bind_threads_to_cpus();
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (int i = 0; i < ndata_used; i++) {
+        for (int j = 0; j < 3 * nat; j++) {
+            u_in[i][j] = disp_in[i][j];
+            f_in[i][j] = force_in[i][j];
+        }
+    }
+
+    // Additional force sets are given by set_extra_force_sets afterwards.
+    set_extra_force_sets(nullptr, nat, ndata_used, 0);
+}
+
+void Fitting::set_extra_force_sets(const double * const *force_in,
+                                   const int nat,
+                                   const int ndata_used,
+                                   const int nset_extra)
+{
+    // Force sets 2 .. nset_extra+1 for the displacements given by
+    // set_displacement_and_force. force_in[iset * ndata_used + idata][3 * iat + j]
+    // is the force of the set iset + 2. They are fitted together with f_in
+    // as the multiple r.h.s. vectors of one factorization.
+
+    if (f_in_extra) {
+        deallocate(f_in_extra);
+        f_in_extra = nullptr;
+    }
+    nset = nset_extra + 1;
+    if (nset_extra == 0) return;
+
+    allocate(f_in_extra, nset_extra * ndata_used, 3 * nat);
+
+    for (int i = 0; i < nset_extra * ndata_used; i++) {
+        for (int j = 0; j < 3 * nat; j++) {
+            f_in_extra[i][j] = force_in[i][j];
+        }
+    }
+}
+
+
+void Fitting::append_displacement_and_force(const double * const *disp_in,
+                                            const double * const *force_in,
+                                            const int nat,
+                                            const int ndata_add)
+{
+    // Update the force constants of the previous fitmain() with additional
+    // snapshots. The triangular factor of (A b) of the data fitted so far is
+    // kept, and the rows of the new snapshots are folded into it by the QR
+    // update, so that the cost is proportional to the amount of new data.
+    // The factor is built from the stored data at the first call.
+
+    int i;
+    int ncol, nc1, nrank;
+    int ndata_old;
+    const int natmin = symmetry->nat_prim;
+    const int nmulti = symmetry->ntran;
+    const int maxorder = interaction->maxorder;
+    int N, N_new;
+    double f_residual;
+    double *param_new;
+    double **u_tmp, **f_tmp;
+
+    if (!params || !matrix_plan) {
+        error->exit("append_displacement_and_force",
+                    "Force constants must be fitted once before appending data.");
+    }
+    if (nat != system->nat) {
+        error->exit("append_displacement_and_force",
+                    "The number of atoms is not consistent with the previous fit.");
+    }
+    if (nset > 1) {
+        error->exit("append_displacement_and_force",
+                    "Appending data is not supported for multiple force sets.");
+    }
+    if (lmodel != "LS" || cross_validation > 0 || hierarchical || selection != "NONE") {
+        error->exit("append_displacement_and_force",
+                    "Appending data supports the plain least-squares fitting only. "
+                    "It cannot follow LMODEL = ENET, CV > 0, HIERARCHICAL = 1, or SELECT = DOPT.");
+    }
+    if (nprocs > 1 || snapshots_distributed) {
+        // Each process holds only its block of the snapshots, and its own
+        // copy of the factor would diverge from those of the others.
+        error->exit("append_displacement_and_force",
+                    "Appending data is not supported with more than one MPI process.");
+    }
+
+    N = 0;
+    for (i = 0; i < maxorder; ++i) N += fcs->nequiv[i].size();
+    N_new = N;
+    if (constraint->constraint_algebraic) {
+        N_new = 0;
+        for (i = 0; i < maxorder; ++i) N_new += constraint->index_bimap[i].size();
+    }
+    ncol = constraint->constraint_algebraic ? N_new : N;
+    nc1 = ncol + 1;
+
+    ndata_old = system->nend - system->nstart + 1;
+
+    std::cout << " INCREMENTAL FITTING" << std::endl;
+    std::cout << " ===================" << std::endl << std::endl;
+    std::cout << "  " << ndata_add << " entries are appended to " << ndata_old
+        << " entries." << std::endl << std::endl;
+
+    if (!rfactor || ncol_rfactor != ncol) {
+        if (rfactor) deallocate(rfactor);
+        allocate(rfactor, static_cast<long>(nc1) * nc1);
+        std::fill(rfactor, rfactor + static_cast<long>(nc1) * nc1, 0.0);
+        ncol_rfactor = ncol;
+        f_square_rfactor = 0.0;
+        update_triangular_factor(ncol, nat, natmin, 0, ndata_old * nmulti,
+                                 rfactor, f_square_rfactor);
+    }
+
+    // Append the new data to u_in and f_in. Their capacity is doubled when
+    // exceeded, so that the stored data are copied only O(log ndata) times
+    // when snapshots are appended in small batches.
+
+    if (ndata_old + ndata_add > ndata_capacity) {
+        const int ncapacity = std::max(ndata_old + ndata_add, 2 * ndata_capacity);
+        allocate(u_tmp, ncapacity, 3 * nat);
+        allocate(f_tmp, ncapacity, 3 * nat);
+        for (i = 0; i < ndata_old; ++i) {
+            std::copy(u_in[i], u_in[i] + 3 * nat, u_tmp[i]);
+            std::copy(f_in[i], f_in[i] + 3 * nat, f_tmp[i]);
+        }
+        deallocate(u_in);
+        deallocate(f_in);
+        u_in = u_tmp;
+        f_in = f_tmp;
+        ndata_capacity = ncapacity;
+    }
+    for (i = 0; i < ndata_add; ++i) {
+        std::copy(disp_in[i], disp_in[i] + 3 * nat, u_in[ndata_old + i]);
+        std::copy(force_in[i], force_in[i] + 3 * nat, f_in[ndata_old + i]);
+    }
+
+    system->ndata += ndata_add;
+    system->nend += ndata_add;
+
+    update_triangular_factor(ncol, nat, natmin, ndata_old * nmulti, ndata_add * nmulti,
+                             rfactor, f_square_rfactor);
+
+    allocate(param_new, ncol);
+
+    nrank = solve_triangular_factor(ncol, rfactor, nc1, param_new, f_residual);
+
+    fit_rank = nrank;
+    std::cout << "  RANK of the matrix = " << nrank << std::endl;
+    if (nrank < ncol)
+        error->warn("append_displacement_and_force",
+                    "Matrix is rank-deficient. Force constants could not be determined uniquely :(");
+
+    std::cout << std::endl << "  Residual sum of squares for the solution: "
+        << std::sqrt(f_residual) << std::endl;
+    fit_error = std::sqrt(f_residual / f_square_rfactor) * 100.0;
+    std::cout << "  Fitting error (%) : "
+        << fit_error << std::endl << std::endl;
+
+    if (constraint->constraint_algebraic) {
+        recover_original_forceconstants(maxorder, param_new, params);
+    } else {
+        for (i = 0; i < N; ++i) params[i] = param_new[i];
+    }
+
+    deallocate(param_new);
+}
+
+
+void Fitting::select_snapshots(const int ncol,
+                               const int nat,
+                               const int natmin,
+                               const int ndata_used,
+                               const int nmulti,
+                               const int maxorder,
+                               std::vector<int> &selected)
+{
+    // Greedy selection of the snapshots, each of which is a data entry
+    // together with its pure translations, based on the D-optimal design.
+    // In the coordinates where the information matrix G = A^T A of all the
+    // data is the identity, i.e., B_s = A_s W with W = V L^{-1/2} for
+    // G = V L V^T, the snapshot s maximizing
+    //   log det(I + B_s G_S^{-1} B_s^T) - r log(1 + |B_s|^2 / tr G_S)
+    // is added to the subset S, where G_S = eps I + sum_{s in S} B_s^T B_s
+    // and r is the rank of A. This is the gain of log det G_S - r log(tr G_S / r),
+    // which measures how close G_S is to a multiple of the identity, so that
+    // the snapshots adding information in the directions already covered
+    // (e.g., near duplicates) are not preferred.
+    // The selection stops when the condition number of G_S - eps I is at most
+    // SELECT_COND^2. Since A_S = B_S W^{-1}, the condition number of the design
+    // matrix of the subset is then at most SELECT_COND times that of all the
+    // data. The log det term never increases as S grows, which allows the
+    // lazy update of the gains.
+    // The leverage |B_s|^2 of each snapshot is reported as well. The leverages
+    // sum up to r. The indices of the data in u_in are returned.
+
+    int i, j, idata, ibest;
+    int n = ncol, nrank, LWORK, INFO;
+    int nrow_s = 3 * natmin * nmulti;
+    double one = 1.0, zero = 0.0;
+    double work_query, score, score_best, score_next, trace_sel;
+    double *gmat, *eval, *wmat, *WORK;
+    double *block, *bvec_b, *bmat, *bwork, *gsel, *usel, *gtest;
+    double cond_sel = 0.0;
+    std::vector<double> leverage(ndata_used), logdet_gain(ndata_used), gain_sel;
+    std::vector<int> stamp(ndata_used, 0);
+    std::vector<bool> is_selected(ndata_used, false);
+
+    const double eps_reg = eps6;
+
+    std::cout << "  Selection of the snapshots by the D-optimal design ..." << std::endl;
+
+    // G = A^T A accumulated over the snapshots
+
+    allocate(gmat, static_cast<long>(n) * n);
+    std::fill(gmat, gmat + static_cast<long>(n) * n, 0.0);
+
+#ifdef _OPENMP
+#pragma omp parallel private(i)
+#endif
+    {
+        double *block_t, *bvec_t, *gthread;
+
+        allocate(block_t, static_cast<long>(nrow_s) * n);
+        allocate(bvec_t, nrow_s);
+        allocate(gthread, static_cast<long>(n) * n);
+        std::fill(gthread, gthread + static_cast<long>(n) * n, 0.0);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (idata = 0; idata < ndata_used; ++idata) {
+            calc_matrix_elements_chunk(ncol, nat, natmin, maxorder, idata * nmulti, nmulti,
+                                       block_t, nrow_s, bvec_t, nullptr);
+            dsyrk_("U", "T", &n, &nrow_s, &one, block_t, &nrow_s, &one, gthread, &n);
+        }
+
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+        for (long k = 0; k < static_cast<long>(n) * n; ++k) gmat[k] += gthread[k];
+
+        deallocate(block_t);
+        deallocate(bvec_t);
+        deallocate(gthread);
+    }
+
+    // W = V L^{-1/2} on the nonzero eigenvalues
+
+    allocate(eval, n);
+    LWORK = -1;
+    dsyev_("V", "U", &n, gmat, &n, eval, &work_query, &LWORK, &INFO);
+    LWORK = static_cast<int>(work_query);
+    allocate(WORK, LWORK);
+    dsyev_("V", "U", &n, gmat, &n, eval, WORK, &LWORK, &INFO);
+    deallocate(WORK);
+
+    if (INFO != 0) {
+        error->exit("select_snapshots", "DSYEV failed. INFO = ", INFO);
+    }
+
+    nrank = 0;
+    for (i = 0; i < n; ++i) {
+        if (eval[i] > eps12 * eval[n - 1]) ++nrank;
+    }
+
+    if (nrank == 0) {
+        deallocate(gmat);
+        deallocate(eval);
+        error->warn("select_snapshots", "The design matrix is zero. All the snapshots are used.");
+        selected.clear();
+        for (idata = 0; idata < ndata_used; ++idata) selected.push_back(idata);
+        return;
+    }
+
+    allocate(wmat, static_cast<long>(n) * nrank);
+    for (j = 0; j < nrank; ++j) {
+        const int jeig = n - nrank + j;
+        for (i = 0; i < n; ++i) {
+            wmat[i + static_cast<long>(n) * j] = gmat[i + static_cast<long>(n) * jeig] / std::sqrt(eval[jeig]);
+        }
+    }
+    deallocate(gmat);
+
+    // Leverages and the gains for the empty subset, G_S = eps I
+
+    allocate(usel, static_cast<long>(nrank) * nrank);
+    std::fill(usel, usel + static_cast<long>(nrank) * nrank, 0.0);
+    for (i = 0; i < nrank; ++i) usel[i + static_cast<long>(nrank) * i] = std::sqrt(eps_reg);
+
+#ifdef _OPENMP
+#pragma omp parallel private(i)
+#endif
+    {
+        double *block_t, *bvec_t, *bmat_t;
+
+        allocate(block_t, static_cast<long>(nrow_s) * n);
+        allocate(bvec_t, nrow_s);
+        allocate(bmat_t, static_cast<long>(nrow_s) * nrank);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (idata = 0; idata < ndata_used; ++idata) {
+            calc_matrix_elements_chunk(ncol, nat, natmin, maxorder, idata * nmulti, nmulti,
+                                       block_t, nrow_s, bvec_t, nullptr);
+            dgemm_("N", "N", &nrow_s, &nrank, &n, &one, block_t, &nrow_s,
+                   wmat, &n, &zero, bmat_t, &nrow_s);
+            leverage[idata] = 0.0;
+            for (i = 0; i < nrow_s * nrank; ++i) leverage[idata] += bmat_t[i] * bmat_t[i];
+            logdet_gain[idata] = information_gain(nrow_s, nrank, bmat_t, usel);
+        }
+
+        deallocate(block_t);
+        deallocate(bvec_t);
+        deallocate(bmat_t);
+    }
+
+    // Lazy greedy selection. logdet_gain of a snapshot is an upper bound of
+    // the current one, and it is exact when it has been evaluated for the
+    // current subset (stamp == size of the subset).
+
+    allocate(block, static_cast<long>(nrow_s) * n);
+    allocate(bvec_b, nrow_s);
+    allocate(bmat, static_cast<long>(nrow_s) * nrank);
+    allocate(bwork, static_cast<long>(nrow_s) * nrank);
+    allocate(gsel, static_cast<long>(nrank) * nrank);
+    allocate(gtest, static_cast<long>(nrank) * nrank);
+    std::fill(gsel, gsel + static_cast<long>(nrank) * nrank, 0.0);
+    for (i = 0; i < nrank; ++i) gsel[i + static_cast<long>(nrank) * i] = eps_reg;
+    trace_sel = nrank * eps_reg;
+
+    selected.clear();
+
+    while (static_cast<int>(selected.size()) < ndata_used) {
+
+        // The best and the second best bounds of the score
+
+        ibest = -1;
+        score_best = 0.0;
+        score_next = 0.0;
+        for (idata = 0; idata < ndata_used; ++idata) {
+            if (is_selected[idata]) continue;
+            score = logdet_gain[idata] - nrank * std::log(1.0 + leverage[idata] / trace_sel);
+            if (ibest < 0 || score > score_best) {
+                score_next = score_best;
+                ibest = idata;
+                score_best = score;
+            } else if (score > score_next) {
+                score_next = score;
+            }
+        }
+        idata = ibest;
+
+        calc_matrix_elements_chunk(ncol, nat, natmin, maxorder, idata * nmulti, nmulti,
+                                   block, nrow_s, bvec_b, nullptr);
+        dgemm_("N", "N", &nrow_s, &nrank, &n, &one, block, &nrow_s,
+               wmat, &n, &zero, bmat, &nrow_s);
+
+        if (stamp[idata] != static_cast<int>(selected.size())) {
+            stamp[idata] = selected.size();
+            std::copy(bmat, bmat + static_cast<long>(nrow_s) * nrank, bwork);
+            logdet_gain[idata] = information_gain(nrow_s, nrank, bwork, usel);
+            score_best = logdet_gain[idata]
+                - nrank * std::log(1.0 + leverage[idata] / trace_sel);
+            if (static_cast<int>(selected.size()) + 1 < ndata_used && score_best < score_next) continue;
+        }
+
+        selected.push_back(idata);
+        is_selected[idata] = true;
+        gain_sel.push_back(score_best);
+        trace_sel += leverage[idata];
+
+        // G_S += B_s^T B_s and its Cholesky factor
+
+        dsyrk_("U", "T", &nrank, &nrow_s, &one, bmat, &nrow_s, &one, gsel, &nrank);
+        std::copy(gsel, gsel + static_cast<long>(nrank) * nrank, usel);
+        dpotrf_("U", &nrank, usel, &nrank, &INFO);
+
+        // Condition number of G_S - eps I
+
+        std::copy(gsel, gsel + static_cast<long>(nrank) * nrank, gtest);
+        for (i = 0; i < nrank; ++i) gtest[i + static_cast<long>(nrank) * i] -= eps_reg;
+        LWORK = -1;
+        dsyev_("N", "U", &nrank, gtest, &nrank, eval, &work_query, &LWORK, &INFO);
+        LWORK = static_cast<int>(work_query);
+        allocate(WORK, LWORK);
+        dsyev_("N", "U", &nrank, gtest, &nrank, eval, WORK, &LWORK, &INFO);
+        deallocate(WORK);
+
+        if (eval[0] > eps12 * eval[nrank - 1]) {
+            cond_sel = std::sqrt(eval[nrank - 1] / eval[0]);
+            if (cond_sel <= select_cond) break;
+        }
+    }
+
+    deallocate(block);
+    deallocate(bvec_b);
+    deallocate(bmat);
+    deallocate(bwork);
+    deallocate(gsel);
+    deallocate(gtest);
+    deallocate(usel);
+    deallocate(wmat);
+    deallocate(eval);
+
+    std::cout << "  Rank of the design matrix : " << nrank << std::endl;
+    std::cout << "  Condition number relative to all the data : " << cond_sel
+        << " (SELECT_COND = " << select_cond << ")" << std::endl << std::endl;
+    std::cout << "  Selected snapshots in the order of selection:" << std::endl;
+    std::cout << "     #    Data      Leverage      Gain" << std::endl;
+    for (i = 0; i < static_cast<int>(selected.size()); ++i) {
+        std::cout << "  " << std::setw(4) << i + 1
+            << std::setw(8) << system->nstart + selected[i]
+            << std::setw(14) << leverage[selected[i]]
+            << std::setw(10) << gain_sel[i] << std::endl;
+    }
+    std::cout << std::endl;
+    std::cout << "  " << selected.size() << " of " << ndata_used
+        << " entries are selected for fitting." << std::endl << std::endl;
+}
+
+
+double Fitting::information_gain(const int nrow,
+                                 const int nrank,
+                                 double *bmat,
+                                 const double *umat) const
+{
+    // log det(I + B G^{-1} B^T) for G = U^T U, where B is nrow x nrank and
+    // overwritten by B U^{-1}. The determinant is evaluated in the smaller
+    // of the two equivalent forms I + X X^T and I + X^T X.
+
+    int i, m = nrow, n = nrank, nmin, INFO;
+    double one = 1.0;
+    double *cmat;
+    double logdet = 0.0;
+
+    dtrsm_("R", "U", "N", "N", &m, &n, &one, const_cast<double *>(umat), &n, bmat, &m);
+
+    nmin = std::min<int>(m, n);
+    allocate(cmat, static_cast<long>(nmin) * nmin);
+    std::fill(cmat, cmat + static_cast<long>(nmin) * nmin, 0.0);
+    for (i = 0; i < nmin; ++i) cmat[i + static_cast<long>(nmin) * i] = 1.0;
+
+    if (m <= n) {
+        dsyrk_("U", "N", &m, &n, &one, bmat, &m, &one, cmat, &nmin);
+    } else {
+        dsyrk_("U", "T", &n, &m, &one, bmat, &m, &one, cmat, &nmin);
+    }
+    dpotrf_("U", &nmin, cmat, &nmin, &INFO);
+
+    for (i = 0; i < nmin; ++i) logdet += 2.0 * std::log(cmat[i + static_cast<long>(nmin) * i]);
+
+    deallocate(cmat);
+
+    return logdet;
+}
+
+
+void Fitting::fit_multiple_force_sets(const int N,
+                                      int ncol,
+                                      const int M,
+                                      const int nat,
+                                      const int natmin,
+                                      const int ndata_used,
+                                      const int nmulti,
+                                      const int maxorder,
+                                      DesignMatrix &dmat,
+                                      double **param_out)
+{
+    // Least-squares fitting of the nset force sets sharing the displacements.
+    // The design matrix depends only on the displacements and is factorized
+    // once by DGELSS with nset r.h.s. vectors.
+    // With the constraints of ICONST = 1, C x = d is eliminated by the
+    // null-space method, which is equivalent to DGGLSE but allows
+    // multiple r.h.s. vectors:
+    //   C^T = Q (R; 0),  x = Q_1 R^{-T} d + Q_2 y,
+    //   min |A Q_2 y - (b - A Q_1 R^{-T} d)|.
+    // dmat.amat is overwritten.
+
+    int i, j, iset;
+    int ichunk, nchunk, ncycle;
+    int m, nfree, ldb, nrank, INFO, LWORK;
+    int inc = 1;
+    double one = 1.0, zero = 0.0;
+    double rcond = -1.0, work_query;
+    double *bmat, *S, *WORK, *xmat;
+    double *cmat, *tau, *qmat, *x0, *ax0, *aq;
+    std::vector<double> f_square(nset, 0.0), f_residual(nset, 0.0);
+
+    const bool algebraic = constraint->constraint_algebraic;
+    const bool with_constraint = constraint->exist_constraint && !algebraic;
+    int P = with_constraint ? constraint->P : 0;
+
+    std::cout << "  Entering fitting routine: SVD for " << nset << " force sets";
+    if (with_constraint) {
+        std::cout << " with constraints eliminated by QR" << std::endl;
+    } else if (algebraic) {
+        std::cout << " with constraints considered algebraically" << std::endl;
+    } else {
+        std::cout << " without constraints" << std::endl;
+    }
+
+    m = M;
+    nfree = ncol - P;
+    ldb = std::max<int>(M, ncol);
+
+    // R.h.s. vectors. The contribution of the fixed parameters,
+    // bvec - bvec_orig, is common to all the sets.
+
+    allocate(bmat, static_cast<long>(ldb) * nset);
+
+    ncycle = ndata_used * nmulti;
+    nchunk = (ncycle + nsnap_chunk - 1) / nsnap_chunk;
+
+    for (iset = 0; iset < nset; ++iset) {
+        double *bcol = bmat + static_cast<long>(iset) * ldb;
+        double **f = (iset == 0) ? f_in : f_in_extra + (iset - 1) * ndata_used;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (ichunk = 0; ichunk < nchunk; ++ichunk) {
+            const int irow0 = ichunk * nsnap_chunk;
+            gather_forces_chunk(nat, natmin, irow0,
+                                std::min<int>(nsnap_chunk, ncycle - irow0),
+                                f, bcol + 3 * natmin * irow0);
+        }
+        for (i = 0; i < M; ++i) {
+            f_square[iset] += bcol[i] * bcol[i];
+            bcol[i] += dmat.bvec[i] - dmat.bvec_orig[i];
+        }
+        for (i = M; i < ldb; ++i) bcol[i] = 0.0;
+    }
+
+    if (with_constraint) {
+
+        allocate(cmat, static_cast<long>(ncol) * P);
+        allocate(tau, P);
+        allocate(qmat, static_cast<long>(ncol) * ncol);
+        allocate(x0, ncol);
+        // ax0 holds R^{-T} d of length P first, and then A x0 of length M.
+        allocate(ax0, std::max<int>(M, P));
+        allocate(aq, static_cast<long>(M) * std::max<int>(nfree, 1));
+
+        for (j = 0; j < P; ++j) {
+            for (i = 0; i < ncol; ++i) {
+                cmat[i + static_cast<long>(j) * ncol] = constraint->const_mat[j][i];
+            }
+        }
+
+        LWORK = -1;
+        dgeqrf_(&ncol, &P, cmat, &ncol, tau, &work_query, &LWORK, &INFO);
+        LWORK = std::max<int>(static_cast<int>(work_query), ncol) * 2;
+        allocate(WORK, LWORK);
+
+        dgeqrf_(&ncol, &P, cmat, &ncol, tau, WORK, &LWORK, &INFO);
+        if (INFO != 0) {
+            error->exit("fit_multiple_force_sets", "DGEQRF failed with INFO = ", INFO);
+        }
+
+        std::copy(cmat, cmat + static_cast<long>(ncol) * P, qmat);
+        dorgqr_(&ncol, &ncol, &P, qmat, &ncol, tau, WORK, &LWORK, &INFO);
+        if (INFO != 0) {
+            error->exit("fit_multiple_force_sets", "DORGQR failed with INFO = ", INFO);
+        }
+        deallocate(WORK);
+
+        // x0 = Q_1 R^{-T} d
+
+        for (i = 0; i < P; ++i) ax0[i] = constraint->const_rhs[i];
+        dtrtrs_("U", "T", "N", &P, &inc, cmat, &ncol, ax0, &P, &INFO);
+        if (INFO != 0) {
+            error->exit("fit_multiple_force_sets",
+                        "The constraint matrix is singular. INFO = ", INFO);
+        }
+        dgemv_("N", &ncol, &P, &one, qmat, &ncol, ax0, &inc, &zero, x0, &inc);
+
+        // b <- b - A x0, A <- A Q_2
+
+        dgemv_("N", &m, &ncol, &one, dmat.amat, &m, x0, &inc, &zero, ax0, &inc);
+        for (iset = 0; iset < nset; ++iset) {
+            for (i = 0; i < M; ++i) bmat[static_cast<long>(iset) * ldb + i] -= ax0[i];
+        }
+        dgemm_("N", "N", &m, &nfree, &ncol, &one, dmat.amat, &m,
+               qmat + static_cast<long>(ncol) * P, &ncol, &zero, aq, &m);
+    } else {
+        aq = dmat.amat;
+    }
+
+    LWORK = -1;
+    allocate(S, std::max<int>(std::min<int>(M, nfree), 1));
+    dgelss_(&m, &nfree, &nset, aq, &m, bmat, &ldb,
+            S, &rcond, &nrank, &work_query, &LWORK, &INFO);
+    LWORK = static_cast<int>(work_query);
+    allocate(WORK, LWORK);
+
+    std::cout << "  SVD has started ... ";
+
+    dgelss_(&m, &nfree, &nset, aq, &m, bmat, &ldb,
+            S, &rcond, &nrank, WORK, &LWORK, &INFO);
+
+    std::cout << "finished !" << std::endl << std::endl;
+
+    fit_rank = nrank;
+    std::cout << "  RANK of the matrix = " << nrank << std::endl;
+    if (nrank < nfree)
+        error->warn("fit_multiple_force_sets",
+                    "Matrix is rank-deficient. Force constants could not be determined uniquely :(");
+
+    allocate(xmat, static_cast<long>(ncol) * nset);
+
+    if (with_constraint) {
+        dgemm_("N", "N", &ncol, &nset, &nfree, &one, qmat + static_cast<long>(ncol) * P, &ncol,
+               bmat, &ldb, &zero, xmat, &ncol);
+        for (iset = 0; iset < nset; ++iset) {
+            for (i = 0; i < ncol; ++i) xmat[iset * ncol + i] += x0[i];
+        }
+    } else {
+        for (iset = 0; iset < nset; ++iset) {
+            for (i = 0; i < ncol; ++i) xmat[iset * ncol + i] = bmat[static_cast<long>(iset) * ldb + i];
+        }
+    }
+
+    if (nrank == nfree) {
+        std::cout << std::endl;
+        std::cout << "   Set    Residual sum of squares    Fitting error (%)" << std::endl;
+        for (iset = 0; iset < nset; ++iset) {
+            for (i = nfree; i < M; ++i) {
+                f_residual[iset] += std::pow(bmat[static_cast<long>(iset) * ldb + i], 2);
+            }
+            if (iset == 0) fit_error = std::sqrt(f_residual[iset] / f_square[iset]) * 100.0;
+            std::cout << std::setw(6) << iset + 1
+                << std::setw(27) << std::sqrt(f_residual[iset])
+                << std::setw(21) << std::sqrt(f_residual[iset] / f_square[iset]) * 100.0
+                << std::endl;
+        }
+    }
+
+    for (iset = 0; iset < nset; ++iset) {
+        if (algebraic) {
+            recover_original_forceconstants(maxorder, xmat + iset * ncol, param_out[iset]);
+        } else {
+            for (i = 0; i < N; ++i) param_out[iset][i] = xmat[iset * ncol + i];
+        }
+    }
+
+    if (with_constraint) {
+        deallocate(cmat);
+        deallocate(tau);
+        deallocate(qmat);
+        deallocate(x0);
+        deallocate(ax0);
+        deallocate(aq);
+    }
+    deallocate(bmat);
+    deallocate(S);
+    deallocate(WORK);
+    deallocate(xmat);
+}
+
+
+void Fitting::fit_without_constraints(int N,
+                                      int M,
+                                      DesignMatrix &dmat,
+                                      double *param_out,
+                                      const std::string method)
+{
+    // The design matrix dmat is overwritten by the solver.
+
+    int i;
+    int nrank;
+    double f_square = 0.0;
+    double f_residual;
+    double *x;
+
+    std::cout << "  Entering fitting routine: " << solver_name(method)
+        << " without constraints" << std::endl;
+
+    for (i = 0; i < M; ++i) {
+        f_square += std::pow(dmat.bvec[i], 2);
+    }
+
+    allocate(x, N);
+
+    std::cout << "  " << solver_name(method) << " has started ... ";
+
+    nrank = solve_least_squares(method, dmat, x, f_residual);
+
+    std::cout << "finished !" << std::endl << std::endl;
+
+    fit_rank = nrank;
+    std::cout << "  RANK of the matrix = " << nrank << std::endl;
+    if (nrank < N)
+        error->warn("fit_without_constraints",
+                    "Matrix is rank-deficient. Force constants could not be determined uniquely :(");
+
+    if (nrank == N) {
+        std::cout << std::endl << "  Residual sum of squares for the solution: "
+            << sqrt(f_residual) << std::endl;
+        fit_error = sqrt(f_residual / f_square) * 100.0;
+        std::cout << "  Fitting error (%) : "
+            << fit_error << std::endl;
+    }
+
+    for (i = 0; i < N; ++i) {
+        param_out[i] = x[i];
+    }
+
+    deallocate(x);
+}
+
+void Fitting::fit_with_constraints(int N,
+                                   int M,
+                                   int P,
+                                   DesignMatrix &dmat,
+                                   double *param_out,
+                                   double **cmat,
+                                   double *dvec)
+{
+    // The design matrix dmat is overwritten by DGGLSE.
+
+    int i, j;
+    unsigned long k;
+    int nrank;
+    double f_square, f_residual;
+    double *cmat_mod;
+    double *x;
+
+    std::cout << "  Entering fitting routine: QRD with constraints" << std::endl;
+
+    f_square = 0.0;
+    for (i = 0; i < M; ++i) {
+        f_square += std::pow(dmat.bvec[i], 2);
+    }
+    std::cout << "  QR-Decomposition has started ...";
+
+    allocate(cmat_mod, static_cast<long>(P) * N);
+
+    // transpose matrix C
+    k = 0;
+    for (j = 0; j < N; ++j) {
+        for (i = 0; i < P; ++i) {
+            cmat_mod[k++] = cmat[i][j];
+        }
+    }
+
+    // Fitting
+
+    allocate(x, N);
+
+    nrank = solve_constrained_least_squares(dmat, P, cmat_mod, dvec, x, f_residual);
+
+    std::cout << " finished. " << std::endl;
+
+    if (nrank != N) {
+        std::cout << std::endl;
+        std::cout << " **************************************************************************" << std::endl;
+        std::cout << "  WARNING : rank deficient.                                                " << std::endl;
+        std::cout << "  rank ( (A) ) ! = N            A: Fitting matrix     B: Constraint matrix " << std::endl;
+        std::cout << "       ( (B) )                  N: The number of parameters                " << std::endl;
+        std::cout << "  rank = " << nrank << " N = " << N << std::endl << std::endl;
+        std::cout << "  This can cause a difficulty in solving the fitting problem properly      " << std::endl;
+        std::cout << "  with DGGLSE, especially when the difference is large. Please check if    " << std::endl;
+        std::cout << "  you obtain reliable force constants in the .fcs file.                    " << std::endl << std::endl;
+        std::cout << "  You may need to reduce the cutoff radii and/or increase NDATA            " << std::endl;
+        std::cout << "  by giving linearly-independent displacement patterns.                    " << std::endl;
+        std::cout << " **************************************************************************" << std::endl;
+        std::cout << std::endl;
+    }
+
+    std::cout << std::endl << "  Residual sum of squares for the solution: "
+        << sqrt(f_residual) << std::endl;
+    fit_error = std::sqrt(f_residual / f_square) * 100.0;
+    std::cout << "  Fitting error (%) : "
+        << fit_error << std::endl;
+
+    // copy fcs to bvec
+
+    for (i = 0; i < N; ++i) {
+        param_out[i] = x[i];
+    }
+
+    deallocate(cmat_mod);
+    deallocate(x);
+}
+
+
+int Fitting::solve_constrained_least_squares(DesignMatrix &dmat,
+                                             int P,
+                                             double *cmat,
+                                             double *dvec,
+                                             double *x,
+                                             double &f_residual)
+{
+    // min |A x - b| subject to C x = d by DGGLSE, where C is P x N in the
+    // column-major layout. dmat, cmat, and dvec are overwritten.
+    // The rank of (A C)^T is estimated from the triangular factors
+    // of the generalized RQ factorization computed in DGGLSE.
+    // Returns the rank and the residual sum of squares in f_residual.
+
+    int i;
+    int M = static_cast<int>(dmat.nrow);
+    int N = dmat.ncol;
+    int nrank;
+    int LWORK = -1;
+    int INFO;
+    double work_query;
+    double *WORK;
+
+    for (i = 0; i < N; ++i) x[i] = 0.0;
+
+    dgglse_(&M, &N, &P, dmat.amat, &M, cmat, &P,
+            dmat.bvec, dvec, x, &work_query, &LWORK, &INFO);
+    LWORK = static_cast<int>(work_query);
+    allocate(WORK, LWORK);
+    first_touch(WORK, LWORK);
+
+    dgglse_(&M, &N, &P, dmat.amat, &M, cmat, &P,
+            dmat.bvec, dvec, x, WORK, &LWORK, &INFO);
+
+    deallocate(WORK);
+
+    // On exit, C(1:P, N-P+1:N) contains the P x P upper triangular matrix R
+    // and A contains the min(M, N-P) x (N-P) upper trapezoidal matrix T.
+
+    nrank = rank_from_diagonal(P, cmat + static_cast<long>(P) * (N - P), P, eps12);
+    if (INFO != 1) {
+        nrank += rank_from_diagonal(std::min<int>(M, N - P), dmat.amat, M, eps12);
+    }
+
+    f_residual = 0.0;
+    for (i = N - P; i < M; ++i) {
+        f_residual += std::pow(dmat.bvec[i], 2);
+    }
+
+    return nrank;
+}
+
+void Fitting::fit_algebraic_constraints(int N,
+                                        int M,
+                                        DesignMatrix &dmat,
+                                        double *param_out,
+                                        const int maxorder,
+                                        const std::string method)
+{
+    // The design matrix dmat is overwritten by the solver.
+
+    int i;
+    int nrank;
+    double f_square = 0.0;
+    double f_residual;
+    double *x;
+
+    std::cout << "  Entering fitting routine: " << solver_name(method)
+        << " with constraints considered algebraically." << std::endl;
+
+    for (i = 0; i < M; ++i) {
+        f_square += std::pow(dmat.bvec_orig[i], 2);
+    }
+
+    allocate(x, N);
+
+    std::cout << "  " << solver_name(method) << " has started ... ";
+
+    nrank = solve_least_squares(method, dmat, x, f_residual);
+
+    std::cout << "finished !" << std::endl << std::endl;
+
+    fit_rank = nrank;
+    std::cout << "  RANK of the matrix = " << nrank << std::endl;
+    if (nrank < N)
+        error->warn("fit_without_constraints",
+                    "Matrix is rank-deficient. Force constants could not be determined uniquely :(");
+
+    if (nrank == N) {
+        std::cout << std::endl;
+        std::cout << "  Residual sum of squares for the solution: "
+            << sqrt(f_residual) << std::endl;
+        fit_error = sqrt(f_residual / f_square) * 100.0;
+        std::cout << "  Fitting error (%) : "
+            << fit_error << std::endl;
+    }
+
+    recover_original_forceconstants(maxorder, x, param_out);
+
+    deallocate(x);
+}
+
+
+int Fitting::solve_least_squares(const std::string method,
+                                 DesignMatrix &dmat,
+                                 double *x,
+                                 double &f_residual)
+{
+    // Least-squares solution x of dmat.amat * x = dmat.bvec by the dense
+    // solver given by method:
+    //   SVD      : singular value decomposition (DGELSS)
+    //   SVD_DC   : divide-and-conquer SVD (DGELSD)
+    //   QRP      : QR decomposition with column pivoting (DGEQP3)
+    //   SKETCH   : LSQR preconditioned by the QR of a random sketch
+    //   CHOLESKY : Cholesky decomposition of the normal equation
+    //   LSQR     : iterative solver
+    // amat and bvec are destroyed except for SKETCH, CHOLESKY, and LSQR.
+    // The workspace of LAPACK is obtained by the workspace query.
+    // Returns the rank, and the residual sum of squares in f_residual,
+    // which is valid when the matrix has full rank.
+
+    int i;
+    int M = static_cast<int>(dmat.nrow);
+    int N = dmat.ncol;
+    int nrhs = 1, nrank, INFO, LWORK;
+    int LMIN = std::min<int>(M, N);
+    int LMAX = std::max<int>(M, N);
+    int inc = 1;
+    double rcond = -1.0;
+    double one = 1.0, zero = 0.0, mone = -1.0;
+    double work_query;
+    double *WORK;
+
+    f_residual = 0.0;
+
+    if (method == "SVD" || method == "SVD_DC") {
+
+        double *S;
+
+        allocate(S, LMIN);
+        for (i = M; i < LMAX; ++i) dmat.bvec[i] = 0.0;
+
+        LWORK = -1;
+        if (method == "SVD") {
+            dgelss_(&M, &N, &nrhs, dmat.amat, &M, dmat.bvec, &LMAX,
+                    S, &rcond, &nrank, &work_query, &LWORK, &INFO);
+            LWORK = static_cast<int>(work_query);
+            allocate(WORK, LWORK);
+            first_touch(WORK, LWORK);
+            dgelss_(&M, &N, &nrhs, dmat.amat, &M, dmat.bvec, &LMAX,
+                    S, &rcond, &nrank, WORK, &LWORK, &INFO);
+        } else {
+            int iwork_query;
+            int *IWORK;
+            dgelsd_(&M, &N, &nrhs, dmat.amat, &M, dmat.bvec, &LMAX,
+                    S, &rcond, &nrank, &work_query, &LWORK, &iwork_query, &INFO);
+            LWORK = static_cast<int>(work_query);
+            allocate(WORK, LWORK);
+            first_touch(WORK, LWORK);
+            allocate(IWORK, std::max<int>(1, iwork_query));
+            dgelsd_(&M, &N, &nrhs, dmat.amat, &M, dmat.bvec, &LMAX,
+                    S, &rcond, &nrank, WORK, &LWORK, IWORK, &INFO);
+            deallocate(IWORK);
+        }
+        deallocate(WORK);
+        deallocate(S);
+
+        if (INFO != 0) {
+            error->exit("solve_least_squares", "SVD did not converge. INFO = ", INFO);
+        }
+
+        for (i = 0; i < N; ++i) x[i] = dmat.bvec[i];
+        for (i = N; i < M; ++i) f_residual += dmat.bvec[i] * dmat.bvec[i];
+
+    } else if (method == "QRP") {
+
+        // A P = Q R, and x = P (R_11^{-1} (Q^T b)_1; 0) with the leading
+        // nrank x nrank block R_11. The residual is |(Q^T b)_2|.
+
+        int lwork_qr;
+        int *JPVT;
+        double *TAU;
+
+        allocate(JPVT, N);
+        allocate(TAU, LMIN);
+        for (i = 0; i < N; ++i) JPVT[i] = 0;
+
+        LWORK = -1;
+        dgeqp3_(&M, &N, dmat.amat, &M, JPVT, TAU, &work_query, &LWORK, &INFO);
+        lwork_qr = static_cast<int>(work_query);
+        dormqr_("L", "T", &M, &nrhs, &LMIN, dmat.amat, &M, TAU, dmat.bvec, &M,
+                &work_query, &LWORK, &INFO);
+        LWORK = std::max<int>(lwork_qr, static_cast<int>(work_query));
+        allocate(WORK, LWORK);
+        first_touch(WORK, LWORK);
+
+        dgeqp3_(&M, &N, dmat.amat, &M, JPVT, TAU, WORK, &LWORK, &INFO);
+        dormqr_("L", "T", &M, &nrhs, &LMIN, dmat.amat, &M, TAU, dmat.bvec, &M,
+                WORK, &LWORK, &INFO);
+
+        nrank = rank_from_diagonal(LMIN, dmat.amat, M, eps12);
+
+        if (nrank > 0) {
+            dtrtrs_("U", "N", "N", &nrank, &nrhs, dmat.amat, &M, dmat.bvec, &M, &INFO);
+        }
+
+        for (i = 0; i < N; ++i) x[i] = 0.0;
+        for (i = 0; i < nrank; ++i) x[JPVT[i] - 1] = dmat.bvec[i];
+        for (i = nrank; i < M; ++i) f_residual += dmat.bvec[i] * dmat.bvec[i];
+
+        deallocate(WORK);
+        deallocate(JPVT);
+        deallocate(TAU);
+
+    } else {
+
+        double *res;
+
+        if (method == "CHOLESKY") {
+
+            double *atamat, *atbvec;
+
+            allocate(atamat, static_cast<long>(N) * N);
+            allocate(atbvec, N);
+
+            dsyrk_("U", "T", &N, &M, &one, dmat.amat, &M, &zero, atamat, &N);
+            dgemv_("T", &M, &N, &one, dmat.amat, &M, dmat.bvec, &inc, &zero, atbvec, &inc);
+
+            nrank = solve_normal_equation(N, atamat, atbvec, x);
+
+            deallocate(atamat);
+            deallocate(atbvec);
+
+        } else if (method == "SKETCH") {
+
+            if (M < N) {
+                error->warn("solve_least_squares",
+                            "SKETCH requires at least as many rows as parameters (M >= N). "
+                            "SVD is used instead.");
+                return solve_least_squares("SVD", dmat, x, f_residual);
+            }
+            if (!solve_sketch_preconditioned(dmat, x)) {
+                error->warn("solve_least_squares",
+                            "The sketched matrix is rank-deficient. SVD is used instead.");
+                return solve_least_squares("SVD", dmat, x, f_residual);
+            }
+            nrank = N;
+
+        } else if (method == "LSQR") {
+
+            const int niter_max = (maxiter > 0) ? maxiter : std::max<int>(1000, 10 * N);
+
+            for (i = 0; i < N; ++i) x[i] = 0.0;
+            if (lsqr(dmat, dmat.bvec, x, tol_iter, niter_max, false) < 0) {
+                error->warn("solve_least_squares",
+                            "LSQR did not converge within the maximum number of iterations.");
+            }
+            nrank = N;
+
+        } else {
+            error->exit("solve_least_squares", "Unknown solver ", method.c_str());
+        }
+
+        // r = b - A x
+
+        allocate(res, M);
+        for (i = 0; i < M; ++i) res[i] = dmat.bvec[i];
+        dgemv_("N", &M, &N, &mone, dmat.amat, &M, x, &inc, &one, res, &inc);
+        for (i = 0; i < M; ++i) f_residual += res[i] * res[i];
+        deallocate(res);
+    }
+
+    return nrank;
+}
+
+
+bool Fitting::solve_sketch_preconditioned(DesignMatrix &dmat,
+                                          double *x)
+{
+    // Sketch-and-precondition solver of Blendenpik and LSRN for M >> N.
+    // The sparse sign embedding S of d = min(M, 4N) rows, with nnz_col
+    // nonzeros of +-1/sqrt(nnz_col) in each column, maps (A b) to (SA Sb)
+    // with O(nnz_col M N) operations. SA = Q R gives the preconditioner R,
+    // for which the condition number of A R^{-1} is O(1) independently of A.
+    // LSQR on A R^{-1} y = b then reaches the accuracy of the direct solvers
+    // in a few tens of iterations, starting from the sketched solution
+    // y0 = (Q^T S b)_1. Returns false when SA is rank-deficient.
+    // M >= N is checked by the caller.
+
+    int i, k;
+    int M = static_cast<int>(dmat.nrow);
+    int N = dmat.ncol;
+    int nrow_s = std::min<int>(M, 4 * N);
+    int nrhs = 1, INFO, LWORK, lwork_qr;
+    int niter;
+    double work_query;
+    double *sketch, *TAU, *WORK, *y;
+
+    const int nnz_col = 8;
+    const double scale = 1.0 / std::sqrt(static_cast<double>(nnz_col));
+    const double tol = std::min<double>(tol_iter, 1.0e-14);
+    const int niter_max = (maxiter > 0) ? maxiter : std::max<int>(1000, 10 * N);
+
+    if (M < N) return false;
+
+    // (SA Sb) of nrow_s x (N + 1). Each thread owns a range of columns and
+    // generates the embedding for the blocks of rows of A.
+
+    allocate(sketch, static_cast<unsigned long>(nrow_s) * (N + 1));
+
+#ifdef _OPENMP
+#pragma omp parallel private(i, k)
+#endif
+    {
+        int ithread = 0, nthreads = 1;
+        int j, ib, istart, nrow_b;
+        const int nrow_block = 512;
+        double *col;
+        const double *acol;
+        std::vector<int> irow(nrow_block * nnz_col);
+        std::vector<double> sign(nrow_block * nnz_col);
+
+#ifdef _OPENMP
+        ithread = omp_get_thread_num();
+        nthreads = omp_get_num_threads();
+#endif
+        const int jstart = static_cast<int>(static_cast<long>(N + 1) * ithread / nthreads);
+        const int jend = static_cast<int>(static_cast<long>(N + 1) * (ithread + 1) / nthreads);
+
+        for (j = jstart; j < jend; ++j) {
+            col = sketch + static_cast<long>(nrow_s) * j;
+            for (i = 0; i < nrow_s; ++i) col[i] = 0.0;
+        }
+
+        for (istart = 0; istart < M && jstart < jend; istart += nrow_block) {
+            nrow_b = std::min<int>(nrow_block, M - istart);
+            for (ib = 0; ib < nrow_b; ++ib) {
+                for (k = 0; k < nnz_col; ++k) {
+                    sparse_sign_element(istart + ib, k, nnz_col, nrow_s,
+                                        irow[ib * nnz_col + k], sign[ib * nnz_col + k]);
+                    sign[ib * nnz_col + k] *= scale;
+                }
+            }
+            for (j = jstart; j < jend; ++j) {
+                col = sketch + static_cast<long>(nrow_s) * j;
+                acol = (j < N) ? dmat.amat + static_cast<long>(M) * j + istart
+                               : dmat.bvec + istart;
+                for (ib = 0; ib < nrow_b; ++ib) {
+                    for (k = 0; k < nnz_col; ++k) {
+                        col[irow[ib * nnz_col + k]] += sign[ib * nnz_col + k] * acol[ib];
+                    }
+                }
+            }
+        }
+    }
+
+    // SA = Q R, and Q^T S b
+
+    allocate(TAU, N);
+    LWORK = -1;
+    dgeqrf_(&nrow_s, &N, sketch, &nrow_s, TAU, &work_query, &LWORK, &INFO);
+    lwork_qr = static_cast<int>(work_query);
+    dormqr_("L", "T", &nrow_s, &nrhs, &N, sketch, &nrow_s, TAU,
+            sketch + static_cast<long>(nrow_s) * N, &nrow_s, &work_query, &LWORK, &INFO);
+    LWORK = std::max<int>(lwork_qr, static_cast<int>(work_query));
+    allocate(WORK, LWORK);
+
+    dgeqrf_(&nrow_s, &N, sketch, &nrow_s, TAU, WORK, &LWORK, &INFO);
+    dormqr_("L", "T", &nrow_s, &nrhs, &N, sketch, &nrow_s, TAU,
+            sketch + static_cast<long>(nrow_s) * N, &nrow_s, WORK, &LWORK, &INFO);
+
+    deallocate(WORK);
+    deallocate(TAU);
+
+    if (rank_from_diagonal(N, sketch, nrow_s, eps12) < N) {
+        deallocate(sketch);
+        return false;
+    }
+
+    // LSQR on A R^{-1} y = b from y0, and x = R^{-1} y
+
+    allocate(y, N);
+    for (i = 0; i < N; ++i) y[i] = sketch[i + static_cast<long>(nrow_s) * N];
+
+    PreconditionedOperator aprec(dmat, sketch, nrow_s);
+    niter = lsqr(aprec, dmat.bvec, y, tol, niter_max, true);
+
+    if (niter < 0) {
+        error->warn("solve_sketch_preconditioned",
+                    "LSQR did not converge within the maximum number of iterations.");
+    }
+
+    for (i = 0; i < N; ++i) x[i] = y[i];
+    dtrtrs_("U", "N", "N", &N, &nrhs, sketch, &nrow_s, x, &N, &INFO);
+
+    deallocate(y);
+    deallocate(sketch);
+
+    return true;
+}
+
+
+std::string Fitting::resolve_dense_solver(DesignMatrix &dmat)
+{
+    // Dense solver used for the design matrix in memory.
+
+    if (solver == "AUTO") return select_solver(dmat);
+    if (solver == "SVD_DC" || solver == "QRP" || solver == "SKETCH") return solver;
+    return "SVD";
+}
+
+
+std::string Fitting::select_solver(DesignMatrix &dmat)
+{
+    // Time the dense solvers on a sample of the rows of dmat and return the
+    // fastest one whose residual norm agrees with that of SVD within
+    // tol_residual. The sample has about 4*N rows taken at equal intervals.
+
+    int i, j, k;
+    int M = static_cast<int>(dmat.nrow);
+    int N = dmat.ncol;
+    int nrow_s = std::min<int>(M, 4 * N);
+    int inc = 1;
+    double one = 1.0, mone = -1.0;
+    double f_residual, f_residual_ref = 0.0;
+    double time_best = -1.0;
+    double *x, *res;
+    std::string method_best = "SVD";
+    DesignMatrix smat;
+
+    const double tol_residual = 1.0e-6;
+    const std::string candidates[] = {"SVD", "SVD_DC", "QRP", "CHOLESKY", "LSQR"};
+
+    std::vector<int> irow(nrow_s);
+    for (i = 0; i < nrow_s; ++i) {
+        irow[i] = static_cast<int>(static_cast<long>(i) * M / nrow_s);
+    }
+
+    allocate(x, N);
+    allocate(res, nrow_s);
+
+    std::cout << std::endl;
+    std::cout << "  Benchmark of the solvers on " << nrow_s << " rows:" << std::endl;
+    std::cout << "   Solver         Time (sec)   Residual" << std::endl;
+
+    for (k = 0; k < 5; ++k) {
+
+        const std::string &method = candidates[k];
+
+        smat.resize(nrow_s, N);
+        for (j = 0; j < N; ++j) {
+            for (i = 0; i < nrow_s; ++i) {
+                smat.amat[i + static_cast<long>(nrow_s) * j] = dmat.amat[irow[i] + static_cast<long>(M) * j];
+            }
+        }
+        for (i = 0; i < nrow_s; ++i) smat.bvec[i] = dmat.bvec[irow[i]];
+
+        std::chrono::steady_clock::time_point t_start = std::chrono::steady_clock::now();
+
+        solve_least_squares(method, smat, x, f_residual);
+
+        const double time_elapsed = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - t_start).count();
+
+        // The residual is recomputed from the sample because the solvers
+        // return it only for the full-rank case.
+
+        for (j = 0; j < N; ++j) {
+            for (i = 0; i < nrow_s; ++i) {
+                smat.amat[i + static_cast<long>(nrow_s) * j] = dmat.amat[irow[i] + static_cast<long>(M) * j];
+            }
+        }
+        for (i = 0; i < nrow_s; ++i) res[i] = dmat.bvec[irow[i]];
+        dgemv_("N", &nrow_s, &N, &mone, smat.amat, &nrow_s, x, &inc, &one, res, &inc);
+        f_residual = 0.0;
+        for (i = 0; i < nrow_s; ++i) f_residual += res[i] * res[i];
+
+        if (k == 0) f_residual_ref = f_residual;
+
+        const bool accurate = std::sqrt(f_residual)
+            <= std::sqrt(f_residual_ref) * (1.0 + tol_residual) + eps15;
+
+        std::cout << "   " << std::setw(12) << std::left << method << std::right
+            << std::setw(12) << time_elapsed
+            << std::setw(14) << std::sqrt(f_residual)
+            << (accurate ? "" : "  (rejected)") << std::endl;
+
+        if (accurate && (time_best < 0.0 || time_elapsed < time_best)) {
+            time_best = time_elapsed;
+            method_best = method;
+        }
+    }
+
+    deallocate(x);
+    deallocate(res);
+
+    std::cout << "  Selected solver : " << method_best << std::endl << std::endl;
+
+    return method_best;
+}
+
+
+std::string Fitting::solver_name(const std::string method) const
+{
+    if (method == "SVD_DC") return "Divide-and-conquer SVD";
+    if (method == "QRP") return "QR with column pivoting";
+    if (method == "SKETCH") return "Sketch-preconditioned LSQR";
+    if (method == "CHOLESKY") return "Cholesky decomposition of normal equation";
+    return method;
+}
+
+
+void Fitting::recover_original_forceconstants(const int maxorder,
+                                              const double *param_in,
+                                              double *param_out)
+{
+    // Convert the free parameters of the algebraic constraint (param_in)
+    // into the full set of irreducible force constants (param_out).
+
+    int i, j;
+    unsigned long k;
+    int ishift = 0;
+    int iparam = 0;
+    double tmp;
+    int inew, iold;
+
+    for (i = 0; i < maxorder; ++i) {
+        for (j = 0; j < constraint->const_fix[i].size(); ++j) {
+            param_out[constraint->const_fix[i][j].p_index_target + ishift]
+                = constraint->const_fix[i][j].val_to_fix;
+        }
+
+        for (boost::bimap<int, int>::const_iterator it = constraint->index_bimap[i].begin();
+             it != constraint->index_bimap[i].end(); ++it) {
+            inew = (*it).left + iparam;
+            iold = (*it).right + ishift;
+
+            param_out[iold] = param_in[inew];
+        }
+
+        for (j = 0; j < constraint->const_relate[i].size(); ++j) {
+            tmp = 0.0;
+
+            for (k = 0; k < constraint->const_relate[i][j].alpha.size(); ++k) {
+                tmp += constraint->const_relate[i][j].alpha[k]
+                    * param_out[constraint->const_relate[i][j].p_index_orig[k] + ishift];
+            }
+            param_out[constraint->const_relate[i][j].p_index_target + ishift] = -tmp;
+        }
+
+        ishift += fcs->nequiv[i].size();
+        iparam += constraint->index_bimap[i].size();
+    }
+}
+
+
+bool Fitting::fit_harmonic_direct(const int N,
+                                  const int N_new,
+                                  const int nat,
+                                  const int natmin,
+                                  const int ndata_used,
+                                  const int nmulti,
+                                  double *param_out)
+{
+    // Harmonic fitting of the data in which each snapshot displaces a single
+    // atom, as generated by MODE = suggest. The force F(i, alpha) of such a
+    // snapshot depends on Phi(i alpha, j beta) only through the displaced
+    // atom j. When the displacement is along a Cartesian axis, every row of
+    // the design matrix contains at most one irreducible parameter, so that
+    // A^T A = D is diagonal and the least-squares solution is
+    //   x_p = (A^T b)_p / D_p
+    // without forming the matrix. The constraints C x = d are imposed by the
+    // Lagrange multipliers (C D^{-1} C^T) lambda = C D^{-1} A^T b - d, and
+    // the algebraic constraints x = T z + x_fix by (T^T D T) z = T^T (A^T b - D x_fix).
+    // The terms are taken from fcs->fc_table directly, so that the result
+    // does not depend on how matrix_plan folds the constraints.
+    // Returns false without fitting if the data are not of this form.
+
+    int i, j, p, idata, itran, iat, icrd;
+    int nrank;
+    unsigned long k;
+    double f_square, f_residual;
+    double val, *x;
+    std::vector<double> dvec(N, 0.0), gvec(N, 0.0);
+    std::vector<int> row_col(3 * natmin);
+    std::vector<double> row_val(3 * natmin);
+    int ind[2];
+
+    class HarmonicTerm
+    {
+    public:
+        int row, col;
+        double coef;
+    };
+
+    const bool algebraic = constraint->constraint_algebraic;
+    const bool constrained = constraint->exist_constraint && !algebraic;
+
+    // Terms of the harmonic force for each displaced coordinate
+
+    std::vector<std::vector<HarmonicTerm>> terms(3 * nat);
+
+    k = 0;
+    p = 0;
+    for (auto iter = fcs->nequiv[0].begin(); iter != fcs->nequiv[0].end(); ++iter) {
+        for (i = 0; i < *iter; ++i) {
+            const FcProperty &fc = fcs->fc_table[0][k];
+            ind[0] = fc.elems[0];
+            ind[1] = fc.elems[1];
+            HarmonicTerm term;
+            term.row = inprim_index(fc.elems[0]);
+            term.col = p;
+            term.coef = -gamma(2, ind) * fc.sign;
+            terms[fc.elems[1]].push_back(term);
+            ++k;
+        }
+        ++p;
+    }
+
+    // Accumulate D = diag(A^T A) and g = A^T b over the snapshots and the
+    // pure translations, checking that each row has only one parameter.
+
+    f_square = 0.0;
+
+    for (idata = 0; idata < ndata_used; ++idata) {
+
+        iat = -1;
+        for (j = 0; j < 3 * nat; ++j) {
+            if (std::abs(u_in[idata][j]) < eps12) continue;
+            if (iat >= 0 && j / 3 != iat) return false;
+            iat = j / 3;
+        }
+
+        for (itran = 0; itran < nmulti; ++itran) {
+
+            std::fill(row_col.begin(), row_col.end(), -1);
+            std::fill(row_val.begin(), row_val.end(), 0.0);
+
+            if (iat >= 0) {
+                const int jat = map_tran[itran * nat + iat];
+                for (icrd = 0; icrd < 3; ++icrd) {
+                    const double u = u_in[idata][3 * iat + icrd];
+                    if (std::abs(u) < eps12) continue;
+                    for (const auto &t : terms[3 * jat + icrd]) {
+                        if (row_col[t.row] >= 0 && row_col[t.row] != t.col) return false;
+                        row_col[t.row] = t.col;
+                        row_val[t.row] += t.coef * u;
+                    }
+                }
+            }
+
+            for (i = 0; i < natmin; ++i) {
+                const int iat_f = map_tran_inv[itran * nat + symmetry->map_p2s[i][0]];
+                for (icrd = 0; icrd < 3; ++icrd) {
+                    const int irow = 3 * i + icrd;
+                    const double f = f_in[idata][3 * iat_f + icrd];
+                    f_square += f * f;
+                    if (row_col[irow] < 0) continue;
+                    dvec[row_col[irow]] += row_val[irow] * row_val[irow];
+                    gvec[row_col[irow]] += row_val[irow] * f;
+                }
+            }
+        }
+    }
+
+    allocate(x, N);
+
+    if (algebraic) {
+
+        // x = T z + x_fix, where the columns of T and x_fix are obtained
+        // from recover_original_forceconstants.
+
+        std::vector<double> xfix(N), tcol(N), zvec(N_new, 0.0);
+        std::vector<std::vector<std::pair<int, double>>> trow(N);
+        double *hmat, *rhs;
+        int n_ = N_new, nrhs = 1, INFO;
+
+        recover_original_forceconstants(1, zvec.data(), xfix.data());
+        for (i = 0; i < N_new; ++i) {
+            zvec[i] = 1.0;
+            recover_original_forceconstants(1, zvec.data(), tcol.data());
+            zvec[i] = 0.0;
+            for (p = 0; p < N; ++p) {
+                val = tcol[p] - xfix[p];
+                if (std::abs(val) > eps12) trow[p].push_back(std::make_pair(i, val));
+            }
+        }
+
+        allocate(hmat, std::max<long>(static_cast<long>(N_new) * N_new, 1));
+        allocate(rhs, std::max<int>(N_new, 1));
+        std::fill(hmat, hmat + static_cast<long>(N_new) * N_new, 0.0);
+        for (i = 0; i < N_new; ++i) rhs[i] = 0.0;
+
+        for (p = 0; p < N; ++p) {
+            for (const auto &a : trow[p]) {
+                rhs[a.first] += a.second * (gvec[p] - dvec[p] * xfix[p]);
+                for (const auto &b : trow[p]) {
+                    hmat[a.first + static_cast<long>(N_new) * b.first] += dvec[p] * a.second * b.second;
+                }
+            }
+        }
+
+        INFO = 0;
+        if (N_new > 0) dposv_("U", &n_, &nrhs, hmat, &n_, rhs, &n_, &INFO);
+
+        if (INFO == 0) {
+            recover_original_forceconstants(1, rhs, x);
+        }
+
+        deallocate(hmat);
+        deallocate(rhs);
+
+        if (INFO != 0) {
+            deallocate(x);
+            return false;
+        }
+        nrank = N_new;
+
+    } else {
+
+        nrank = 0;
+        for (p = 0; p < N; ++p) {
+            if (dvec[p] > 0.0) {
+                x[p] = gvec[p] / dvec[p];
+                ++nrank;
+            } else {
+                x[p] = 0.0;
+            }
+        }
+
+        if (constrained) {
+
+            // x <- x - D^{-1} C^T lambda
+
+            const int P = constraint->P;
+            double *smat, *lambda;
+            int n_ = P, nrhs = 1, INFO;
+
+            if (nrank < N) {
+                deallocate(x);
+                return false;
+            }
+
+            allocate(smat, static_cast<long>(P) * P);
+            allocate(lambda, P);
+
+            for (i = 0; i < P; ++i) {
+                lambda[i] = -constraint->const_rhs[i];
+                for (p = 0; p < N; ++p) lambda[i] += constraint->const_mat[i][p] * x[p];
+                for (j = 0; j <= i; ++j) {
+                    val = 0.0;
+                    for (p = 0; p < N; ++p) {
+                        val += constraint->const_mat[i][p] * constraint->const_mat[j][p] / dvec[p];
+                    }
+                    smat[j + static_cast<long>(P) * i] = val;
+                    smat[i + static_cast<long>(P) * j] = val;
+                }
+            }
+
+            dposv_("U", &n_, &nrhs, smat, &n_, lambda, &n_, &INFO);
+
+            if (INFO == 0) {
+                for (p = 0; p < N; ++p) {
+                    val = 0.0;
+                    for (i = 0; i < P; ++i) val += constraint->const_mat[i][p] * lambda[i];
+                    x[p] -= val / dvec[p];
+                }
+            }
+
+            deallocate(smat);
+            deallocate(lambda);
+
+            if (INFO != 0) {
+                deallocate(x);
+                return false;
+            }
+        }
+    }
+
+    for (p = 0; p < N; ++p) param_out[p] = x[p];
+
+    // |A x - b|^2 = |b|^2 - 2 x^T g + x^T D x
+
+    f_residual = f_square;
+    for (p = 0; p < N; ++p) {
+        f_residual += x[p] * (dvec[p] * x[p] - 2.0 * gvec[p]);
+    }
+    f_residual = std::max<double>(f_residual, 0.0);
+
+    deallocate(x);
+
+    std::cout << "  Entering fitting routine: direct harmonic fitting of the single-atom displacements"
+        << std::endl << std::endl;
+
+    fit_rank = nrank;
+    std::cout << "  RANK of the matrix = " << nrank << std::endl;
+    if (nrank < (algebraic ? N_new : N))
+        error->warn("fit_harmonic_direct",
+                    "Matrix is rank-deficient. Force constants could not be determined uniquely :(");
+
+    if (nrank == (algebraic ? N_new : N)) {
+        std::cout << std::endl << "  Residual sum of squares for the solution: "
+            << sqrt(f_residual) << std::endl;
+        fit_error = sqrt(f_residual / f_square) * 100.0;
+        std::cout << "  Fitting error (%) : "
+            << fit_error << std::endl;
+    }
+
+    return true;
+}
+
+
+bool Fitting::find_displacement_pairs(const int nat,
+                                      const int ndata_used,
+                                      std::vector<std::pair<int, int>> &pairs)
+{
+    // Pair the snapshots u and -u of the data 0 .. ndata_used-1 of u_in.
+    // The displacements are rounded to a grid of eps8 and normalized such
+    // that the first nonzero component is positive, so that u and -u share
+    // the same key. Returns false unless every snapshot has its partner.
+
+    int i, j, idata;
+    long long key;
+    std::vector<std::vector<long long>> keys(ndata_used);
+    std::vector<int> sign(ndata_used, 0), order(ndata_used);
+
+    pairs.clear();
+
+    for (idata = 0; idata < ndata_used; ++idata) {
+        keys[idata].resize(3 * nat);
+        for (j = 0; j < 3 * nat; ++j) {
+            key = std::llround(u_in[idata][j] / eps8);
+            if (sign[idata] == 0 && key != 0) sign[idata] = (key > 0) ? 1 : -1;
+            keys[idata][j] = key;
+        }
+        if (sign[idata] == 0) return false;
+        if (sign[idata] < 0) {
+            for (j = 0; j < 3 * nat; ++j) keys[idata][j] = -keys[idata][j];
+        }
+        order[idata] = idata;
+    }
+
+    std::sort(order.begin(), order.end(),
+              [&keys](const int a, const int b) { return keys[a] < keys[b]; });
+
+    // Each group of equal keys must contain as many +u as -u.
+
+    std::vector<int> plus, minus;
+
+    for (i = 0; i < ndata_used;) {
+        plus.clear();
+        minus.clear();
+        for (j = i; j < ndata_used && keys[order[j]] == keys[order[i]]; ++j) {
+            if (sign[order[j]] > 0) {
+                plus.push_back(order[j]);
+            } else {
+                minus.push_back(order[j]);
+            }
+        }
+        if (plus.size() != minus.size()) return false;
+        for (idata = 0; idata < static_cast<int>(plus.size()); ++idata) {
+            pairs.push_back(std::make_pair(plus[idata], minus[idata]));
+        }
+        i = j;
+    }
+
+    return true;
+}
+
+
+bool Fitting::fit_parity_split(const int N,
+                               const int N_new,
+                               const int nat,
+                               const int natmin,
+                               const int ndata_used,
+                               const int nmulti,
+                               const int maxorder,
+                               double *param_out)
+{
+    // Fitting of the data consisting of the pairs u and -u.
+    // Since the force of the order n (n = 0 for the harmonic terms) is
+    // proportional to u^{n+1}, the difference (f(u) - f(-u))/2 depends only
+    // on the even n and the sum (f(u) + f(-u))/2 only on the odd n.
+    // The least-squares problem therefore separates into two independent
+    // problems, each having half the rows of the original one and the
+    // columns of one parity, which are solved one after the other.
+    // The residual of the original problem is twice the sum of the two.
+    // Returns false without fitting if the data are not paired or the
+    // constraints mix the two parities.
+
+    int i, j, ip, order, idata;
+    int ncol, npair, M_p;
+    int nrank_tot;
+    unsigned long k;
+    double f_square, f_residual;
+    double *x;
+    double **u_save, **f_save, **u_pair;
+    double **f_pair[2];
+    MatrixElementPlan *plan_save;
+    MatrixElementPlan *plan_p[2];
+    std::vector<std::pair<int, int>> pairs;
+    std::vector<int> col_parity, col_index;
+    std::vector<int> rows_p[2];
+
+    const bool algebraic = constraint->constraint_algebraic;
+    const bool constrained = constraint->exist_constraint && !algebraic;
+
+    // The rotational invariance relates the neighboring orders.
+    if (constraint->constraint_mode >= 2) return false;
+    if (constrained && solver != "SVD") return false;
+    if (!find_displacement_pairs(nat, ndata_used, pairs)) return false;
+
+    npair = pairs.size();
+    M_p = 3 * natmin * npair * nmulti;
+    ncol = algebraic ? N_new : N;
+
+    // Parity of each column and its index in the problem of that parity
+
+    int ncol_p[2] = {0, 0};
+
+    col_parity.resize(ncol);
+    col_index.resize(ncol);
+    i = 0;
+    for (order = 0; order < maxorder; ++order) {
+        const int nparam = algebraic ? constraint->index_bimap[order].size()
+                               : fcs->nequiv[order].size();
+        for (j = 0; j < nparam; ++j) {
+            col_parity[i] = order % 2;
+            col_index[i] = ncol_p[order % 2]++;
+            ++i;
+        }
+    }
+
+    // Split the linear constraints C x = d by the parity
+
+    int P_p[2] = {0, 0};
+    double *cmat_p[2] = {nullptr, nullptr};
+    double *dvec_p[2] = {nullptr, nullptr};
+
+    if (constrained) {
+        for (i = 0; i < constraint->P; ++i) {
+            ip = -1;
+            for (j = 0; j < ncol; ++j) {
+                if (std::abs(constraint->const_mat[i][j]) < eps12) continue;
+                if (ip >= 0 && col_parity[j] != ip) return false;
+                ip = col_parity[j];
+            }
+            if (ip >= 0) rows_p[ip].push_back(i);
+        }
+    }
+
+    for (ip = 0; ip < 2; ++ip) {
+        P_p[ip] = rows_p[ip].size();
+        if (P_p[ip] > ncol_p[ip] || ncol_p[ip] > M_p + P_p[ip]) return false;
+    }
+
+    std::cout << "  " << npair << " pairs of +u and -u are found." << std::endl;
+    std::cout << "  The fitting is split into the harmonic/quartic terms ("
+        << ncol_p[0] << " parameters) and the cubic/quintic terms ("
+        << ncol_p[1] << " parameters)." << std::endl << std::endl;
+
+    for (ip = 0; ip < 2; ++ip) {
+        if (P_p[ip] == 0) continue;
+        allocate(cmat_p[ip], static_cast<long>(P_p[ip]) * ncol_p[ip]);
+        allocate(dvec_p[ip], P_p[ip]);
+        std::fill(cmat_p[ip], cmat_p[ip] + static_cast<long>(P_p[ip]) * ncol_p[ip], 0.0);
+        // column-major as required by DGGLSE
+        for (i = 0; i < P_p[ip]; ++i) {
+            dvec_p[ip][i] = constraint->const_rhs[rows_p[ip][i]];
+            for (j = 0; j < ncol; ++j) {
+                if (col_parity[j] != ip) continue;
+                cmat_p[ip][i + static_cast<long>(P_p[ip]) * col_index[j]] = constraint->const_mat[rows_p[ip][i]][j];
+            }
+        }
+    }
+
+    // Plans of the two problems. The orders of the other parity are left
+    // empty, and the columns are renumbered within the parity.
+
+    for (ip = 0; ip < 2; ++ip) {
+        allocate(plan_p[ip], maxorder);
+        for (order = 0; order < maxorder; ++order) {
+            plan_p[ip][order].nelem = order + 1;
+            if (order % 2 != ip) continue;
+            plan_p[ip][order] = matrix_plan[order];
+            for (k = 0; k < matrix_plan[order].nterm_amat; ++k) {
+                plan_p[ip][order].col[k] = col_index[matrix_plan[order].col[k]];
+            }
+        }
+    }
+
+    // Representatives u and the (anti)symmetric combinations of the forces
+
+    allocate(u_pair, npair, 3 * nat);
+    allocate(f_pair[0], npair, 3 * nat);
+    allocate(f_pair[1], npair, 3 * nat);
+
+    for (idata = 0; idata < npair; ++idata) {
+        const int iplus = pairs[idata].first;
+        const int iminus = pairs[idata].second;
+        for (j = 0; j < 3 * nat; ++j) {
+            u_pair[idata][j] = u_in[iplus][j];
+            f_pair[0][idata][j] = 0.5 * (f_in[iplus][j] - f_in[iminus][j]);
+            f_pair[1][idata][j] = 0.5 * (f_in[iplus][j] + f_in[iminus][j]);
+        }
+    }
+
+    std::cout << "  Calculation of matrix elements for direct fitting started ... ";
+
+    DesignMatrix dmat_p[2];
+
+    u_save = u_in;
+    f_save = f_in;
+    plan_save = matrix_plan;
+    u_in = u_pair;
+
+    f_square = 0.0;
+    for (ip = 0; ip < 2; ++ip) {
+        f_in = f_pair[ip];
+        matrix_plan = plan_p[ip];
+        dmat_p[ip].resize(M_p, std::max<int>(ncol_p[ip], 1));
+        calc_matrix_elements(ncol_p[ip], nat, natmin, 0, npair,
+                             nmulti, maxorder, dmat_p[ip]);
+        for (i = 0; i < M_p; ++i) {
+            f_square += std::pow(algebraic ? dmat_p[ip].bvec_orig[i] : dmat_p[ip].bvec[i], 2);
+        }
+    }
+
+    u_in = u_save;
+    f_in = f_save;
+    matrix_plan = plan_save;
+
+    deallocate(u_pair);
+    deallocate(f_pair[0]);
+    deallocate(f_pair[1]);
+    deallocate(plan_p[0]);
+    deallocate(plan_p[1]);
+
+    std::cout << "done!" << std::endl << std::endl;
+
+    // The dense solver is chosen for each problem.
+
+    std::string method_p[2];
+    int nrank_p[2] = {0, 0};
+    double res_p[2] = {0.0, 0.0};
+    double *x_p[2];
+
+    for (ip = 0; ip < 2; ++ip) {
+        allocate(x_p[ip], std::max<int>(ncol_p[ip], 1));
+        if (ncol_p[ip] == 0) {
+            for (i = 0; i < M_p; ++i) res_p[ip] += std::pow(dmat_p[ip].bvec[i], 2);
+            continue;
+        }
+        method_p[ip] = constrained ? "SVD" : resolve_dense_solver(dmat_p[ip]);
+    }
+
+    std::cout << "  Entering fitting routine: "
+        << (constrained ? "QRD with constraints" : solver_name(method_p[0]))
+        << " for each parity" << std::endl;
+    // The two problems are solved one after the other, each with all the
+    // threads of LAPACK. Solving them concurrently with half the threads
+    // each was not faster, and the warnings of the solvers were interleaved.
+
+    for (ip = 0; ip < 2; ++ip) {
+        if (ncol_p[ip] == 0) continue;
+        if (P_p[ip] > 0) {
+            nrank_p[ip] = solve_constrained_least_squares(dmat_p[ip], P_p[ip], cmat_p[ip],
+                                                          dvec_p[ip], x_p[ip], res_p[ip]);
+        } else {
+            nrank_p[ip] = solve_least_squares(method_p[ip], dmat_p[ip], x_p[ip], res_p[ip]);
+        }
+    }
+
+    std::cout << std::endl;
+
+    nrank_tot = nrank_p[0] + nrank_p[1];
+    f_residual = 2.0 * (res_p[0] + res_p[1]);
+    f_square *= 2.0;
+
+    fit_rank = nrank_tot;
+    std::cout << "  RANK of the matrix = " << nrank_tot << std::endl;
+    if (nrank_tot < ncol)
+        error->warn("fit_parity_split",
+                    "Matrix is rank-deficient. Force constants could not be determined uniquely :(");
+
+    if (nrank_tot == ncol) {
+        std::cout << std::endl << "  Residual sum of squares for the solution: "
+            << sqrt(f_residual) << std::endl;
+        fit_error = sqrt(f_residual / f_square) * 100.0;
+        std::cout << "  Fitting error (%) : "
+            << fit_error << std::endl;
+    }
+
+    allocate(x, ncol);
+    for (j = 0; j < ncol; ++j) {
+        x[j] = x_p[col_parity[j]][col_index[j]];
+    }
+
+    if (algebraic) {
+        recover_original_forceconstants(maxorder, x, param_out);
+    } else {
+        for (j = 0; j < N; ++j) param_out[j] = x[j];
+    }
+
+    deallocate(x);
+    for (ip = 0; ip < 2; ++ip) {
+        deallocate(x_p[ip]);
+        if (cmat_p[ip]) deallocate(cmat_p[ip]);
+        if (dvec_p[ip]) deallocate(dvec_p[ip]);
+    }
+
+    return true;
+}
+
+
+void Fitting::fit_normal_equation(const int N,
+                                  const int N_new,
+                                  const int nat,
+                                  const int natmin,
+                                  const int ndata_used,
+                                  const int nmulti,
+                                  const int maxorder,
+                                  double *param_out)
+{
+    // Least-squares fitting via the normal equation (A^T A) x = A^T b.
+    // The design matrix A is generated for a block of snapshots at a time
+    // and its contribution is accumulated to A^T A and A^T b with BLAS-3,
+    // so that the required memory scales as N^2 instead of M*N.
+
+    int i;
+    int ncol, nrank;
+    int ndata_block;
+    int idata_begin, idata_end;
+    int icycle_begin, icycle_end;
+    int inc = 1;
+    double one = 1.0, zero = 0.0;
+    double f_square, b_square, f_residual;
+    double *atamat, *atbvec, *gx;
+    double *param_new;
+
+    const bool algebraic = constraint->constraint_algebraic;
+
+    ncol = algebraic ? N_new : N;
+
+    // By default, the number of rows in each block is set comparable to N
+    // so that the peak memory does not exceed that of A^T A.
+    if (nblock > 0) {
+        ndata_block = nblock;
+    } else {
+        ndata_block = std::max<int>(1, ncol / (3 * nat));
+    }
+    ndata_block = std::min<int>(ndata_block, ndata_used);
+
+    // Contiguous block of the snapshots of this process. When the snapshots
+    // are distributed, u_in and f_in hold this block only.
+
+    snapshot_block(ndata_used, nprocs, my_rank, idata_begin, idata_end);
+    if (snapshots_distributed) {
+        idata_end -= idata_begin;
+        idata_begin = 0;
+    }
+    icycle_begin = idata_begin * nmulti;
+    icycle_end = idata_end * nmulti;
+
+    std::cout << "  Entering fitting routine: Cholesky decomposition of normal equation" << std::endl;
+    if (nprocs > 1) {
+        std::cout << "  Number of MPI processes : " << nprocs << std::endl;
+    }
+    std::cout << "  Number of snapshots processed at once : " << ndata_block << std::endl;
+    std::cout << std::endl;
+
+    allocate(atamat, static_cast<long>(ncol) * ncol);
+    allocate(atbvec, ncol);
+
+    std::fill(atamat, atamat + static_cast<long>(ncol) * ncol, 0.0);
+    for (i = 0; i < ncol; ++i) atbvec[i] = 0.0;
+    f_square = 0.0;
+    b_square = 0.0;
+
+    std::cout << "  Calculation of matrix elements for normal equation started ... ";
+
+    accumulate_normal_equation(ncol, nat, natmin, maxorder,
+                               icycle_begin, icycle_end - icycle_begin, ndata_block * nmulti,
+                               atamat, atbvec, b_square, f_square);
+
+#ifdef _USE_MPI
+    if (nprocs > 1) {
+        allreduce_sum_in_chunks(atamat, static_cast<long>(ncol) * ncol);
+        MPI_Allreduce(MPI_IN_PLACE, atbvec, ncol, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE, &b_square, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE, &f_square, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    }
+#endif
+
+    std::cout << "done!" << std::endl << std::endl;
+
+    allocate(param_new, ncol);
+
+    if (algebraic || !constraint->exist_constraint) {
+        nrank = solve_normal_equation(ncol, atamat, atbvec, param_new);
+    } else {
+        nrank = solve_normal_equation_with_constraints(ncol, constraint->P, atamat, atbvec,
+                                                       constraint->const_mat,
+                                                       constraint->const_rhs,
+                                                       param_new);
+    }
+
+    fit_rank = nrank;
+    std::cout << "  RANK of the matrix = " << nrank << std::endl;
+    if (nrank < ncol)
+        error->warn("fit_normal_equation",
+                    "Matrix is rank-deficient. Force constants could not be determined uniquely :(");
+
+    // |Ax - b|^2 = x^T (A^T A) x - 2 x^T (A^T b) + b^T b
+
+    allocate(gx, ncol);
+    dsymv_("U", &ncol, &one, atamat, &ncol, param_new, &inc, &zero, gx, &inc);
+
+    f_residual = b_square;
+    for (i = 0; i < ncol; ++i) {
+        f_residual += param_new[i] * (gx[i] - 2.0 * atbvec[i]);
+    }
+    f_residual = std::max<double>(f_residual, 0.0);
+
+    std::cout << std::endl << "  Residual sum of squares for the solution: "
+        << std::sqrt(f_residual) << std::endl;
+    fit_error = std::sqrt(f_residual / f_square) * 100.0;
+    std::cout << "  Fitting error (%) : "
+        << fit_error << std::endl;
+
+    if (algebraic) {
+        recover_original_forceconstants(maxorder, param_new, param_out);
+    } else {
+        for (i = 0; i < N; ++i) param_out[i] = param_new[i];
+    }
+
+    deallocate(gx);
+    deallocate(param_new);
+    deallocate(atamat);
+    deallocate(atbvec);
+}
+
+
+void Fitting::accumulate_normal_equation(int ncol,
+                                         const int nat,
+                                         const int natmin,
+                                         const int maxorder,
+                                         const int icycle_start,
+                                         const int ncycle,
+                                         const int ncycle_block,
+                                         double *atamat,
+                                         double *atbvec,
+                                         double &b_square,
+                                         double &f_square)
+{
+    // Add the contribution of the snapshots icycle_start .. icycle_start+ncycle-1
+    // to the upper triangle of A^T A, A^T b, b^T b, and f^T f.
+    // The rows are generated for ncycle_block snapshots at a time.
+
+    int i, istart;
+    int ncycle_tmp, nrow, ichunk, nchunk;
+    int inc = 1;
+    double one = 1.0;
+    double *amat, *fsum, *fsum_orig;
+
+    nrow = 3 * natmin * ncycle_block;
+
+    allocate(amat, static_cast<long>(nrow) * ncol);
+    allocate(fsum, nrow);
+    allocate(fsum_orig, nrow);
+
+    for (istart = 0; istart < ncycle; istart += ncycle_block) {
+
+        ncycle_tmp = std::min<int>(ncycle_block, ncycle - istart);
+        nrow = 3 * natmin * ncycle_tmp;
+        nchunk = (ncycle_tmp + nsnap_chunk - 1) / nsnap_chunk;
+
+        // amat is the column-major nrow x ncol matrix, where the rows are
+        // grouped by chunks of nsnap_chunk snapshots.
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (ichunk = 0; ichunk < nchunk; ++ichunk) {
+            const int irow0 = ichunk * nsnap_chunk;
+            const int ioffset = 3 * natmin * irow0;
+            calc_matrix_elements_chunk(ncol, nat, natmin, maxorder,
+                                       icycle_start + istart + irow0,
+                                       std::min<int>(nsnap_chunk, ncycle_tmp - irow0),
+                                       amat + ioffset, nrow,
+                                       fsum + ioffset, fsum_orig + ioffset);
+        }
+
+        dsyrk_("U", "T", &ncol, &nrow, &one, amat, &nrow,
+               &one, atamat, &ncol);
+        dgemv_("T", &nrow, &ncol, &one, amat, &nrow,
+               fsum, &inc, &one, atbvec, &inc);
+
+        for (i = 0; i < nrow; ++i) {
+            b_square += fsum[i] * fsum[i];
+            f_square += fsum_orig[i] * fsum_orig[i];
+        }
+    }
+
+    deallocate(amat);
+    deallocate(fsum);
+    deallocate(fsum_orig);
+}
+
+
+int Fitting::solve_normal_equation(const int n,
+                                   const double *atamat,
+                                   const double *atbvec,
+                                   double *x)
+{
+    // Solve (A^T A) x = A^T b with the Cholesky decomposition.
+    // Only the upper triangle of atamat (column-major) is referenced.
+    // The columns are normalized beforehand to reduce the condition number.
+    // When the matrix is not positive definite, the minimum-norm solution
+    // is obtained from the eigenvalue decomposition instead.
+    // Returns the rank of the matrix.
+
+    int i, j;
+    int n_ = n;
+    int nrhs = 1, INFO;
+    int nrank;
+    double *mat, *scale;
+
+    if (n == 0) return 0;
+
+    allocate(mat, static_cast<long>(n) * n);
+    allocate(scale, n);
+
+    for (i = 0; i < n; ++i) {
+        if (atamat[i + static_cast<long>(n) * i] > 0.0) {
+            scale[i] = 1.0 / std::sqrt(atamat[i + static_cast<long>(n) * i]);
+        } else {
+            scale[i] = 0.0;
+        }
+    }
+    for (j = 0; j < n; ++j) {
+        for (i = 0; i <= j; ++i) {
+            mat[i + static_cast<long>(n) * j] = atamat[i + static_cast<long>(n) * j] * scale[i] * scale[j];
+        }
+        x[j] = atbvec[j] * scale[j];
+    }
+    for (i = 0; i < n; ++i) {
+        if (scale[i] == 0.0) mat[i + static_cast<long>(n) * i] = 0.0;
+    }
+
+    dposv_("U", &n_, &nrhs, mat, &n_, x, &n_, &INFO);
+
+    if (INFO == 0) {
+
+        nrank = n;
+
+    } else {
+
+        int LWORK = -1;
+        double *eval, *WORK, *y;
+        double work_tmp;
+
+        for (j = 0; j < n; ++j) {
+            for (i = 0; i <= j; ++i) {
+                mat[i + static_cast<long>(n) * j] = atamat[i + static_cast<long>(n) * j] * scale[i] * scale[j];
+            }
+            x[j] = atbvec[j] * scale[j];
+        }
+
+        allocate(eval, n);
+        allocate(y, n);
+
+        dsyev_("V", "U", &n_, mat, &n_, eval, &work_tmp, &LWORK, &INFO);
+        LWORK = static_cast<int>(work_tmp);
+        allocate(WORK, LWORK);
+        dsyev_("V", "U", &n_, mat, &n_, eval, WORK, &LWORK, &INFO);
+        deallocate(WORK);
+
+        if (INFO != 0) {
+            error->exit("solve_normal_equation", "DSYEV failed with INFO = ", INFO);
+        }
+
+        // Eigenvalues are in ascending order.
+        nrank = 0;
+        for (i = 0; i < n; ++i) {
+            y[i] = 0.0;
+            if (eval[i] > eps12 * eval[n - 1]) {
+                for (j = 0; j < n; ++j) y[i] += mat[j + static_cast<long>(n) * i] * x[j];
+                y[i] /= eval[i];
+                ++nrank;
+            }
+        }
+        for (j = 0; j < n; ++j) {
+            x[j] = 0.0;
+            for (i = 0; i < n; ++i) {
+                x[j] += mat[j + static_cast<long>(n) * i] * y[i];
+            }
+        }
+
+        deallocate(eval);
+        deallocate(y);
+    }
+
+    for (i = 0; i < n; ++i) x[i] *= scale[i];
+
+    deallocate(mat);
+    deallocate(scale);
+
+    return nrank;
+}
+
+
+int Fitting::solve_normal_equation_with_constraints(const int n,
+                                                    const int p,
+                                                    const double *atamat,
+                                                    const double *atbvec,
+                                                    double **cmat,
+                                                    double *dvec,
+                                                    double *x)
+{
+    // Minimize |Ax - b| subject to Cx = d using the null-space method.
+    // With the QR decomposition C^T = Q (R 0)^T, x = Q (y1 y2)^T,
+    // the constraint gives y1 = R^{-T} d, and y2 is obtained from
+    // the reduced normal equation
+    //   (Q2^T A^T A Q2) y2 = Q2^T (A^T b - A^T A Q1 y1).
+    // Returns the rank of the stacked matrix (A C)^T.
+
+    int i, j;
+    int n_ = n, p_ = p, n2 = n - p;
+    int nrhs = 1, INFO, LWORK;
+    int nrank;
+    double one = 1.0, zero = 0.0;
+    int inc = 1;
+    double work_tmp;
+    double *qmat, *rmat, *tau, *WORK;
+    double *gmat, *tmp, *hmat, *hvec;
+    double *y, *h22, *h2;
+
+    if (p == 0) return solve_normal_equation(n, atamat, atbvec, x);
+    if (p >= n) {
+        error->exit("solve_normal_equation_with_constraints",
+                    "The number of constraints must be smaller than the number of parameters.");
+    }
+
+    allocate(qmat, static_cast<long>(n) * n);
+    allocate(rmat, static_cast<long>(p) * p);
+    allocate(tau, p);
+
+    // The row-major P x N array cmat is the column-major N x P matrix C^T.
+    std::copy(cmat[0], cmat[0] + static_cast<long>(n) * p, qmat);
+
+    LWORK = -1;
+    dgeqrf_(&n_, &p_, qmat, &n_, tau, &work_tmp, &LWORK, &INFO);
+    LWORK = std::max<int>(static_cast<int>(work_tmp), n);
+    allocate(WORK, LWORK);
+    dgeqrf_(&n_, &p_, qmat, &n_, tau, WORK, &LWORK, &INFO);
+
+    for (j = 0; j < p; ++j) {
+        for (i = 0; i < p; ++i) {
+            rmat[i + static_cast<long>(p) * j] = (i <= j) ? qmat[i + static_cast<long>(n) * j] : 0.0;
+        }
+    }
+
+    dorgqr_(&n_, &n_, &p_, qmat, &n_, tau, WORK, &LWORK, &INFO);
+    deallocate(WORK);
+    deallocate(tau);
+
+    allocate(y, n);
+    for (i = 0; i < p; ++i) y[i] = dvec[i];
+
+    dtrtrs_("U", "T", "N", &p_, &nrhs, rmat, &p_, y, &p_, &INFO);
+    deallocate(rmat);
+
+    if (INFO > 0) {
+        error->exit("solve_normal_equation_with_constraints",
+                    "The constraint matrix is rank-deficient.");
+    }
+
+    // H = Q^T (A^T A) Q,  h = Q^T (A^T b)
+
+    allocate(gmat, static_cast<long>(n) * n);
+    allocate(tmp, static_cast<long>(n) * n);
+    allocate(hmat, static_cast<long>(n) * n);
+    allocate(hvec, n);
+
+    for (j = 0; j < n; ++j) {
+        for (i = 0; i <= j; ++i) {
+            gmat[i + static_cast<long>(n) * j] = atamat[i + static_cast<long>(n) * j];
+            gmat[j + static_cast<long>(n) * i] = atamat[i + static_cast<long>(n) * j];
+        }
+    }
+
+    dgemm_("N", "N", &n_, &n_, &n_, &one, gmat, &n_, qmat, &n_, &zero, tmp, &n_);
+    dgemm_("T", "N", &n_, &n_, &n_, &one, qmat, &n_, tmp, &n_, &zero, hmat, &n_);
+    dgemv_("T", &n_, &n_, &one, qmat, &n_, const_cast<double *>(atbvec), &inc,
+           &zero, hvec, &inc);
+
+    deallocate(gmat);
+    deallocate(tmp);
+
+    allocate(h22, static_cast<long>(n2) * n2);
+    allocate(h2, n2);
+
+    for (i = 0; i < n2; ++i) {
+        h2[i] = hvec[p + i];
+        for (j = 0; j < p; ++j) {
+            h2[i] -= hmat[(p + i) + static_cast<long>(n) * j] * y[j];
+        }
+        for (j = 0; j < n2; ++j) {
+            h22[i + static_cast<long>(n2) * j] = hmat[(p + i) + static_cast<long>(n) * (p + j)];
+        }
+    }
+
+    nrank = p + solve_normal_equation(n2, h22, h2, y + p);
+
+    dgemv_("N", &n_, &n_, &one, qmat, &n_, y, &inc, &zero, x, &inc);
+
+    deallocate(h22);
+    deallocate(h2);
+    deallocate(hmat);
+    deallocate(hvec);
+    deallocate(qmat);
+    deallocate(y);
+
+    return nrank;
+}
+
+
+void Fitting::fit_cross_validation(const int N,
+                                   const int N_new,
+                                   const int nat,
+                                   const int natmin,
+                                   const int ndata_used,
+                                   const int nmulti,
+                                   const int maxorder,
+                                   double *param_out)
+{
+    // K-fold cross validation of the ridge regression
+    //   min |Ax - b|^2 + alpha |Dx|^2,  D = diag(A^T A)^{1/2}
+    // for cv_nalpha values of alpha.
+    // The snapshots are divided into K folds, and the blocks (A^T A)_k,
+    // (A^T b)_k of each fold are computed only once. The training matrix of
+    // the fold k is A^T A - (A^T A)_k, which is diagonalized once so that
+    // the solutions for all alpha are obtained as
+    //   x = D^{-1} V (Lambda + alpha)^{-1} V^T D^{-1} (A^T b)_train.
+    // The validation error |A_k x - b_k|^2 = x^T (A^T A)_k x - 2 x^T (A^T b)_k + b_k^T b_k
+    // does not require the design matrix either. Finally, all the data are
+    // fitted with the alpha that minimizes the validation error.
+    // When LMODEL = ENET, the elastic net is solved instead along the path of
+    // alpha by the coordinate descent on the same blocks.
+
+    int i, k, ifold, ialpha;
+    int ncol, nfold;
+    int ndata_block, idata_start, idata_end;
+    int lwork, INFO;
+    int inc = 1;
+    double one = 1.0, zero = 0.0;
+    double alpha, b_square, f_square, b_norm;
+    double e_train, e_valid, e_rel;
+    double **gfold, **rfold, *bfold, *ffold;
+    double *gmat, *rvec, *dscale, *eval, *vmat, *cvec;
+    double *work, *gx, *gfx, *param_new;
+    std::vector<double> sum_train, sum_valid, sum_ftrain, sum_fvalid;
+    std::vector<double> sum_rel, sum_rel2;
+
+    const bool algebraic = constraint->constraint_algebraic;
+    const bool enet = (lmodel == "ENET");
+
+    ncol = algebraic ? N_new : N;
+    nfold = cross_validation;
+
+    if (nfold < 2 || nfold > ndata_used) {
+        error->exit("fit_cross_validation",
+                    "CV must be in the range 2 <= CV <= NEND - NSTART + 1.");
+    }
+    if (cv_nalpha <= 0 || cv_minalpha <= 0.0 || cv_maxalpha < cv_minalpha) {
+        error->exit("fit_cross_validation",
+                    "CV_MINALPHA, CV_MAXALPHA, and CV_NALPHA are not consistent.");
+    }
+    if (enet && (l1_ratio <= 0.0 || l1_ratio > 1.0)) {
+        error->exit("fit_cross_validation", "L1_RATIO must be in the range 0 < L1_RATIO <= 1");
+    }
+
+    if (nblock > 0) {
+        ndata_block = nblock;
+    } else {
+        ndata_block = std::max<int>(1, ncol / (3 * nat));
+    }
+
+    std::cout << "  Entering fitting routine: " << nfold << "-fold cross validation of ";
+    if (enet) {
+        std::cout << "elastic net (L1_RATIO = " << l1_ratio << ")" << std::endl;
+    } else {
+        std::cout << "ridge regression" << std::endl;
+    }
+    std::cout << "  Number of regularization parameters : " << cv_nalpha << std::endl;
+    std::cout << std::endl;
+
+    // Normal equations of each fold
+
+    allocate(gfold, nfold, static_cast<long>(ncol) * ncol);
+    allocate(rfold, nfold, ncol);
+    allocate(bfold, nfold);
+    allocate(ffold, nfold);
+    allocate(gmat, static_cast<long>(ncol) * ncol);
+    allocate(rvec, ncol);
+
+    std::fill(gmat, gmat + static_cast<long>(ncol) * ncol, 0.0);
+    for (i = 0; i < ncol; ++i) rvec[i] = 0.0;
+    b_square = 0.0;
+    f_square = 0.0;
+
+    std::cout << "  Calculation of matrix elements for normal equation started ... ";
+
+    for (ifold = 0; ifold < nfold; ++ifold) {
+
+        idata_start = ndata_used * ifold / nfold;
+        idata_end = ndata_used * (ifold + 1) / nfold;
+
+        std::fill(gfold[ifold], gfold[ifold] + static_cast<long>(ncol) * ncol, 0.0);
+        for (i = 0; i < ncol; ++i) rfold[ifold][i] = 0.0;
+        bfold[ifold] = 0.0;
+        ffold[ifold] = 0.0;
+
+        accumulate_normal_equation(ncol, nat, natmin, maxorder,
+                                   idata_start * nmulti,
+                                   (idata_end - idata_start) * nmulti,
+                                   std::min<int>(ndata_block, idata_end - idata_start) * nmulti,
+                                   gfold[ifold], rfold[ifold], bfold[ifold], ffold[ifold]);
+
+        for (long k = 0; k < static_cast<long>(ncol) * ncol; ++k) gmat[k] += gfold[ifold][k];
+        for (i = 0; i < ncol; ++i) rvec[i] += rfold[ifold][i];
+        b_square += bfold[ifold];
+        f_square += ffold[ifold];
+    }
+
+    std::cout << "done!" << std::endl << std::endl;
+
+    // Column scaling so that the penalty does not depend on the units of
+    // the force constants of different orders.
+
+    allocate(dscale, ncol);
+    for (i = 0; i < ncol; ++i) {
+        if (gmat[static_cast<long>(i) * ncol + i] > 0.0) {
+            dscale[i] = 1.0 / std::sqrt(gmat[static_cast<long>(i) * ncol + i]);
+        } else {
+            dscale[i] = 1.0;
+        }
+    }
+    b_norm = (b_square > 0.0) ? std::sqrt(b_square) : 1.0;
+
+    cv_alphas.resize(cv_nalpha);
+    for (ialpha = 0; ialpha < cv_nalpha; ++ialpha) {
+        if (cv_nalpha == 1) {
+            cv_alphas[ialpha] = cv_minalpha;
+        } else {
+            cv_alphas[ialpha] = cv_maxalpha * std::pow(cv_minalpha / cv_maxalpha,
+                                                       static_cast<double>(ialpha)
+                                                       / static_cast<double>(cv_nalpha - 1));
+        }
+    }
+
+    sum_train.assign(cv_nalpha, 0.0);
+    sum_valid.assign(cv_nalpha, 0.0);
+    sum_ftrain.assign(cv_nalpha, 0.0);
+    sum_fvalid.assign(cv_nalpha, 0.0);
+    sum_rel.assign(cv_nalpha, 0.0);
+    sum_rel2.assign(cv_nalpha, 0.0);
+
+    allocate(eval, ncol);
+    allocate(vmat, static_cast<long>(ncol) * ncol);
+    allocate(cvec, ncol);
+    allocate(gx, ncol);
+    allocate(gfx, ncol);
+    allocate(param_new, ncol);
+
+    lwork = -1;
+    dsyev_("V", "U", &ncol, vmat, &ncol, eval, &alpha, &lwork, &INFO);
+    lwork = static_cast<int>(alpha);
+    allocate(work, lwork);
+
+    std::cout << "  Cross validation started ... " << std::endl;
+
+    for (ifold = 0; ifold < nfold; ++ifold) {
+
+        if (enet) {
+
+            // eval and cvec hold the scaled solution and the gradient.
+
+            scaled_gram_matrix(ncol, gmat, gfold[ifold], dscale, true, vmat);
+            for (i = 0; i < ncol; ++i) {
+                eval[i] = 0.0;
+                cvec[i] = (rvec[i] - rfold[ifold][i]) * dscale[i] / b_norm;
+            }
+
+        } else {
+
+            // D^{-1} (A^T A - (A^T A)_k) D^{-1} = V Lambda V^T
+
+            scaled_gram_matrix(ncol, gmat, gfold[ifold], dscale, false, vmat);
+            dsyev_("V", "U", &ncol, vmat, &ncol, eval, work, &lwork, &INFO);
+            if (INFO != 0) {
+                error->exit("fit_cross_validation", "DSYEV failed with INFO = ", INFO);
+            }
+
+            for (i = 0; i < ncol; ++i) gx[i] = (rvec[i] - rfold[ifold][i]) * dscale[i];
+            dgemv_("T", &ncol, &ncol, &one, vmat, &ncol, gx, &inc, &zero, cvec, &inc);
+        }
+
+        for (ialpha = 0; ialpha < cv_nalpha; ++ialpha) {
+
+            alpha = cv_alphas[ialpha];
+
+            if (enet) {
+                coordinate_descent(ncol, vmat, alpha, cv_alphas[std::max<int>(ialpha - 1, 0)],
+                                   eval, cvec);
+                for (i = 0; i < ncol; ++i) param_new[i] = eval[i] * dscale[i] * b_norm;
+            } else {
+                for (i = 0; i < ncol; ++i) {
+                    gx[i] = cvec[i] / (std::max<double>(eval[i], 0.0) + alpha);
+                }
+                dgemv_("N", &ncol, &ncol, &one, vmat, &ncol, gx, &inc, &zero, param_new, &inc);
+                for (i = 0; i < ncol; ++i) param_new[i] *= dscale[i];
+            }
+
+            dsymv_("U", &ncol, &one, gmat, &ncol, param_new, &inc, &zero, gx, &inc);
+            dsymv_("U", &ncol, &one, gfold[ifold], &ncol, param_new, &inc, &zero, gfx, &inc);
+
+            e_train = b_square - bfold[ifold];
+            e_valid = bfold[ifold];
+            for (i = 0; i < ncol; ++i) {
+                e_train += param_new[i] * (gx[i] - gfx[i] - 2.0 * (rvec[i] - rfold[ifold][i]));
+                e_valid += param_new[i] * (gfx[i] - 2.0 * rfold[ifold][i]);
+            }
+            e_train = std::max<double>(e_train, 0.0);
+            e_valid = std::max<double>(e_valid, 0.0);
+
+            sum_train[ialpha] += e_train;
+            sum_valid[ialpha] += e_valid;
+            sum_ftrain[ialpha] += f_square - ffold[ifold];
+            sum_fvalid[ialpha] += ffold[ifold];
+
+            e_rel = std::sqrt(e_valid / ffold[ifold]) * 100.0;
+            sum_rel[ialpha] += e_rel;
+            sum_rel2[ialpha] += e_rel * e_rel;
+        }
+        std::cout << "   Fold " << std::setw(3) << ifold + 1 << " / " << nfold << " done." << std::endl;
+    }
+
+    cv_error_train.resize(cv_nalpha);
+    cv_error_valid.resize(cv_nalpha);
+    cv_error_valid_std.resize(cv_nalpha);
+
+    k = 0;
+    for (ialpha = 0; ialpha < cv_nalpha; ++ialpha) {
+        cv_error_train[ialpha] = std::sqrt(sum_train[ialpha] / sum_ftrain[ialpha]) * 100.0;
+        cv_error_valid[ialpha] = std::sqrt(sum_valid[ialpha] / sum_fvalid[ialpha]) * 100.0;
+        e_rel = sum_rel[ialpha] / static_cast<double>(nfold);
+        cv_error_valid_std[ialpha]
+            = std::sqrt(std::max<double>(sum_rel2[ialpha] / static_cast<double>(nfold) - e_rel * e_rel, 0.0));
+        if (cv_error_valid[ialpha] < cv_error_valid[k]) k = ialpha;
+    }
+    cv_alpha_opt = cv_alphas[k];
+
+    std::cout << std::endl;
+    std::cout << "  Fitting errors (%) of the training and validation sets:" << std::endl;
+    std::cout << "       ALPHA            Training        Validation" << std::endl;
+    for (ialpha = 0; ialpha < cv_nalpha; ++ialpha) {
+        std::cout << "  " << std::scientific << std::setprecision(6)
+            << std::setw(15) << cv_alphas[ialpha]
+            << std::setw(18) << cv_error_train[ialpha]
+            << std::setw(18) << cv_error_valid[ialpha] << std::endl;
+    }
+    std::cout.unsetf(std::ios::scientific);
+    std::cout << std::setprecision(6);
+    std::cout << std::endl;
+    std::cout << "  Minimum validation error at ALPHA = " << cv_alpha_opt << std::endl;
+    std::cout << std::endl;
+
+    // Refit all the data with the optimal alpha
+
+    if (enet) {
+        scaled_gram_matrix(ncol, gmat, nullptr, dscale, true, vmat);
+        for (i = 0; i < ncol; ++i) {
+            eval[i] = 0.0;
+            cvec[i] = rvec[i] * dscale[i] / b_norm;
+        }
+        for (ialpha = 0; ialpha <= k; ++ialpha) {
+            coordinate_descent(ncol, vmat, cv_alphas[ialpha],
+                               cv_alphas[std::max<int>(ialpha - 1, 0)], eval, cvec);
+        }
+        for (i = 0; i < ncol; ++i) param_new[i] = eval[i] * dscale[i] * b_norm;
+    } else {
+        scaled_gram_matrix(ncol, gmat, nullptr, dscale, false, vmat);
+        dsyev_("V", "U", &ncol, vmat, &ncol, eval, work, &lwork, &INFO);
+        if (INFO != 0) {
+            error->exit("fit_cross_validation", "DSYEV failed with INFO = ", INFO);
+        }
+
+        for (i = 0; i < ncol; ++i) gx[i] = rvec[i] * dscale[i];
+        dgemv_("T", &ncol, &ncol, &one, vmat, &ncol, gx, &inc, &zero, cvec, &inc);
+        for (i = 0; i < ncol; ++i) {
+            gx[i] = cvec[i] / (std::max<double>(eval[i], 0.0) + cv_alpha_opt);
+        }
+        dgemv_("N", &ncol, &ncol, &one, vmat, &ncol, gx, &inc, &zero, param_new, &inc);
+        for (i = 0; i < ncol; ++i) param_new[i] *= dscale[i];
+    }
+
+    dsymv_("U", &ncol, &one, gmat, &ncol, param_new, &inc, &zero, gx, &inc);
+    e_train = b_square;
+    for (i = 0; i < ncol; ++i) {
+        e_train += param_new[i] * (gx[i] - 2.0 * rvec[i]);
+    }
+    e_train = std::max<double>(e_train, 0.0);
+
+    std::cout << "  Residual sum of squares for the solution: "
+        << std::sqrt(e_train) << std::endl;
+    fit_error = std::sqrt(e_train / f_square) * 100.0;
+    std::cout << "  Fitting error (%) : "
+        << fit_error << std::endl;
+
+    if (algebraic) {
+        recover_original_forceconstants(maxorder, param_new, param_out);
+    } else {
+        for (i = 0; i < N; ++i) param_out[i] = param_new[i];
+    }
+
+    deallocate(gfold);
+    deallocate(rfold);
+    deallocate(bfold);
+    deallocate(ffold);
+    deallocate(gmat);
+    deallocate(rvec);
+    deallocate(dscale);
+    deallocate(eval);
+    deallocate(vmat);
+    deallocate(cvec);
+    deallocate(work);
+    deallocate(gx);
+    deallocate(gfx);
+    deallocate(param_new);
+}
+
+
+void Fitting::fit_order_by_order(const int N,
+                                 const int N_new,
+                                 const int nat,
+                                 const int natmin,
+                                 const int nmulti,
+                                 const int maxorder,
+                                 double *param_out)
+{
+    // Hierarchical fitting: the force constants are determined order by
+    // order, starting from the harmonic ones. At each step, the forces
+    // predicted by the lower orders are subtracted from the r.h.s. through
+    // the matrix plan, and only the columns of the current order are fitted
+    // by SVD with the data NSTART_ORDER .. NEND_ORDER of that order.
+
+    int i, order;
+    int ncol, ncol_order, icol, M_order;
+    int idata_start, ndata_order;
+    const int nstart = system->nstart;
+    const int nend = system->nend;
+    double *param_new;
+
+    const bool algebraic = constraint->constraint_algebraic;
+
+    ncol = algebraic ? N_new : N;
+
+    if ((!nstart_order.empty() && static_cast<int>(nstart_order.size()) != maxorder)
+        || (!nend_order.empty() && static_cast<int>(nend_order.size()) != maxorder)) {
+        error->exit("fit_order_by_order",
+                    "The number of entries of NSTART_ORDER and NEND_ORDER has to be equal to NORDER.");
+    }
+
+    std::cout << "  Entering fitting routine: order-by-order fitting" << std::endl << std::endl;
+
+    allocate(param_new, ncol);
+    for (i = 0; i < ncol; ++i) param_new[i] = 0.0;
+
+    icol = 0;
+
+    for (order = 0; order < maxorder; ++order) {
+
+        if (algebraic) {
+            ncol_order = constraint->index_bimap[order].size();
+        } else {
+            ncol_order = fcs->nequiv[order].size();
+        }
+
+        i = nstart_order.empty() ? nstart : nstart_order[order];
+        ndata_order = (nend_order.empty() ? nend : nend_order[order]) - i + 1;
+        idata_start = i - nstart;
+
+        if (idata_start < 0 || ndata_order <= 0 || idata_start + ndata_order > nend - nstart + 1) {
+            error->exit("fit_order_by_order",
+                        "NSTART_ORDER and NEND_ORDER must be within NSTART and NEND.");
+        }
+
+        std::cout << "  " << interaction->str_order[order] << " : "
+            << ncol_order << " parameters, data " << i << " - " << i + ndata_order - 1
+            << std::endl;
+
+        if (ncol_order == 0) {
+            std::cout << std::endl;
+            continue;
+        }
+
+        build_matrix_element_plan(maxorder, order, param_new);
+
+        M_order = 3 * natmin * ndata_order * nmulti;
+
+        DesignMatrix dmat;
+        dmat.resize(M_order, ncol_order);
+        calc_matrix_elements(ncol_order, nat, natmin, idata_start, ndata_order,
+                             nmulti, maxorder, dmat);
+
+        fit_without_constraints(ncol_order, M_order, dmat, param_new + icol,
+                                resolve_dense_solver(dmat));
+        std::cout << std::endl;
+
+        icol += ncol_order;
+    }
+
+    // Restore the plan of the whole problem
+    build_matrix_element_plan(maxorder, -1, nullptr);
+
+    if (algebraic) {
+        recover_original_forceconstants(maxorder, param_new, param_out);
+    } else {
+        for (i = 0; i < N; ++i) param_out[i] = param_new[i];
+    }
+
+    deallocate(param_new);
+}
+
+
+void Fitting::fit_elastic_net(const int N,
+                              const int N_new,
+                              const int nat,
+                              const int natmin,
+                              const int ndata_used,
+                              const int nmulti,
+                              const int maxorder,
+                              double *param_out)
+{
+    // Elastic-net regression
+    //   min 1/2 |A'x' - b'|^2 + alpha (rho |x'|_1 + (1 - rho)/2 |x'|^2)
+    // with the scaled columns A' = A D^{-1} (D = diag(A^T A)^{1/2}) and
+    // b' = b / |b|, so that alpha is dimensionless. rho is L1_RATIO
+    // (rho = 1: LASSO). The problem is solved on the Gram matrix A'^T A'
+    // by the coordinate descent, starting from alpha_max, where all the
+    // parameters vanish, and halving alpha down to L1_ALPHA with warm starts.
+
+    int i, j;
+    int ncol, ndata_block, nzero, niter;
+    int inc = 1;
+    double one = 1.0, zero = 0.0;
+    double b_square, f_square, b_norm, f_residual;
+    double alpha, alpha_prev, alpha_max;
+    double *gmat, *rvec, *dscale, *gscaled, *grad, *xscaled, *gx;
+    double *param_new;
+
+    const bool algebraic = constraint->constraint_algebraic;
+
+    ncol = algebraic ? N_new : N;
+
+    if (l1_alpha <= 0.0) {
+        error->exit("fit_elastic_net", "L1_ALPHA must be positive when LMODEL = ENET and CV = 0.");
+    }
+    if (l1_ratio <= 0.0 || l1_ratio > 1.0) {
+        error->exit("fit_elastic_net", "L1_RATIO must be in the range 0 < L1_RATIO <= 1");
+    }
+
+    if (nblock > 0) {
+        ndata_block = nblock;
+    } else {
+        ndata_block = std::max<int>(1, ncol / (3 * nat));
+    }
+    ndata_block = std::min<int>(ndata_block, ndata_used);
+
+    std::cout << "  Entering fitting routine: Elastic net by coordinate descent" << std::endl;
+    std::cout << "  L1_ALPHA = " << l1_alpha << "; L1_RATIO = " << l1_ratio << std::endl;
+    std::cout << std::endl;
+
+    allocate(gmat, static_cast<long>(ncol) * ncol);
+    allocate(rvec, ncol);
+
+    std::fill(gmat, gmat + static_cast<long>(ncol) * ncol, 0.0);
+    for (i = 0; i < ncol; ++i) rvec[i] = 0.0;
+    b_square = 0.0;
+    f_square = 0.0;
+
+    std::cout << "  Calculation of matrix elements for normal equation started ... ";
+
+    accumulate_normal_equation(ncol, nat, natmin, maxorder,
+                               0, ndata_used * nmulti, ndata_block * nmulti,
+                               gmat, rvec, b_square, f_square);
+
+    std::cout << "done!" << std::endl << std::endl;
+
+    allocate(dscale, ncol);
+    for (i = 0; i < ncol; ++i) {
+        if (gmat[static_cast<long>(i) * ncol + i] > 0.0) {
+            dscale[i] = 1.0 / std::sqrt(gmat[static_cast<long>(i) * ncol + i]);
+        } else {
+            dscale[i] = 1.0;
+        }
+    }
+    b_norm = (b_square > 0.0) ? std::sqrt(b_square) : 1.0;
+
+    allocate(gscaled, static_cast<long>(ncol) * ncol);
+    allocate(grad, ncol);
+    allocate(xscaled, ncol);
+
+    scaled_gram_matrix(ncol, gmat, nullptr, dscale, true, gscaled);
+
+    alpha_max = 0.0;
+    for (i = 0; i < ncol; ++i) {
+        xscaled[i] = 0.0;
+        grad[i] = rvec[i] * dscale[i] / b_norm;
+        alpha_max = std::max<double>(alpha_max, std::abs(grad[i]));
+    }
+    alpha_max /= l1_ratio;
+
+    std::cout << "  Coordinate descent along the path from alpha_max = " << alpha_max << std::endl;
+
+    alpha = std::max<double>(alpha_max, l1_alpha);
+    niter = 0;
+    do {
+        alpha_prev = alpha;
+        alpha = std::max<double>(0.5 * alpha, l1_alpha);
+        niter += coordinate_descent(ncol, gscaled, alpha, alpha_prev, xscaled, grad);
+    } while (alpha > l1_alpha);
+
+    std::cout << "  Total number of sweeps : " << niter << std::endl;
+
+    allocate(param_new, ncol);
+    allocate(gx, ncol);
+
+    nzero = 0;
+    for (i = 0; i < ncol; ++i) {
+        param_new[i] = xscaled[i] * dscale[i] * b_norm;
+        if (xscaled[i] == 0.0) ++nzero;
+    }
+
+    std::cout << "  Number of nonzero parameters : " << ncol - nzero
+        << " / " << ncol << std::endl;
+
+    dsymv_("U", &ncol, &one, gmat, &ncol, param_new, &inc, &zero, gx, &inc);
+    f_residual = b_square;
+    for (j = 0; j < ncol; ++j) {
+        f_residual += param_new[j] * (gx[j] - 2.0 * rvec[j]);
+    }
+    f_residual = std::max<double>(f_residual, 0.0);
+
+    std::cout << std::endl << "  Residual sum of squares for the solution: "
+        << std::sqrt(f_residual) << std::endl;
+    fit_error = std::sqrt(f_residual / f_square) * 100.0;
+    std::cout << "  Fitting error (%) : "
+        << fit_error << std::endl;
+
+    if (algebraic) {
+        recover_original_forceconstants(maxorder, param_new, param_out);
+    } else {
+        for (i = 0; i < N; ++i) param_out[i] = param_new[i];
+    }
+
+    deallocate(gmat);
+    deallocate(rvec);
+    deallocate(dscale);
+    deallocate(gscaled);
+    deallocate(grad);
+    deallocate(xscaled);
+    deallocate(gx);
+    deallocate(param_new);
+}
+
+
+int Fitting::coordinate_descent(const int n,
+                                const double *gmat,
+                                const double alpha,
+                                const double alpha_prev,
+                                double *x,
+                                double *grad)
+{
+    // Coordinate descent for
+    //   min 1/2 x^T G x - x^T r + alpha (rho |x|_1 + (1 - rho)/2 |x|^2)
+    // on the full symmetric n x n matrix G, starting from the solution x at
+    // alpha_prev. grad = r - G x is kept consistent with x on entry and exit.
+    // The sequential strong rule discards the coordinates with
+    // |grad_j| < rho (2 alpha - alpha_prev), and the discarded coordinates
+    // are checked with the KKT condition after the convergence.
+    // Returns the number of sweeps.
+
+    int i, j, iter, niter, maxiter_cd;
+    int nviol;
+    double l1, l2, thresh_strong;
+    double gjj, z, xnew, delta, dmax, xmax;
+    std::vector<int> active;
+    std::vector<int> strong(n);
+
+    maxiter_cd = (maxiter > 0) ? maxiter : std::max<int>(1000, 10 * n);
+
+    l1 = alpha * l1_ratio;
+    l2 = alpha * (1.0 - l1_ratio);
+    thresh_strong = l1_ratio * (2.0 * alpha - alpha_prev);
+
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for (j = 0; j < n; ++j) {
+        strong[j] = (x[j] != 0.0 || std::abs(grad[j]) >= thresh_strong);
+    }
+
+    niter = 0;
+
+    while (true) {
+
+        active.clear();
+        for (j = 0; j < n; ++j) {
+            if (strong[j]) active.push_back(j);
+        }
+
+        for (iter = 0; iter < maxiter_cd; ++iter) {
+            dmax = 0.0;
+            xmax = 0.0;
+
+            for (auto it = active.begin(); it != active.end(); ++it) {
+                j = *it;
+                gjj = gmat[j + static_cast<long>(j) * n] + l2;
+                if (gjj <= 0.0) continue;
+
+                z = grad[j] + gmat[j + static_cast<long>(j) * n] * x[j];
+                if (z > l1) {
+                    xnew = (z - l1) / gjj;
+                } else if (z < -l1) {
+                    xnew = (z + l1) / gjj;
+                } else {
+                    xnew = 0.0;
+                }
+                delta = xnew - x[j];
+
+                if (delta != 0.0) {
+                    x[j] = xnew;
+                    const double *gcol = gmat + static_cast<long>(j) * n;
+                    // The O(n) update dominates each step. Threads pay off
+                    // only when it outweighs the cost of the fork and join.
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if (n >= 4096)
+#endif
+                    for (i = 0; i < n; ++i) grad[i] -= gcol[i] * delta;
+                }
+                dmax = std::max<double>(dmax, std::abs(delta));
+                xmax = std::max<double>(xmax, std::abs(x[j]));
+            }
+            ++niter;
+            if (dmax <= tol_iter * xmax) break;
+        }
+
+        nviol = 0;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:nviol)
+#endif
+        for (j = 0; j < n; ++j) {
+            if (!strong[j] && std::abs(grad[j]) > l1) {
+                strong[j] = 1;
+                ++nviol;
+            }
+        }
+        if (nviol == 0) break;
+    }
+
+    return niter;
+}
+
+
+void Fitting::fit_sparse(const int N,
+                         const int N_new,
+                         const int nat,
+                         const int natmin,
+                         const int ndata_used,
+                         const int nmulti,
+                         const int maxorder,
+                         double *param_out)
+{
+    // Least-squares fitting with the design matrix stored in the CSR format.
+    // The number of nonzero elements of each row is bounded by the number of
+    // parameters involving the corresponding atom in the primitive cell,
+    // so that the memory scales with the number of nonzeros instead of M*N.
+
+    int i;
+    int ncol, ncycle;
+    long nrow;
+    int nrank = -1;
+    double f_square, f_residual;
+    double *fsum, *fsum_orig, *res;
+    double *param_new;
+    SparseDesignMatrix amat;
+
+    const bool algebraic = constraint->constraint_algebraic;
+
+    ncol = algebraic ? N_new : N;
+    ncycle = ndata_used * nmulti;
+    nrow = 3L * natmin * ncycle;
+
+    std::cout << "  Entering fitting routine: sparse design matrix with "
+        << sparse_solver << std::endl << std::endl;
+
+    allocate(fsum, nrow);
+    allocate(fsum_orig, nrow);
+
+    std::cout << "  Calculation of matrix elements in the sparse format started ... ";
+
+    calc_matrix_elements_sparse(ncol, nat, natmin, ncycle, maxorder,
+                                amat, fsum, fsum_orig);
+
+    std::cout << "done!" << std::endl << std::endl;
+
+    std::cout << "  Number of nonzero elements : " << amat.val.size()
+        << " (" << std::setprecision(3)
+        << 100.0 * static_cast<double>(amat.val.size())
+        / (static_cast<double>(nrow) * static_cast<double>(ncol))
+        << " %)" << std::setprecision(6) << std::endl << std::endl;
+
+    allocate(param_new, ncol);
+    for (i = 0; i < ncol; ++i) param_new[i] = 0.0;
+
+    if (sparse_solver == "QR") {
+
+#ifdef _USE_EIGEN
+        std::vector<Eigen::Triplet<double>> triplets;
+        Eigen::SparseMatrix<double> amat_eigen(nrow, ncol);
+        Eigen::SparseQR<Eigen::SparseMatrix<double>, Eigen::COLAMDOrdering<int>> qr;
+
+        triplets.reserve(amat.val.size());
+        for (i = 0; i < nrow; ++i) {
+            for (size_t k = amat.rowptr[i]; k < amat.rowptr[i + 1]; ++k) {
+                triplets.push_back(Eigen::Triplet<double>(i, amat.colind[k], amat.val[k]));
+            }
+        }
+        amat_eigen.setFromTriplets(triplets.begin(), triplets.end());
+        amat_eigen.makeCompressed();
+        triplets.clear();
+
+        std::cout << "  Sparse QR decomposition has started ... ";
+
+        qr.compute(amat_eigen);
+        if (qr.info() != Eigen::Success) {
+            error->exit("fit_sparse", "Sparse QR decomposition failed.");
+        }
+        Eigen::VectorXd xvec = qr.solve(Eigen::Map<Eigen::VectorXd>(fsum, nrow));
+        for (i = 0; i < ncol; ++i) param_new[i] = xvec(i);
+        nrank = qr.rank();
+
+        std::cout << "finished !" << std::endl << std::endl;
+#else
+        error->exit("fit_sparse",
+                    "SPARSESOLVER = QR is not available. Please recompile ALM with Eigen (-D_USE_EIGEN).");
+#endif
+
+    } else {
+
+        run_iterative_solver(amat, fsum, param_new, "LSQR", maxorder);
+    }
+
+    if (nrank >= 0) {
+        fit_rank = nrank;
+        std::cout << "  RANK of the matrix = " << nrank << std::endl;
+        if (nrank < ncol)
+            error->warn("fit_sparse",
+                        "Matrix is rank-deficient. Force constants could not be determined uniquely :(");
+    }
+
+    allocate(res, nrow);
+    amat.multiply(param_new, res);
+
+    f_residual = 0.0;
+    f_square = 0.0;
+    for (long k = 0; k < nrow; ++k) {
+        f_residual += std::pow(fsum[k] - res[k], 2);
+        f_square += std::pow(fsum_orig[k], 2);
+    }
+
+    std::cout << std::endl << "  Residual sum of squares for the solution: "
+        << std::sqrt(f_residual) << std::endl;
+    fit_error = std::sqrt(f_residual / f_square) * 100.0;
+    std::cout << "  Fitting error (%) : "
+        << fit_error << std::endl;
+
+    if (algebraic) {
+        recover_original_forceconstants(maxorder, param_new, param_out);
+    } else {
+        for (i = 0; i < N; ++i) param_out[i] = param_new[i];
+    }
+
+    deallocate(res);
+    deallocate(param_new);
+    deallocate(fsum);
+    deallocate(fsum_orig);
+}
+
+
+void Fitting::fit_out_of_core(const int N,
+                              const int N_new,
+                              const int nat,
+                              const int natmin,
+                              const int ndata_used,
+                              const int nmulti,
+                              const int maxorder,
+                              double *param_out)
+{
+    // Out-of-core least-squares fitting.
+    // The augmented matrix (A b) is built by row panels in a memory-mapped
+    // scratch file, and the panels are then streamed from the file to the
+    // tall-skinny QR decomposition (DTPQRT), which reduces (A b) to its
+    // (ncol+1) x (ncol+1) triangular factor. Only one panel and the
+    // triangular factor are required to be in memory at a time.
+
+#ifdef _HAVE_MMAP
+    int i, ipanel, ichunk, nchunk;
+    int ncol, nc1, ncycle, nrank;
+    int nsnap_panel, npanel;
+    int icycle_start, ncycle_panel;
+    int fd;
+    long nrow_panel, nrow_p;
+    size_t panel_stride, file_size;
+    long page_size;
+    double f_square, f_residual;
+    double *rmat, *fsum_orig;
+    double *param_new;
+    char *base;
+    std::string file_scratch;
+
+    const bool algebraic = constraint->constraint_algebraic;
+
+    ncol = algebraic ? N_new : N;
+    nc1 = ncol + 1;
+    ncycle = ndata_used * nmulti;
+
+    nsnap_panel = snapshots_per_panel(nc1, natmin, ncycle);
+    npanel = (ncycle + nsnap_panel - 1) / nsnap_panel;
+    nrow_panel = 3L * natmin * nsnap_panel;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    panel_stride = static_cast<size_t>(nrow_panel) * nc1 * sizeof(double);
+    panel_stride = ((panel_stride + page_size - 1) / page_size) * page_size;
+    file_size = panel_stride * npanel;
+
+    file_scratch = scratch_dir + "/" + files->job_title + ".scratch";
+
+    std::cout << "  Entering fitting routine: out-of-core TSQR" << std::endl;
+    std::cout << "  Scratch file : " << file_scratch
+        << " (" << file_size / 1000000 << " MB)" << std::endl;
+    std::cout << "  Number of panels : " << npanel
+        << " (" << nrow_panel << " rows each)" << std::endl << std::endl;
+
+    fd = open(file_scratch.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        error->exit("fit_out_of_core", "Cannot open the scratch file ", file_scratch.c_str());
+    }
+    if (ftruncate(fd, file_size) != 0) {
+        error->exit("fit_out_of_core", "Cannot resize the scratch file ", file_scratch.c_str());
+    }
+    base = static_cast<char *>(mmap(nullptr, file_size, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED, fd, 0));
+    if (base == MAP_FAILED) {
+        error->exit("fit_out_of_core", "mmap of the scratch file failed.");
+    }
+
+    // Build the panels. Within a panel, the column-major (A b) has the
+    // leading dimension nrow_p, and the rows are grouped by chunks.
+
+    allocate(fsum_orig, nrow_panel);
+    f_square = 0.0;
+
+    std::cout << "  Calculation of matrix elements to the scratch file started ... ";
+
+    for (ipanel = 0; ipanel < npanel; ++ipanel) {
+
+        double *panel = reinterpret_cast<double *>(base + panel_stride * static_cast<size_t>(ipanel));
+
+        icycle_start = ipanel * nsnap_panel;
+        ncycle_panel = std::min<int>(nsnap_panel, ncycle - icycle_start);
+        nrow_p = 3L * natmin * ncycle_panel;
+        nchunk = (ncycle_panel + nsnap_chunk - 1) / nsnap_chunk;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (ichunk = 0; ichunk < nchunk; ++ichunk) {
+            const int irow0 = ichunk * nsnap_chunk;
+            const long ioffset = 3L * natmin * irow0;
+            calc_matrix_elements_chunk(ncol, nat, natmin, maxorder,
+                                       icycle_start + irow0,
+                                       std::min<int>(nsnap_chunk, ncycle_panel - irow0),
+                                       panel + ioffset, nrow_p,
+                                       panel + static_cast<long>(ncol) * nrow_p + ioffset,
+                                       fsum_orig + ioffset);
+        }
+
+        for (long k = 0; k < nrow_p; ++k) f_square += fsum_orig[k] * fsum_orig[k];
+
+        madvise(panel, panel_stride, MADV_DONTNEED);
+    }
+
+    deallocate(fsum_orig);
+
+    std::cout << "done!" << std::endl << std::endl;
+
+    // Tall-skinny QR: R <- qr((R; panel))
+
+    allocate(rmat, static_cast<long>(nc1) * nc1);
+
+    std::fill(rmat, rmat + static_cast<long>(nc1) * nc1, 0.0);
+
+    std::cout << "  TSQR has started ... ";
+
+    for (ipanel = 0; ipanel < npanel; ++ipanel) {
+
+        double *panel = reinterpret_cast<double *>(base + panel_stride * static_cast<size_t>(ipanel));
+
+        if (ipanel + 1 < npanel) {
+            madvise(base + panel_stride * (ipanel + 1), panel_stride, MADV_WILLNEED);
+        }
+
+        icycle_start = ipanel * nsnap_panel;
+        ncycle_panel = std::min<int>(nsnap_panel, ncycle - icycle_start);
+        nrow_p = 3L * natmin * ncycle_panel;
+
+        add_rows_to_triangular_factor(nc1, static_cast<int>(nrow_p), panel, rmat);
+
+        madvise(panel, panel_stride, MADV_DONTNEED);
+    }
+
+    std::cout << "finished !" << std::endl << std::endl;
+
+    munmap(base, file_size);
+    close(fd);
+    unlink(file_scratch.c_str());
+
+    allocate(param_new, ncol);
+
+    nrank = solve_triangular_factor(ncol, rmat, nc1, param_new, f_residual);
+
+    fit_rank = nrank;
+    std::cout << "  RANK of the matrix = " << nrank << std::endl;
+    if (nrank < ncol)
+        error->warn("fit_out_of_core",
+                    "Matrix is rank-deficient. Force constants could not be determined uniquely :(");
+
+    std::cout << std::endl << "  Residual sum of squares for the solution: "
+        << std::sqrt(f_residual) << std::endl;
+    fit_error = std::sqrt(f_residual / f_square) * 100.0;
+    std::cout << "  Fitting error (%) : "
+        << fit_error << std::endl;
+
+    if (algebraic) {
+        recover_original_forceconstants(maxorder, param_new, param_out);
+    } else {
+        for (i = 0; i < N; ++i) param_out[i] = param_new[i];
+    }
+
+    deallocate(param_new);
+
+    // Keep the factor for append_displacement_and_force
+    rfactor = rmat;
+    ncol_rfactor = ncol;
+    f_square_rfactor = f_square;
+#else
+    error->exit("fit_out_of_core", "SCRATCH is not supported on this platform.");
+#endif
+}
+
+
+void Fitting::add_rows_to_triangular_factor(const int nc1,
+                                            const int nrow,
+                                            double *panel,
+                                            double *rmat)
+{
+    // R <- triangular factor of (R; panel) by DTPQRT, where rmat is the
+    // nc1 x nc1 upper triangular matrix and panel is the column-major
+    // nrow x nc1 matrix (destroyed).
+
+    int m = nrow, n = nc1, izero = 0, nb, INFO;
+    double *tmat, *work;
+
+    if (nrow == 0) return;
+
+    nb = std::min<int>(nc1, 64);
+    allocate(tmat, static_cast<long>(nb) * nc1);
+    allocate(work, static_cast<long>(nb) * nc1);
+
+    dtpqrt_(&m, &n, &izero, &nb, rmat, &n, panel, &m, tmat, &nb, work, &INFO);
+
+    if (INFO != 0) {
+        error->exit("add_rows_to_triangular_factor", "DTPQRT failed with INFO = ", INFO);
+    }
+
+    deallocate(tmat);
+    deallocate(work);
+}
+
+
+void Fitting::update_triangular_factor(const int ncol,
+                                       const int nat,
+                                       const int natmin,
+                                       const int icycle_start,
+                                       const int ncycle,
+                                       double *rmat,
+                                       double &f_square)
+{
+    // Fold the rows of the snapshots icycle_start .. icycle_start+ncycle-1
+    // into the (ncol+1) x (ncol+1) triangular factor rmat of (A b).
+    // The rows are generated by panels, and each thread folds its panels
+    // into its own triangular factor by DTPQRT as soon as they are built.
+    // The factors of the threads are merged pairwise in a binary tree,
+    // and the result is merged into rmat.
+
+    int i, ipanel, ifactor, stride;
+    int nsnap_panel, npanel, nfactor;
+    int nthreads = 1;
+    const int nc1 = ncol + 1;
+    const int maxorder = interaction->maxorder;
+    double f_square_local = 0.0;
+    double *rlocal;
+
+    if (ncycle == 0) return;
+
+    nsnap_panel = snapshots_per_panel(nc1, natmin, ncycle);
+    npanel = (ncycle + nsnap_panel - 1) / nsnap_panel;
+
+#ifdef _OPENMP
+    nthreads = omp_get_max_threads();
+#endif
+    nfactor = std::min<int>(nthreads, npanel);
+
+    allocate(rlocal, static_cast<long>(nfactor) * nc1 * nc1);
+
+    for (long k = 0; k < static_cast<long>(nfactor) * nc1 * nc1; ++k) rlocal[k] = 0.0;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nfactor) private(i) reduction(+:f_square_local)
+#endif
+    {
+        int ichunk, nchunk, istart, ncycle_panel, nrow_p;
+        int ithread = 0;
+        const int nrow_panel = 3 * natmin * nsnap_panel;
+        double *panel, *fsum_orig, *rthread;
+
+#ifdef _OPENMP
+        ithread = omp_get_thread_num();
+#endif
+        rthread = rlocal + static_cast<long>(ithread) * nc1 * nc1;
+
+        allocate(panel, static_cast<long>(nrow_panel) * nc1);
+        allocate(fsum_orig, nrow_panel);
+
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (ipanel = 0; ipanel < npanel; ++ipanel) {
+
+            istart = ipanel * nsnap_panel;
+            ncycle_panel = std::min<int>(nsnap_panel, ncycle - istart);
+            nrow_p = 3 * natmin * ncycle_panel;
+            nchunk = (ncycle_panel + nsnap_chunk - 1) / nsnap_chunk;
+
+            for (ichunk = 0; ichunk < nchunk; ++ichunk) {
+                const int irow0 = ichunk * nsnap_chunk;
+                const long ioffset = 3 * natmin * irow0;
+                calc_matrix_elements_chunk(ncol, nat, natmin, maxorder,
+                                           icycle_start + istart + irow0,
+                                           std::min<int>(nsnap_chunk, ncycle_panel - irow0),
+                                           panel + ioffset, nrow_p,
+                                           panel + static_cast<long>(ncol) * nrow_p + ioffset,
+                                           fsum_orig + ioffset);
+            }
+
+            for (i = 0; i < nrow_p; ++i) f_square_local += fsum_orig[i] * fsum_orig[i];
+
+            add_rows_to_triangular_factor(nc1, nrow_p, panel, rthread);
+        }
+
+        deallocate(panel);
+        deallocate(fsum_orig);
+    }
+
+    // Binary-tree reduction: R_i <- qr((R_i; R_{i+stride}))
+
+    for (stride = 1; stride < nfactor; stride *= 2) {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+        for (ifactor = 0; ifactor < nfactor - stride; ifactor += 2 * stride) {
+            merge_triangular_factors(nc1,
+                                     rlocal + static_cast<long>(ifactor) * nc1 * nc1,
+                                     rlocal + static_cast<long>(ifactor + stride) * nc1 * nc1);
+        }
+    }
+
+    merge_triangular_factors(nc1, rmat, rlocal);
+
+    deallocate(rlocal);
+
+    f_square += f_square_local;
+}
+
+
+int Fitting::snapshots_per_panel(const int nc1,
+                                 const int natmin,
+                                 const int ncycle) const
+{
+    // Number of snapshots in a row panel of (A b), which is a multiple of
+    // nsnap_chunk. A panel has about 4*nc1 rows, or MAXMEM MB if given.
+
+    int nsnap_panel;
+
+    if (maxmem > 0.0) {
+        nsnap_panel = static_cast<int>(maxmem * 1.0e+6
+            / (sizeof(double) * static_cast<double>(nc1) * 3 * natmin));
+    } else {
+        nsnap_panel = (4 * nc1 + 3 * natmin - 1) / (3 * natmin);
+    }
+    nsnap_panel = std::max<int>(nsnap_chunk, (nsnap_panel / nsnap_chunk) * nsnap_chunk);
+    return std::max<int>(1, std::min<int>(nsnap_panel, ncycle));
+}
+
+
+int Fitting::solve_triangular_factor(const int n,
+                                     const double *rmat,
+                                     const int ldr,
+                                     double *x,
+                                     double &f_residual)
+{
+    // Least-squares solution from the triangular factor (R c; 0 rho)
+    // of the augmented matrix (A b), which gives
+    //   |A x - b|^2 = |R x - c|^2 + rho^2.
+    // The equality constraints of ICONST < 10 are imposed with DGGLSE
+    // on the n x n problem; otherwise, DGELSS gives the minimum-norm solution.
+    // Returns the rank, and the residual sum of squares in f_residual.
+
+    int i, j;
+    int n_ = n;
+    int nrhs = 1, nrank, INFO, LWORK;
+    double rcond = -1.0;
+    double work_tmp, tmp;
+    double *rr, *cvec, *WORK;
+
+    allocate(rr, static_cast<long>(n) * n);
+    allocate(cvec, n);
+
+    for (j = 0; j < n; ++j) {
+        for (i = 0; i < n; ++i) {
+            rr[i + static_cast<long>(n) * j] = (i <= j) ? rmat[i + static_cast<long>(ldr) * j] : 0.0;
+        }
+        cvec[j] = rmat[j + static_cast<long>(ldr) * n];
+    }
+
+    if (constraint->exist_constraint && !constraint->constraint_algebraic) {
+
+        int P = constraint->P;
+        double *cmat_mod, *dvec;
+
+        allocate(cmat_mod, static_cast<long>(P) * n);
+        allocate(dvec, P);
+        for (j = 0; j < n; ++j) {
+            for (i = 0; i < P; ++i) {
+                cmat_mod[i + static_cast<long>(P) * j] = constraint->const_mat[i][j];
+            }
+        }
+        for (i = 0; i < P; ++i) dvec[i] = constraint->const_rhs[i];
+
+        LWORK = -1;
+        dgglse_(&n_, &n_, &P, rr, &n_, cmat_mod, &P, cvec, dvec, x,
+                &work_tmp, &LWORK, &INFO);
+        LWORK = static_cast<int>(work_tmp);
+        allocate(WORK, LWORK);
+        dgglse_(&n_, &n_, &P, rr, &n_, cmat_mod, &P, cvec, dvec, x,
+                WORK, &LWORK, &INFO);
+        deallocate(WORK);
+
+        nrank = rank_from_diagonal(P, cmat_mod + static_cast<long>(P) * (n - P), P, eps12);
+        if (INFO != 1) nrank += rank_from_diagonal(n - P, rr, n, eps12);
+
+        deallocate(cmat_mod);
+        deallocate(dvec);
+
+    } else {
+
+        double *S;
+        allocate(S, n);
+
+        LWORK = -1;
+        dgelss_(&n_, &n_, &nrhs, rr, &n_, cvec, &n_, S, &rcond, &nrank,
+                &work_tmp, &LWORK, &INFO);
+        LWORK = static_cast<int>(work_tmp);
+        allocate(WORK, LWORK);
+        dgelss_(&n_, &n_, &nrhs, rr, &n_, cvec, &n_, S, &rcond, &nrank,
+                WORK, &LWORK, &INFO);
+        deallocate(WORK);
+        deallocate(S);
+
+        for (i = 0; i < n; ++i) x[i] = cvec[i];
+    }
+
+    tmp = rmat[n + static_cast<long>(ldr) * n];
+    f_residual = tmp * tmp;
+    for (i = 0; i < n; ++i) {
+        tmp = -rmat[i + static_cast<long>(ldr) * n];
+        for (j = i; j < n; ++j) tmp += rmat[i + static_cast<long>(ldr) * j] * x[j];
+        f_residual += tmp * tmp;
+    }
+
+    deallocate(rr);
+    deallocate(cvec);
+
+    return nrank;
+}
+
+
+void Fitting::fit_tsqr(const int N,
+                        const int N_new,
+                        const int nat,
+                        const int natmin,
+                        const int ndata_used,
+                        const int nmulti,
+                        const int maxorder,
+                        double *param_out)
+{
+    // Least-squares fitting by the communication-avoiding tall-skinny QR.
+    // The triangular factor of (A b) is built by update_triangular_factor,
+    // where the threads factorize their row panels while they are built,
+    // so that no M x N matrix is stored. With MPI, the snapshots are
+    // distributed over the processes, and the factors of the processes are
+    // merged in a binary tree. R is solved by back substitution, and the SVD
+    // of R is used only when R is rank-deficient or ICONST < 10.
+
+    int i;
+    int ncol, nc1, nrank;
+    int idata_begin, idata_end;
+    int icycle_begin, icycle_end;
+    int inc = 1, INFO;
+    double f_square, f_residual;
+    double *rmat, *param_new;
+
+    const bool algebraic = constraint->constraint_algebraic;
+
+    ncol = algebraic ? N_new : N;
+    nc1 = ncol + 1;
+
+    // Contiguous block of the snapshots of this process. When the snapshots
+    // are distributed, u_in and f_in hold this block only.
+
+    snapshot_block(ndata_used, nprocs, my_rank, idata_begin, idata_end);
+    if (snapshots_distributed) {
+        idata_end -= idata_begin;
+        idata_begin = 0;
+    }
+    icycle_begin = idata_begin * nmulti;
+    icycle_end = idata_end * nmulti;
+
+    std::cout << "  Entering fitting routine: TSQR" << std::endl;
+    if (nprocs > 1) {
+        std::cout << "  Number of MPI processes : " << nprocs << std::endl;
+    }
+    std::cout << "  Number of rows in a panel : "
+        << 3 * natmin * snapshots_per_panel(nc1, natmin, icycle_end - icycle_begin)
+        << std::endl << std::endl;
+
+    allocate(rmat, static_cast<long>(nc1) * nc1);
+
+    std::fill(rmat, rmat + static_cast<long>(nc1) * nc1, 0.0);
+    f_square = 0.0;
+
+    std::cout << "  Calculation of matrix elements and TSQR started ... ";
+
+    update_triangular_factor(ncol, nat, natmin, icycle_begin, icycle_end - icycle_begin,
+                             rmat, f_square);
+
+#ifdef _USE_MPI
+    if (nprocs > 1) {
+        reduce_triangular_factor(nc1, rmat, f_square);
+    }
+#endif
+
+    std::cout << "done!" << std::endl << std::endl;
+
+    allocate(param_new, ncol);
+
+    nrank = rank_from_diagonal(ncol, rmat, nc1, eps12);
+
+    if (nrank == ncol && (algebraic || !constraint->exist_constraint)) {
+
+        // R x = c by back substitution, and |A x - b|^2 = rho^2
+
+        double *rr;
+        allocate(rr, static_cast<long>(nc1) * nc1);
+        std::copy(rmat, rmat + static_cast<long>(nc1) * nc1, rr);
+        for (i = 0; i < ncol; ++i) param_new[i] = rmat[i + static_cast<long>(nc1) * ncol];
+
+        dtrtrs_("U", "N", "N", &ncol, &inc, rr, &nc1, param_new, &ncol, &INFO);
+        deallocate(rr);
+
+        f_residual = std::pow(rmat[ncol + static_cast<long>(nc1) * ncol], 2);
+
+    } else {
+        nrank = solve_triangular_factor(ncol, rmat, nc1, param_new, f_residual);
+    }
+
+    fit_rank = nrank;
+    std::cout << "  RANK of the matrix = " << nrank << std::endl;
+    if (nrank < ncol)
+        error->warn("fit_tsqr",
+                    "Matrix is rank-deficient. Force constants could not be determined uniquely :(");
+
+    std::cout << std::endl << "  Residual sum of squares for the solution: "
+        << std::sqrt(f_residual) << std::endl;
+    fit_error = std::sqrt(f_residual / f_square) * 100.0;
+    std::cout << "  Fitting error (%) : "
+        << fit_error << std::endl;
+
+    if (algebraic) {
+        recover_original_forceconstants(maxorder, param_new, param_out);
+    } else {
+        for (i = 0; i < N; ++i) param_out[i] = param_new[i];
+    }
+
+    deallocate(param_new);
+
+    // Keep the factor for append_displacement_and_force
+    rfactor = rmat;
+    ncol_rfactor = ncol;
+    f_square_rfactor = f_square;
+}
+
+
+#ifdef _USE_MPI
+void Fitting::reduce_triangular_factor(const int nc1,
+                                       double *rmat,
+                                       double &f_square)
+{
+    // Merge the triangular factors of all MPI processes in a binary tree.
+    // On return, every process has the factor of the whole data and the
+    // total f_square.
+
+    int stride;
+    long i;
+    const long n2 = static_cast<long>(nc1) * nc1;
+    double *rrecv;
+
+    allocate(rrecv, n2);
+
+    // MPI takes the counts in int, so that the factor is sent in chunks.
+
+    for (stride = 1; stride < nprocs; stride *= 2) {
+        if (my_rank % (2 * stride) == 0) {
+            if (my_rank + stride < nprocs) {
+                for (i = 0; i < n2; i += mpi_chunk) {
+                    MPI_Recv(rrecv + i, static_cast<int>(std::min<long>(mpi_chunk, n2 - i)),
+                             MPI_DOUBLE, my_rank + stride, stride,
+                             MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                }
+                merge_triangular_factors(nc1, rmat, rrecv);
+            }
+        } else if (my_rank % (2 * stride) == stride) {
+            for (i = 0; i < n2; i += mpi_chunk) {
+                MPI_Send(rmat + i, static_cast<int>(std::min<long>(mpi_chunk, n2 - i)),
+                         MPI_DOUBLE, my_rank - stride, stride, MPI_COMM_WORLD);
+            }
+        }
+    }
+
+    deallocate(rrecv);
+
+    for (i = 0; i < n2; i += mpi_chunk) {
+        MPI_Bcast(rmat + i, static_cast<int>(std::min<long>(mpi_chunk, n2 - i)),
+                  MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &f_square, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+}
+#endif
+
+
+void Fitting::merge_triangular_factors(const int nc1,
+                                       double *rmat,
+                                       double *rmat2)
+{
+    // R <- triangular factor of (R; R2) by DTPQRT, where both are nc1 x nc1
+    // upper triangular. The lower triangle of R2 is not referenced, and R2
+    // is destroyed.
+
+    int n = nc1, nb, INFO;
+    double *tmat, *work;
+
+    nb = std::min<int>(nc1, 64);
+    allocate(tmat, static_cast<long>(nb) * nc1);
+    allocate(work, static_cast<long>(nb) * nc1);
+
+    dtpqrt_(&n, &n, &n, &nb, rmat, &n, rmat2, &n, tmat, &nb, work, &INFO);
+
+    if (INFO != 0) {
+        error->exit("merge_triangular_factors", "DTPQRT failed with INFO = ", INFO);
+    }
+
+    deallocate(tmat);
+    deallocate(work);
+}
+
+
+void Fitting::fit_mixed_precision(const int N,
+                                  const int N_new,
+                                  const int nat,
+                                  const int natmin,
+                                  const int ndata_used,
+                                  const int nmulti,
+                                  const int maxorder,
+                                  double *param_out)
+{
+    // Least-squares fitting with the design matrix stored in single precision.
+    // A = QR is computed by SGEQRF, which halves the memory of the matrix.
+    // Then the solution is obtained by the corrected semi-normal equations
+    //   r = b - A x,  R^T R dx = A^T r,  x <- x + dx
+    // in double precision, where A x and A^T r are evaluated from the
+    // double-precision displacements by MatrixFreeDesignMatrix. The iteration
+    // converges to the double-precision solution if cond(A)^2 * eps_single < 1.
+
+    int i, j;
+    int ncol, nrank, iter;
+    long nrow;
+    int ichunk, nchunk, ncycle;
+    int M, LWORK, INFO;
+    int inc = 1;
+    float work_query;
+    float *amat_sp, *tau_sp, *work_sp;
+    double f_square, f_residual, dx_norm, x_norm, g_norm;
+    double *rmat, *fsum, *fsum_orig, *res, *grad, *param_new;
+
+    const bool algebraic = constraint->constraint_algebraic;
+    const int maxiter_refine = (maxiter > 0) ? maxiter : 20;
+
+    ncol = algebraic ? N_new : N;
+    nrow = 3L * natmin * ndata_used * nmulti;
+    M = static_cast<int>(nrow);
+
+    std::cout << "  Entering fitting routine: single-precision QR with iterative refinement"
+        << std::endl << std::endl;
+
+    // The triangular factor is taken from the first ncol rows of the QR.
+
+    if (M < ncol) {
+        error->exit("fit_mixed_precision",
+                    "PRECISION = MIXED requires at least as many rows as parameters (M >= N). "
+                    "Use PRECISION = DOUBLE.");
+    }
+
+    // Matrix elements in single precision
+
+    std::cout << "  Calculation of matrix elements for direct fitting started ... ";
+
+    allocate(amat_sp, nrow * ncol);
+
+    ncycle = ndata_used * nmulti;
+    nchunk = (ncycle + nsnap_chunk - 1) / nsnap_chunk;
+
+#ifdef _OPENMP
+#pragma omp parallel private(i, j)
+#endif
+    {
+        const int nrow_chunk = 3 * natmin * nsnap_chunk;
+        double *abuf, *bbuf;
+
+        allocate(abuf, static_cast<long>(nrow_chunk) * ncol);
+        allocate(bbuf, nrow_chunk);
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for (ichunk = 0; ichunk < nchunk; ++ichunk) {
+            const int irow0 = ichunk * nsnap_chunk;
+            const int nsnap = std::min<int>(nsnap_chunk, ncycle - irow0);
+            const int nr = 3 * natmin * nsnap;
+            const long ioffset = 3 * natmin * static_cast<long>(irow0);
+
+            calc_matrix_elements_chunk(ncol, nat, natmin, maxorder, irow0, nsnap,
+                                       abuf, nr, bbuf, nullptr);
+
+            for (j = 0; j < ncol; ++j) {
+                for (i = 0; i < nr; ++i) {
+                    amat_sp[static_cast<long>(j) * nrow + ioffset + i]
+                        = static_cast<float>(abuf[static_cast<long>(j) * nr + i]);
+                }
+            }
+        }
+
+        deallocate(abuf);
+        deallocate(bbuf);
+    }
+
+    std::cout << "done!" << std::endl << std::endl;
+
+    // QR factorization in single precision
+
+    allocate(tau_sp, ncol);
+
+    LWORK = -1;
+    sgeqrf_(&M, &ncol, amat_sp, &M, tau_sp, &work_query, &LWORK, &INFO);
+    LWORK = static_cast<int>(work_query);
+    allocate(work_sp, LWORK);
+
+    std::cout << "  QR-Decomposition in single precision has started ... ";
+
+    sgeqrf_(&M, &ncol, amat_sp, &M, tau_sp, work_sp, &LWORK, &INFO);
+    if (INFO != 0) {
+        error->exit("fit_mixed_precision", "SGEQRF failed with INFO = ", INFO);
+    }
+
+    std::cout << "finished !" << std::endl << std::endl;
+
+    allocate(rmat, static_cast<long>(ncol) * ncol);
+    for (j = 0; j < ncol; ++j) {
+        for (i = 0; i < ncol; ++i) {
+            rmat[i + static_cast<long>(j) * ncol] = (i <= j) ? static_cast<double>(amat_sp[i + static_cast<long>(j) * nrow]) : 0.0;
         }
+    }
 
-        for (j = 0; j < constraint->const_relate[i].size(); ++j) {
-            tmp = 0.0;
+    deallocate(amat_sp);
+    deallocate(tau_sp);
+    deallocate(work_sp);
 
-            for (k = 0; k < constraint->const_relate[i][j].alpha.size(); ++k) {
-                tmp += constraint->const_relate[i][j].alpha[k]
-                    * param_out[constraint->const_relate[i][j].p_index_orig[k] + ishift];
+    nrank = rank_from_diagonal(ncol, rmat, ncol, 1.0e-5);
+    fit_rank = nrank;
+    std::cout << "  RANK of the matrix = " << nrank << std::endl;
+    if (nrank < ncol) {
+        error->exit("fit_mixed_precision",
+                    "Matrix is rank-deficient in single precision. Use PRECISION = DOUBLE.");
+    }
+
+    // Iterative refinement in double precision
+
+    MatrixFreeDesignMatrix amat(maxorder, matrix_plan, nat, natmin, ndata_used, nmulti,
+                                u_in, map_tran, ncol);
+
+    allocate(fsum, nrow);
+    allocate(fsum_orig, nrow);
+    allocate(res, nrow);
+    allocate(grad, ncol);
+    allocate(param_new, ncol);
+
+    std::vector<int> iat_prim(natmin);
+    for (i = 0; i < natmin; ++i) iat_prim[i] = symmetry->map_p2s[i][0];
+    amat.calc_rhs(f_in, iat_prim.data(), fsum, fsum_orig);
+
+    f_square = 0.0;
+    for (long k = 0; k < nrow; ++k) {
+        res[k] = fsum[k];
+        f_square += std::pow(fsum_orig[k], 2);
+    }
+    for (i = 0; i < ncol; ++i) param_new[i] = 0.0;
+
+    std::cout << std::endl << "  Iterative refinement:" << std::endl;
+    std::cout << "   Iter    Residual sum of squares    |A^T r|           |dx|/|x|" << std::endl;
+
+    for (iter = 0; iter < maxiter_refine; ++iter) {
+
+        amat.multiply_transpose(res, grad);
+
+        g_norm = 0.0;
+        for (i = 0; i < ncol; ++i) g_norm += grad[i] * grad[i];
+
+        dtrtrs_("U", "T", "N", &ncol, &inc, rmat, &ncol, grad, &ncol, &INFO);
+        dtrtrs_("U", "N", "N", &ncol, &inc, rmat, &ncol, grad, &ncol, &INFO);
+
+        dx_norm = 0.0;
+        x_norm = 0.0;
+        for (i = 0; i < ncol; ++i) {
+            param_new[i] += grad[i];
+            dx_norm += grad[i] * grad[i];
+            x_norm += param_new[i] * param_new[i];
+        }
+
+        amat.multiply(param_new, res);
+        f_residual = 0.0;
+        for (long k = 0; k < nrow; ++k) {
+            res[k] = fsum[k] - res[k];
+            f_residual += res[k] * res[k];
+        }
+
+        std::cout << std::setw(7) << iter + 1
+            << std::setw(27) << std::sqrt(f_residual)
+            << std::setw(18) << std::sqrt(g_norm)
+            << std::setw(18) << std::sqrt(dx_norm / x_norm) << std::endl;
+
+        if (dx_norm <= tol_iter * tol_iter * x_norm) break;
+    }
+
+    if (iter == maxiter_refine) {
+        error->warn("fit_mixed_precision",
+                    "Iterative refinement did not converge. The matrix may be ill-conditioned.");
+    }
+
+    std::cout << std::endl << "  Residual sum of squares for the solution: "
+        << std::sqrt(f_residual) << std::endl;
+    fit_error = std::sqrt(f_residual / f_square) * 100.0;
+    std::cout << "  Fitting error (%) : "
+        << fit_error << std::endl;
+
+    if (algebraic) {
+        recover_original_forceconstants(maxorder, param_new, param_out);
+    } else {
+        for (i = 0; i < N; ++i) param_out[i] = param_new[i];
+    }
+
+    deallocate(rmat);
+    deallocate(fsum);
+    deallocate(fsum_orig);
+    deallocate(res);
+    deallocate(grad);
+    deallocate(param_new);
+}
+
+
+void Fitting::fit_matrix_free(const int N,
+                              const int N_new,
+                              const int nat,
+                              const int natmin,
+                              const int ndata_used,
+                              const int nmulti,
+                              const int maxorder,
+                              double *param_out,
+                              const std::string method)
+{
+    // Least-squares fitting with a matrix-free iterative solver.
+    // The products A x and A^T y are evaluated directly from the displacements,
+    // so that the memory scales as O(ndata * nat + N).
+
+    int i, ncol;
+    long nrow;
+    double f_square, f_residual;
+    double *fsum, *fsum_orig, *res;
+    double *param_new;
+
+    const bool algebraic = constraint->constraint_algebraic;
+
+    ncol = algebraic ? N_new : N;
+    nrow = 3L * natmin * ndata_used * nmulti;
+
+    std::cout << "  Entering fitting routine: matrix-free " << method << std::endl << std::endl;
+
+    MatrixFreeDesignMatrix amat(maxorder, matrix_plan, nat, natmin, ndata_used, nmulti,
+                                u_in, map_tran, ncol);
+
+    allocate(fsum, nrow);
+    allocate(fsum_orig, nrow);
+
+    std::vector<int> iat_prim(natmin);
+    for (i = 0; i < natmin; ++i) iat_prim[i] = symmetry->map_p2s[i][0];
+    amat.calc_rhs(f_in, iat_prim.data(), fsum, fsum_orig);
+
+    allocate(param_new, ncol);
+
+    run_iterative_solver(amat, fsum, param_new, method, maxorder);
+
+    allocate(res, nrow);
+    amat.multiply(param_new, res);
+
+    f_residual = 0.0;
+    f_square = 0.0;
+    for (long k = 0; k < nrow; ++k) {
+        f_residual += std::pow(fsum[k] - res[k], 2);
+        f_square += std::pow(fsum_orig[k], 2);
+    }
+
+    std::cout << std::endl << "  Residual sum of squares for the solution: "
+        << std::sqrt(f_residual) << std::endl;
+    fit_error = std::sqrt(f_residual / f_square) * 100.0;
+    std::cout << "  Fitting error (%) : "
+        << fit_error << std::endl;
+
+    if (algebraic) {
+        recover_original_forceconstants(maxorder, param_new, param_out);
+    } else {
+        for (i = 0; i < N; ++i) param_out[i] = param_new[i];
+    }
+
+    deallocate(res);
+    deallocate(param_new);
+    deallocate(fsum);
+    deallocate(fsum_orig);
+}
+
+
+int Fitting::run_iterative_solver(const LinearOperator &amat,
+                                  const double *bvec,
+                                  double *x,
+                                  const std::string method,
+                                  const int maxorder)
+{
+    // Run LSQR or CGLS on amat. When warm_start is set and the force constants
+    // of a previous fit are available, they are used as the initial guess
+    // (mapped to the free parameters when the constraints are algebraic).
+
+    int i, niter, iparam, ishift;
+    const int ncol = amat.ncol;
+    const int niter_max = (maxiter > 0) ? maxiter : std::max<int>(1000, 10 * ncol);
+    bool use_guess = false;
+
+    for (i = 0; i < ncol; ++i) x[i] = 0.0;
+
+    if (warm_start && params) {
+        use_guess = true;
+        if (constraint->constraint_algebraic) {
+            ishift = 0;
+            iparam = 0;
+            for (int order = 0; order < maxorder; ++order) {
+                for (auto it = constraint->index_bimap[order].begin();
+                     it != constraint->index_bimap[order].end(); ++it) {
+                    x[(*it).left + iparam] = params[(*it).right + ishift];
+                }
+                ishift += fcs->nequiv[order].size();
+                iparam += constraint->index_bimap[order].size();
             }
-            param_out[constraint->const_relate[i][j].p_index_target + ishift] = -tmp;
+        } else {
+            for (i = 0; i < ncol; ++i) x[i] = params[i];
         }
+        std::cout << "  Initial guess is taken from the previous force constants." << std::endl;
+    }
 
-        ishift += fcs->nequiv[i].size();
-        iparam += constraint->index_bimap[i].size();
+    if (method == "CGLS") {
+        niter = cgls(amat, bvec, x, tol_iter, niter_max, use_guess);
+    } else {
+        niter = lsqr(amat, bvec, x, tol_iter, niter_max, use_guess);
     }
 
-    deallocate(WORK);
-    deallocate(S);
-    deallocate(fsum2);
-    deallocate(amat_mod);
+    if (niter < 0) {
+        error->warn("run_iterative_solver",
+                    "The iterative solver did not converge within the maximum number of iterations.");
+    } else {
+        std::cout << "  " << method << " converged in " << niter << " iterations." << std::endl;
+    }
+
+    return niter;
+}
+
+
+int Fitting::lsqr(const LinearOperator &amat,
+                  const double *bvec,
+                  double *x,
+                  const double tol,
+                  const int maxiter,
+                  const bool warm_start)
+{
+    // LSQR algorithm of Paige and Saunders for min |A x - b|,
+    // applied to the column-scaled matrix A D with D = diag(1/|a_j|).
+    // When warm_start is true, x on entry is used as the initial guess.
+    // The iteration stops when |(AD)^T r| <= tol |AD| |r| or |r| <= tol |b|.
+    // Returns the number of iterations, or -1 when not converged.
+
+    int i, iter;
+    long k;
+    const long m = amat.nrow;
+    const int n = amat.ncol;
+    double alpha, beta, rho, rhobar, phi, phibar, theta, c, s;
+    double anorm, bnorm, arnorm;
+    double *scale, *uvec, *vvec, *wvec, *dx, *tmp_m, *tmp_n;
+
+    allocate(scale, n);
+    allocate(uvec, m);
+    allocate(vvec, n);
+    allocate(wvec, n);
+    allocate(dx, n);
+    allocate(tmp_m, m);
+    allocate(tmp_n, n);
+
+    amat.column_norms(scale);
+    for (i = 0; i < n; ++i) {
+        scale[i] = (scale[i] > 0.0) ? 1.0 / scale[i] : 0.0;
+    }
+
+    // u = b - A x0
+
+    bnorm = 0.0;
+    for (k = 0; k < m; ++k) bnorm += bvec[k] * bvec[k];
+    bnorm = std::sqrt(bnorm);
+
+    if (warm_start) {
+        amat.multiply(x, tmp_m);
+        for (k = 0; k < m; ++k) uvec[k] = bvec[k] - tmp_m[k];
+    } else {
+        for (i = 0; i < n; ++i) x[i] = 0.0;
+        for (k = 0; k < m; ++k) uvec[k] = bvec[k];
+    }
+
+    beta = 0.0;
+    for (k = 0; k < m; ++k) beta += uvec[k] * uvec[k];
+    beta = std::sqrt(beta);
+
+    for (i = 0; i < n; ++i) dx[i] = 0.0;
+
+    if (beta == 0.0 || bnorm == 0.0) {
+        deallocate(scale);
+        deallocate(uvec);
+        deallocate(vvec);
+        deallocate(wvec);
+        deallocate(dx);
+        deallocate(tmp_m);
+        deallocate(tmp_n);
+        return 0;
+    }
+
+    for (k = 0; k < m; ++k) uvec[k] /= beta;
+
+    amat.multiply_transpose(uvec, vvec);
+    alpha = 0.0;
+    for (i = 0; i < n; ++i) {
+        vvec[i] *= scale[i];
+        alpha += vvec[i] * vvec[i];
+    }
+    alpha = std::sqrt(alpha);
+    if (alpha > 0.0) {
+        for (i = 0; i < n; ++i) vvec[i] /= alpha;
+    }
+    for (i = 0; i < n; ++i) wvec[i] = vvec[i];
+
+    rhobar = alpha;
+    phibar = beta;
+    anorm = 0.0;
+
+    for (iter = 1; iter <= maxiter; ++iter) {
+
+        if (alpha == 0.0) break;
+
+        // Bidiagonalization
+
+        for (i = 0; i < n; ++i) tmp_n[i] = scale[i] * vvec[i];
+        amat.multiply(tmp_n, tmp_m);
+        beta = 0.0;
+        for (k = 0; k < m; ++k) {
+            uvec[k] = tmp_m[k] - alpha * uvec[k];
+            beta += uvec[k] * uvec[k];
+        }
+        beta = std::sqrt(beta);
+        anorm = std::sqrt(anorm * anorm + alpha * alpha + beta * beta);
+
+        if (beta > 0.0) {
+            for (k = 0; k < m; ++k) uvec[k] /= beta;
+            amat.multiply_transpose(uvec, tmp_n);
+            alpha = 0.0;
+            for (i = 0; i < n; ++i) {
+                vvec[i] = scale[i] * tmp_n[i] - beta * vvec[i];
+                alpha += vvec[i] * vvec[i];
+            }
+            alpha = std::sqrt(alpha);
+            if (alpha > 0.0) {
+                for (i = 0; i < n; ++i) vvec[i] /= alpha;
+            }
+        }
+
+        // Plane rotation
+
+        rho = std::sqrt(rhobar * rhobar + beta * beta);
+        c = rhobar / rho;
+        s = beta / rho;
+        theta = s * alpha;
+        rhobar = -c * alpha;
+        phi = c * phibar;
+        phibar = s * phibar;
+
+        for (i = 0; i < n; ++i) {
+            dx[i] += (phi / rho) * wvec[i];
+            wvec[i] = vvec[i] - (theta / rho) * wvec[i];
+        }
+
+        arnorm = phibar * alpha * std::abs(c);
+
+        if (arnorm <= tol * anorm * phibar || phibar <= tol * bnorm) break;
+    }
+
+    for (i = 0; i < n; ++i) x[i] += scale[i] * dx[i];
+
+    deallocate(scale);
+    deallocate(uvec);
+    deallocate(vvec);
+    deallocate(wvec);
+    deallocate(dx);
+    deallocate(tmp_m);
+    deallocate(tmp_n);
+
+    if (iter > maxiter) return -1;
+    return iter;
+}
+
+
+int Fitting::cgls(const LinearOperator &amat,
+                  const double *bvec,
+                  double *x,
+                  const double tol,
+                  const int maxiter,
+                  const bool warm_start)
+{
+    // Conjugate gradient method on the normal equation (CGLS) for min |A x - b|,
+    // applied to the column-scaled matrix A D with D = diag(1/|a_j|).
+    // The stopping criteria are the same as those of lsqr().
+    // Returns the number of iterations, or -1 when not converged.
+
+    int i, iter;
+    long k;
+    const long m = amat.nrow;
+    const int n = amat.ncol;
+    double gamma, gamma_new, alpha, beta, qnorm2;
+    double anorm, bnorm, rnorm;
+    double *scale, *rvec, *svec, *pvec, *qvec, *tmp_n;
+
+    allocate(scale, n);
+    allocate(rvec, m);
+    allocate(svec, n);
+    allocate(pvec, n);
+    allocate(qvec, m);
+    allocate(tmp_n, n);
+
+    amat.column_norms(scale);
+    anorm = 0.0;
+    for (i = 0; i < n; ++i) {
+        if (scale[i] > 0.0) {
+            scale[i] = 1.0 / scale[i];
+            anorm += 1.0;
+        } else {
+            scale[i] = 0.0;
+        }
+    }
+    anorm = std::sqrt(anorm);
+
+    bnorm = 0.0;
+    for (k = 0; k < m; ++k) bnorm += bvec[k] * bvec[k];
+    bnorm = std::sqrt(bnorm);
+
+    // r = b - A x0
+
+    if (warm_start) {
+        amat.multiply(x, qvec);
+        for (k = 0; k < m; ++k) rvec[k] = bvec[k] - qvec[k];
+    } else {
+        for (i = 0; i < n; ++i) x[i] = 0.0;
+        for (k = 0; k < m; ++k) rvec[k] = bvec[k];
+    }
+
+    amat.multiply_transpose(rvec, svec);
+    gamma = 0.0;
+    for (i = 0; i < n; ++i) {
+        svec[i] *= scale[i];
+        pvec[i] = svec[i];
+        gamma += svec[i] * svec[i];
+    }
+
+    rnorm = 0.0;
+    for (k = 0; k < m; ++k) rnorm += rvec[k] * rvec[k];
+    rnorm = std::sqrt(rnorm);
+
+    for (iter = 0; iter <= maxiter; ++iter) {
+
+        if (std::sqrt(gamma) <= tol * anorm * rnorm || rnorm <= tol * bnorm) break;
+        if (iter == maxiter) {
+            ++iter;
+            break;
+        }
+
+        for (i = 0; i < n; ++i) tmp_n[i] = scale[i] * pvec[i];
+        amat.multiply(tmp_n, qvec);
+
+        qnorm2 = 0.0;
+        for (k = 0; k < m; ++k) qnorm2 += qvec[k] * qvec[k];
+        if (qnorm2 == 0.0) break;
+
+        alpha = gamma / qnorm2;
+        for (i = 0; i < n; ++i) x[i] += alpha * tmp_n[i];
+        rnorm = 0.0;
+        for (k = 0; k < m; ++k) {
+            rvec[k] -= alpha * qvec[k];
+            rnorm += rvec[k] * rvec[k];
+        }
+        rnorm = std::sqrt(rnorm);
+
+        amat.multiply_transpose(rvec, svec);
+        gamma_new = 0.0;
+        for (i = 0; i < n; ++i) {
+            svec[i] *= scale[i];
+            gamma_new += svec[i] * svec[i];
+        }
+
+        beta = gamma_new / gamma;
+        gamma = gamma_new;
+        for (i = 0; i < n; ++i) pvec[i] = svec[i] + beta * pvec[i];
+    }
+
+    deallocate(scale);
+    deallocate(rvec);
+    deallocate(svec);
+    deallocate(pvec);
+    deallocate(qvec);
+    deallocate(tmp_n);
+
+    if (iter > maxiter) return -1;
+    return iter;
 }
 
 
-void Fitting::calc_matrix_elements(const int M,
-                                   const int N,
+void Fitting::calc_matrix_elements(const int ncol,
                                    const int nat,
                                    const int natmin,
+                                   const int idata_start,
                                    const int ndata_fit,
                                    const int nmulti,
                                    const int maxorder,
-                                   double **u,
-                                   double **f,
-                                   double **amat,
-                                   double *bvec)
+                                   DesignMatrix &dmat)
 {
-    int i, j;
-    int irow;
+    // The chunks of snapshots are written directly to the column-major dmat.
+    // Within a chunk, the rows are ordered as in calc_matrix_elements_chunk,
+    // which does not matter for the least-squares problem as long as
+    // the r.h.s. vectors follow the same order.
+    // When the constraints are treated algebraically, they are already folded
+    // into matrix_plan, which maps the terms to the free parameters directly.
+    // The data idata_start .. idata_start+ndata_fit-1 of u_in are used.
+
+    int ichunk, nchunk;
     int ncycle;
-
-    std::cout << "  Calculation of matrix elements for direct fitting started ... ";
-    for (i = 0; i < M; ++i) {
-        for (j = 0; j < N; ++j) {
-            amat[i][j] = 0.0;
-        }
-        bvec[i] = 0.0;
-    }
+    const int nrow = static_cast<int>(dmat.nrow);
 
     ncycle = ndata_fit * nmulti;
+    nchunk = (ncycle + nsnap_chunk - 1) / nsnap_chunk;
 
 #ifdef _OPENMP
-#pragma omp parallel private(irow, i, j)
+#pragma omp parallel for schedule(static)
 #endif
-    {
-        int *ind;
-        int mm, order, iat, k;
-        int im, idata, iparam;
-        double amat_tmp;
-
-        allocate(ind, maxorder + 1);
+    for (ichunk = 0; ichunk < nchunk; ++ichunk) {
+        const int irow0 = ichunk * nsnap_chunk;
+        const int ioffset = 3 * natmin * irow0;
+        calc_matrix_elements_chunk(ncol, nat, natmin, maxorder,
+                                   idata_start * nmulti + irow0,
+                                   std::min<int>(nsnap_chunk, ncycle - irow0),
+                                   dmat.amat + ioffset, nrow,
+                                   dmat.bvec + ioffset, dmat.bvec_orig + ioffset);
+    }
+}
 
-#ifdef _OPENMP
-#pragma omp for schedule(guided)
-#endif
-        for (irow = 0; irow < ncycle; ++irow) {
 
-            // generate r.h.s vector B
-            for (i = 0; i < natmin; ++i) {
-                iat = symmetry->map_p2s[i][0];
-                for (j = 0; j < 3; ++j) {
-                    im = 3 * i + j + 3 * natmin * irow;
-                    bvec[im] = f[irow][3 * iat + j];
-                }
+void Fitting::calc_matrix_elements_chunk(const int ncol,
+                                         const int nat,
+                                         const int natmin,
+                                         const int maxorder,
+                                         const int icycle0,
+                                         const int nsnap,
+                                         double *amat,
+                                         const int lda,
+                                         double *bvec,
+                                         double *bvec_orig)
+{
+    // Matrix elements for nsnap snapshots icycle0 .. icycle0+nsnap-1, where
+    // the snapshot icycle is the data icycle / ntran shifted by the pure
+    // translation icycle % ntran. The translation is applied while reading
+    // u_in and f_in, so that the data are never replicated.
+    // amat is column-major with the leading dimension lda, and the row of the
+    // force component i (0 <= i < 3*natmin) of the snapshot isnap is i*nsnap + isnap.
+    // bvec and bvec_orig follow the same row order (bvec_orig may be nullptr).
+
+    int i, j, is, iat;
+    int order;
+    int nrow = 3 * natmin * nsnap;
+    int idata, itran;
+    const int ntran = symmetry->ntran;
+    double *usoa;
+    std::string str_kernel;
+
+    static const MatrixKernel kernel = select_matrix_kernel(str_kernel);
+
+    allocate(usoa, 3 * nat * nsnap);
+
+    for (is = 0; is < nsnap; ++is) {
+        idata = (icycle0 + is) / ntran;
+        itran = (icycle0 + is) % ntran;
+        for (i = 0; i < nat; ++i) {
+            iat = map_tran[itran * nat + i];
+            for (j = 0; j < 3; ++j) {
+                usoa[(3 * iat + j) * nsnap + is] = u_in[idata][3 * i + j];
             }
+        }
+    }
 
-            // generate l.h.s. matrix A
+    for (j = 0; j < ncol; ++j) {
+        for (i = 0; i < nrow; ++i) {
+            amat[static_cast<long>(j) * lda + i] = 0.0;
+        }
+    }
 
-            idata = 3 * natmin * irow;
-            iparam = 0;
+    gather_forces_chunk(nat, natmin, icycle0, nsnap, f_in, bvec);
 
-            for (order = 0; order < maxorder; ++order) {
+    if (bvec_orig) {
+        for (i = 0; i < nrow; ++i) bvec_orig[i] = bvec[i];
+    }
 
-                mm = 0;
-
-                for (auto iter = fcs->nequiv[order].begin(); iter != fcs->nequiv[order].end(); ++iter) {
-                    for (i = 0; i < *iter; ++i) {
-                        ind[0] = fcs->fc_table[order][mm].elems[0];
-                        k = idata + inprim_index(fcs->fc_table[order][mm].elems[0]);
-                        amat_tmp = 1.0;
-                        for (j = 1; j < order + 2; ++j) {
-                            ind[j] = fcs->fc_table[order][mm].elems[j];
-                            amat_tmp *= u[irow][fcs->fc_table[order][mm].elems[j]];
-                        }
-                        amat[k][iparam] -= gamma(order + 2, ind) * fcs->fc_table[order][mm].sign * amat_tmp;
-                        ++mm;
-                    }
-                    ++iparam;
-                }
-            }
-        }
+    for (order = 0; order < maxorder; ++order) {
 
-        deallocate(ind);
+        const MatrixElementPlan &plan = matrix_plan[order];
+        const unsigned int nterm = plan.row.size();
+        const unsigned int na = plan.nterm_amat;
 
+        kernel(plan.nelem, na,
+               plan.row.data(), plan.col.data(), plan.coef.data(), plan.disp.data(),
+               usoa, nsnap, amat, lda);
+
+        // Terms of the fixed parameters (col = -1) go to bvec. With lda = 0,
+        // the column index is irrelevant.
+        if (nterm > na) {
+            kernel(plan.nelem, nterm - na,
+                   plan.row.data() + na, plan.col.data() + na, plan.coef.data() + na,
+                   plan.disp.data() + static_cast<long>(na) * plan.nelem,
+                   usoa, nsnap, bvec, 0);
+        }
     }
 
-    std::cout << "done!" << std::endl << std::endl;
+    deallocate(usoa);
 }
 
 
-void Fitting::calc_matrix_elements_algebraic_constraint(const int M,
-                                                        const int N,
-                                                        const int N_new,
-                                                        const int nat,
-                                                        const int natmin,
-                                                        const int ndata_fit,
-                                                        const int nmulti,
-                                                        const int maxorder,
-                                                        double **u,
-                                                        double **f,
-                                                        double **amat,
-                                                        double *bvec,
-                                                        double *bvec_orig)
+void Fitting::gather_forces_chunk(const int nat,
+                                  const int natmin,
+                                  const int icycle0,
+                                  const int nsnap,
+                                  double **f,
+                                  double *fvec)
 {
-    int i, j;
-    int irow;
-    int ncycle;
-
-    std::cout << "  Calculation of matrix elements for direct fitting started ... ";
+    // Forces on the atoms in the primitive cell for the snapshots
+    // icycle0 .. icycle0+nsnap-1 in the row order of calc_matrix_elements_chunk.
+
+    int i, j, is, iat;
+    int idata, itran;
+    const int ntran = symmetry->ntran;
+
+    for (is = 0; is < nsnap; ++is) {
+        idata = (icycle0 + is) / ntran;
+        itran = (icycle0 + is) % ntran;
+        for (i = 0; i < natmin; ++i) {
+            iat = map_tran_inv[itran * nat + symmetry->map_p2s[i][0]];
+            for (j = 0; j < 3; ++j) {
+                fvec[(3 * i + j) * nsnap + is] = f[idata][3 * iat + j];
+            }
+        }
+    }
+}
 
-    ncycle = ndata_fit * nmulti;
 
+void Fitting::calc_matrix_elements_sparse(const int ncol,
+                                          const int nat,
+                                          const int natmin,
+                                          const int ncycle,
+                                          const int maxorder,
+                                          SparseDesignMatrix &amat,
+                                          double *bvec,
+                                          double *bvec_orig)
+{
+    // Sparse matrix elements for the snapshots u[0..ncycle-1].
+    // The sparsity pattern of the 3*natmin rows of a snapshot is given by
+    // matrix_plan and is common to all snapshots, so that the position of
+    // each term in the CSR arrays is determined once and the snapshots
+    // are filled independently.
+
+    int i, j, order;
+    int icycle, idata, itran;
+    long irow;
+    const int nrow_snap = 3 * natmin;
+    const int ntran = symmetry->ntran;
+    std::vector<double> usnap(3 * nat);
+    size_t nnz_snap, ioffset;
+    std::vector<std::vector<int>> cols_row;
+    std::vector<size_t> ptr_snap;
+    std::vector<std::vector<size_t>> slot;
+
+    cols_row.resize(nrow_snap);
+
+    for (order = 0; order < maxorder; ++order) {
+        const MatrixElementPlan &plan = matrix_plan[order];
+        for (unsigned int k = 0; k < plan.nterm_amat; ++k) {
+            cols_row[plan.row[k]].push_back(plan.col[k]);
+        }
+    }
 
-#ifdef _OPENMP
-#pragma omp parallel for private(j)
-#endif
-    for (i = 0; i < M; ++i) {
-        for (j = 0; j < N_new; ++j) {
-            amat[i][j] = 0.0;
+    ptr_snap.resize(nrow_snap + 1);
+    ptr_snap[0] = 0;
+    for (i = 0; i < nrow_snap; ++i) {
+        std::sort(cols_row[i].begin(), cols_row[i].end());
+        cols_row[i].erase(std::unique(cols_row[i].begin(), cols_row[i].end()),
+                          cols_row[i].end());
+        ptr_snap[i + 1] = ptr_snap[i] + cols_row[i].size();
+    }
+    nnz_snap = ptr_snap[nrow_snap];
+
+    slot.resize(maxorder);
+    for (order = 0; order < maxorder; ++order) {
+        const MatrixElementPlan &plan = matrix_plan[order];
+        slot[order].resize(plan.nterm_amat);
+        for (unsigned int k = 0; k < plan.nterm_amat; ++k) {
+            irow = plan.row[k];
+            slot[order][k] = ptr_snap[irow]
+                + (std::lower_bound(cols_row[irow].begin(), cols_row[irow].end(), plan.col[k])
+                    - cols_row[irow].begin());
         }
-        bvec[i] = 0.0;
-        bvec_orig[i] = 0.0;
     }
 
+    amat.nrow = static_cast<long>(nrow_snap) * ncycle;
+    amat.ncol = ncol;
+    amat.rowptr.resize(amat.nrow + 1);
+    amat.colind.resize(nnz_snap * ncycle);
+    amat.val.assign(nnz_snap * ncycle, 0.0);
+
 #ifdef _OPENMP
-#pragma omp parallel private(irow, i, j)
+#pragma omp parallel for private(i, j, order, ioffset, irow, idata, itran), firstprivate(usnap), schedule(static)
 #endif
-    {
-        int *ind;
-        int mm, order, iat, k;
-        int im, idata, iparam;
-        int ishift;
-        int iold, inew;
-        double amat_tmp;
-        double **amat_orig;
-        double **amat_mod;
+    for (icycle = 0; icycle < ncycle; ++icycle) {
 
-        allocate(ind, maxorder + 1);
-        allocate(amat_orig, 3 * natmin, N);
-        allocate(amat_mod, 3 * natmin, N_new);
+        ioffset = nnz_snap * icycle;
+        idata = icycle / ntran;
+        itran = icycle % ntran;
 
-#ifdef _OPENMP
-#pragma omp for schedule(guided)
-#endif
-        for (irow = 0; irow < ncycle; ++irow) {
+        for (i = 0; i < nat; ++i) {
+            for (j = 0; j < 3; ++j) {
+                usnap[3 * map_tran[itran * nat + i] + j] = u_in[idata][3 * i + j];
+            }
+        }
 
-            // generate r.h.s vector B
-            for (i = 0; i < natmin; ++i) {
-                iat = symmetry->map_p2s[i][0];
-                for (j = 0; j < 3; ++j) {
-                    im = 3 * i + j + 3 * natmin * irow;
-                    bvec[im] = f[irow][3 * iat + j];
-                    bvec_orig[im] = f[irow][3 * iat + j];
-                }
+        for (i = 0; i < nrow_snap; ++i) {
+            amat.rowptr[static_cast<long>(nrow_snap) * icycle + i] = ioffset + ptr_snap[i];
+            for (j = 0; j < static_cast<int>(cols_row[i].size()); ++j) {
+                amat.colind[ioffset + ptr_snap[i] + j] = cols_row[i][j];
             }
+        }
 
-            for (i = 0; i < 3 * natmin; ++i) {
-                for (j = 0; j < N; ++j) {
-                    amat_orig[i][j] = 0.0;
-                }
-                for (j = 0; j < N_new; ++j) {
-                    amat_mod[i][j] = 0.0;
+        for (i = 0; i < natmin; ++i) {
+            irow = static_cast<long>(nrow_snap) * icycle + 3 * i;
+            for (j = 0; j < 3; ++j) {
+                bvec[irow + j] = f_in[idata][3 * map_tran_inv[itran * nat + symmetry->map_p2s[i][0]] + j];
+                if (bvec_orig) bvec_orig[irow + j] = bvec[irow + j];
+            }
+        }
+
+        for (order = 0; order < maxorder; ++order) {
+
+            const MatrixElementPlan &plan = matrix_plan[order];
+            const unsigned int nterm = plan.row.size();
+            const int *disp = plan.disp.data();
+            double prod;
+
+            for (unsigned int k = 0; k < nterm; ++k) {
+                prod = plan.coef[k];
+                for (j = 0; j < plan.nelem; ++j) prod *= usnap[disp[j]];
+                disp += plan.nelem;
+
+                if (k < plan.nterm_amat) {
+                    amat.val[ioffset + slot[order][k]] += prod;
+                } else {
+                    bvec[static_cast<long>(nrow_snap) * icycle + plan.row[k]] += prod;
                 }
             }
+        }
+    }
+    amat.rowptr[amat.nrow] = nnz_snap * ncycle;
+}
 
-            // generate l.h.s. matrix A
 
-            idata = 3 * natmin * irow;
-            iparam = 0;
+void Fitting::build_matrix_element_plan(const int maxorder,
+                                        const int order_fit,
+                                        const double *x_fixed)
+{
+    // Compile fcs->fc_table into the flat list of terms of the design matrix.
+    // The factor gamma(), the sign, and the row index in the primitive cell
+    // do not depend on snapshots and are evaluated here only once.
+    // When the constraints are treated algebraically, the linear mapping
+    // from the original parameters to the free ones is also folded in.
+    // When order_fit >= 0, only the columns of that order are kept and
+    // renumbered from 0. The parameters of the lower orders are fixed to
+    // x_fixed, given in the column indices of the whole problem, and go to
+    // the r.h.s. vector. The higher orders are dropped.
+
+    int i, j, order;
+    int mm, iparam, ishift, iparam_new;
+    int nparam, nelem, irow, icol_shift;
+    int *ind;
+    double coef, val;
+    std::vector<std::vector<std::pair<int, double>>> colmap;
+    std::vector<int> is_fixed;
+    std::vector<double> val_fixed;
+
+    class PlanTerm
+    {
+    public:
+        int row, col;
+        double coef;
+        std::vector<int> disp;
+
+        bool operator<(const PlanTerm &a) const
+        {
+            if (col < 0 && a.col >= 0) return false;
+            if (col >= 0 && a.col < 0) return true;
+            if (row != a.row) return row < a.row;
+            return col < a.col;
+        }
+    };
 
-            for (order = 0; order < maxorder; ++order) {
+    std::vector<PlanTerm> terms;
 
-                mm = 0;
+    const bool algebraic = constraint->constraint_algebraic;
 
-                for (auto iter = fcs->nequiv[order].begin(); iter != fcs->nequiv[order].end(); ++iter) {
-                    for (i = 0; i < *iter; ++i) {
-                        ind[0] = fcs->fc_table[order][mm].elems[0];
-                        k = inprim_index(ind[0]);
+    if (matrix_plan) {
+        deallocate(matrix_plan);
+    }
+    allocate(matrix_plan, maxorder);
 
-                        amat_tmp = 1.0;
-                        for (j = 1; j < order + 2; ++j) {
-                            ind[j] = fcs->fc_table[order][mm].elems[j];
-                            amat_tmp *= u[irow][fcs->fc_table[order][mm].elems[j]];
-                        }
-                        amat_orig[k][iparam] -= gamma(order + 2, ind) * fcs->fc_table[order][mm].sign * amat_tmp;
-                        ++mm;
-                    }
-                    ++iparam;
-                }
-            }
+    allocate(ind, maxorder + 1);
 
-            ishift = 0;
-            iparam = 0;
+    ishift = 0;
+    iparam_new = 0;
 
-            for (order = 0; order < maxorder; ++order) {
+    for (order = 0; order < maxorder; ++order) {
 
-                for (i = 0; i < constraint->const_fix[order].size(); ++i) {
+        nelem = order + 1;
+        nparam = fcs->nequiv[order].size();
 
-                    for (j = 0; j < 3 * natmin; ++j) {
-                        bvec[j + idata] -= constraint->const_fix[order][i].val_to_fix
-                            * amat_orig[j][ishift + constraint->const_fix[order][i].p_index_target];
-                    }
+        // Columns (and weights) to which each parameter of this order contributes
+
+        colmap.clear();
+        colmap.resize(nparam);
+        is_fixed.assign(nparam, 0);
+        val_fixed.assign(nparam, 0.0);
+
+        if (algebraic) {
+            for (i = 0; i < constraint->const_fix[order].size(); ++i) {
+                is_fixed[constraint->const_fix[order][i].p_index_target] = 1;
+                val_fixed[constraint->const_fix[order][i].p_index_target]
+                    = constraint->const_fix[order][i].val_to_fix;
+            }
+            for (auto it = constraint->index_bimap[order].begin();
+                 it != constraint->index_bimap[order].end(); ++it) {
+                colmap[(*it).right].push_back(std::make_pair((*it).left + iparam_new, 1.0));
+            }
+            for (i = 0; i < constraint->const_relate[order].size(); ++i) {
+                const ConstraintTypeRelate &rel = constraint->const_relate[order][i];
+                for (j = 0; j < rel.alpha.size(); ++j) {
+                    colmap[rel.p_index_target].push_back(
+                        std::make_pair(constraint->index_bimap[order].right.at(rel.p_index_orig[j])
+                                       + iparam_new, -rel.alpha[j]));
                 }
+            }
+        } else {
+            for (i = 0; i < nparam; ++i) {
+                colmap[i].push_back(std::make_pair(i + ishift, 1.0));
+            }
+        }
 
-                for (boost::bimap<int, int>::const_iterator it = constraint->index_bimap[order].begin();
-                     it != constraint->index_bimap[order].end(); ++it) {
-                    inew = (*it).left + iparam;
-                    iold = (*it).right + ishift;
+        terms.clear();
+        mm = 0;
+        iparam = 0;
+        icol_shift = algebraic ? iparam_new : ishift;
 
-                    for (j = 0; j < 3 * natmin; ++j) {
-                        amat_mod[j][inew] = amat_orig[j][iold];
-                    }
-                }
+        for (auto iter = fcs->nequiv[order].begin(); iter != fcs->nequiv[order].end(); ++iter) {
+            if (order_fit >= 0 && order > order_fit) break;
 
-                for (i = 0; i < constraint->const_relate[order].size(); ++i) {
+            for (i = 0; i < *iter; ++i) {
+                const FcProperty &fc = fcs->fc_table[order][mm];
+                for (j = 0; j < order + 2; ++j) ind[j] = fc.elems[j];
 
-                    iold = constraint->const_relate[order][i].p_index_target + ishift;
+                irow = inprim_index(fc.elems[0]);
+                coef = -gamma(order + 2, ind) * fc.sign;
 
-                    for (j = 0; j < constraint->const_relate[order][i].alpha.size(); ++j) {
+                PlanTerm term;
+                term.row = irow;
+                term.disp.assign(fc.elems.begin() + 1, fc.elems.end());
 
-                        inew = constraint->index_bimap[order].right.at(
-                                                                 constraint->const_relate[order][i].p_index_orig[j])
-                            + iparam;
-                        for (k = 0; k < 3 * natmin; ++k) {
-                            amat_mod[k][inew] -= amat_orig[k][iold] * constraint->const_relate[order][i].alpha[j];
-                        }
+                if (order_fit >= 0 && order < order_fit) {
+                    // bvec -= val * A(:, iparam) with the fitted value
+                    val = is_fixed[iparam] ? val_fixed[iparam] : 0.0;
+                    for (const auto &c : colmap[iparam]) {
+                        val += c.second * x_fixed[c.first];
+                    }
+                    if (val != 0.0) {
+                        term.col = -1;
+                        term.coef = -coef * val;
+                        terms.push_back(term);
                     }
+                    ++mm;
+                    continue;
                 }
 
-                ishift += fcs->nequiv[order].size();
-                iparam += constraint->index_bimap[order].size();
-            }
-
-            for (i = 0; i < 3 * natmin; ++i) {
-                for (j = 0; j < N_new; ++j) {
-                    amat[i + idata][j] = amat_mod[i][j];
+                for (const auto &c : colmap[iparam]) {
+                    term.col = (order_fit >= 0) ? c.first - icol_shift : c.first;
+                    term.coef = coef * c.second;
+                    terms.push_back(term);
                 }
+                if (is_fixed[iparam]) {
+                    // bvec -= val * A(:, iparam)
+                    term.col = -1;
+                    term.coef = -coef * val_fixed[iparam];
+                    terms.push_back(term);
+                }
+                ++mm;
             }
+            ++iparam;
+        }
+
+        std::stable_sort(terms.begin(), terms.end());
+
+        MatrixElementPlan &plan = matrix_plan[order];
 
+        plan.nelem = nelem;
+        plan.nterm_amat = 0;
+        plan.row.clear();
+        plan.col.clear();
+        plan.coef.clear();
+        plan.disp.clear();
+
+        for (const auto &t : terms) {
+            plan.row.push_back(t.row);
+            plan.col.push_back(t.col);
+            plan.coef.push_back(t.coef);
+            for (j = 0; j < nelem; ++j) plan.disp.push_back(t.disp[j]);
+            if (t.col >= 0) ++plan.nterm_amat;
         }
 
-        deallocate(ind);
-        deallocate(amat_orig);
-        deallocate(amat_mod);
+        ishift += nparam;
+        if (algebraic) iparam_new += constraint->index_bimap[order].size();
     }
 
-    std::cout << "done!" << std::endl << std::endl;
+    deallocate(ind);
 }
 
 
-void Fitting::data_multiplier(double **u,
-                              double **f,
-                              const int nat,
-                              const int ndata_used,
-                              const int nmulti)
+void Fitting::setup_translation_map(const int nat,
+                                    const int ntran)
 {
-    int i, j, k;
-    int idata, itran, isym;
-    int n_mapped;
-    double u_rot[3], f_rot[3];
-
-    // Multiply data
-    idata = 0;
-    for (i = 0; i < ndata_used; ++i) {
-        for (itran = 0; itran < symmetry->ntran; ++itran) {
-            for (j = 0; j < nat; ++j) {
-                n_mapped = symmetry->map_sym[j][symmetry->symnum_tran[itran]];
-                for (k = 0; k < 3; ++k) {
-                    u[idata][3 * n_mapped + k] = u_in[i][3 * j + k];
-                    f[idata][3 * n_mapped + k] = f_in[i][3 * j + k];
-                }
-            }
-            ++idata;
+    // Instead of replicating the snapshots by the pure translations
+    // of the supercell, the atom indices are permuted when reading u_in and f_in.
+    // The snapshot shifted by itran has u'[3 * map_tran[itran * nat + i] + k] = u[3 * i + k].
+
+    int i, itran;
+
+    map_tran.resize(ntran * nat);
+    map_tran_inv.resize(ntran * nat);
+
+    for (itran = 0; itran < ntran; ++itran) {
+        for (i = 0; i < nat; ++i) {
+            map_tran[itran * nat + i] = symmetry->map_sym[i][symmetry->symnum_tran[itran]];
+            map_tran_inv[itran * nat + map_tran[itran * nat + i]] = i;
         }
     }
 }
 
 
+void Fitting::bind_threads_to_cpus()
+{
+    // Bind the k-th OpenMP thread to the CPU (k * ncpu) / nthreads of the
+    // affinity mask of the process. The threads then stay on the NUMA nodes
+    // where they first touched their rows of the arrays. Nothing is done if
+    // the OpenMP runtime already binds the threads (OMP_PROC_BIND).
+
+    if (threads_pinned) return;
+    threads_pinned = true;
+
+#ifdef _HAVE_AFFINITY
+    cpu_set_t mask;
+    std::vector<int> cpus;
+    int nthreads = omp_get_max_threads();
+    std::vector<int> cpu_thread(nthreads, -1);
+
+    if (omp_get_proc_bind() != omp_proc_bind_false) {
+        std::cout << "  The OpenMP threads are already bound by OMP_PROC_BIND." << std::endl << std::endl;
+        return;
+    }
+
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &mask) != 0) {
+        error->warn("bind_threads_to_cpus", "sched_getaffinity failed. The threads are not pinned.");
+        return;
+    }
+    for (int icpu = 0; icpu < CPU_SETSIZE; ++icpu) {
+        if (CPU_ISSET(icpu, &mask)) cpus.push_back(icpu);
+    }
+
+#pragma omp parallel num_threads(nthreads)
+    {
+        const int ithread = omp_get_thread_num();
+        const int icpu = cpus[(static_cast<long>(ithread) * cpus.size()) / nthreads];
+        cpu_set_t mask_thread;
+
+        CPU_ZERO(&mask_thread);
+        CPU_SET(icpu, &mask_thread);
+        if (sched_setaffinity(0, sizeof(cpu_set_t), &mask_thread) == 0) {
+            cpu_thread[ithread] = icpu;
+        }
+    }
+
+    std::cout << "  OpenMP threads pinned to the CPUs (thread:cpu):";
+    for (int ithread = 0; ithread < nthreads; ++ithread) {
+        if (ithread % 8 == 0) std::cout << std::endl << "   ";
+        std::cout << " " << std::setw(4) << ithread << ":" << std::setw(4) << std::left
+            << cpu_thread[ithread] << std::right;
+    }
+    std::cout << std::endl << std::endl;
+#else
+    error->warn("bind_threads_to_cpus", "PIN_THREADS = 1 is supported only on Linux with OpenMP.");
+#endif
+}
+
 int Fitting::inprim_index(const int n)
 {
-    int in;
+    int in = -1;
     int atmn = n / 3;
     int crdn = n % 3;
 
@@ -808,6 +5887,10 @@ int Fitting::inprim_index(const int n)
             break;
         }
     }
+    if (in < 0) {
+        error->exit("inprim_index",
+                    "The atom is not in the primitive cell. atom = ", atmn);
+    }
     return in;
 }
 
@@ -881,19 +5964,23 @@ int Fitting::rankQRD(const int m,
 
     int LDA = m_;
 
-    int LWORK = 10 * n_;
+    int LWORK = -1;
     int INFO;
     int *JPVT;
+    double work_query;
     double *WORK, *TAU;
 
     int nmin = std::min<int>(m_, n_);
 
     allocate(JPVT, n_);
-    allocate(WORK, LWORK);
     allocate(TAU, nmin);
 
     for (int i = 0; i < n_; ++i) JPVT[i] = 0;
 
+    dgeqp3_(&m_, &n_, mat, &LDA, JPVT, TAU, &work_query, &LWORK, &INFO);
+    LWORK = static_cast<int>(work_query);
+    allocate(WORK, LWORK);
+
     dgeqp3_(&m_, &n_, mat, &LDA, JPVT, TAU, WORK, &LWORK, &INFO);
 
     deallocate(JPVT);
@@ -932,21 +6019,26 @@ int Fitting::rankSVD(const int m,
     int m_ = m;
     int n_ = n;
 
-    int LWORK = 10 * m;
+    int LWORK = -1;
     int INFO;
     int *IWORK;
     int ldu = 1, ldvt = 1;
+    double work_query;
     double *s, *WORK;
     double u[1], vt[1];
 
     int nmin = std::min<int>(m, n);
 
     allocate(IWORK, 8 * nmin);
-    allocate(WORK, LWORK);
     allocate(s, nmin);
 
     char mode[] = "N";
 
+    dgesdd_(mode, &m_, &n_, mat, &m_, s, u, &ldu, vt, &ldvt,
+            &work_query, &LWORK, IWORK, &INFO);
+    LWORK = static_cast<int>(work_query);
+    allocate(WORK, LWORK);
+
     dgesdd_(mode, &m_, &n_, mat, &m_, s, u, &ldu, vt, &ldvt,
             WORK, &LWORK, IWORK, &INFO);
 
@@ -975,7 +6067,7 @@ int Fitting::rankSVD2(const int m_in,
     int m = m_in;
     int n = n_in;
 
-    allocate(arr, m * n);
+    allocate(arr, static_cast<long>(m) * n);
 
     k = 0;
 
@@ -985,21 +6077,26 @@ int Fitting::rankSVD2(const int m_in,
         }
     }
 
-    int LWORK = 10 * m;
+    int LWORK = -1;
     int INFO;
     int *IWORK;
     int ldu = 1, ldvt = 1;
+    double work_query;
     double *s, *WORK;
     double u[1], vt[1];
 
     int nmin = std::min<int>(m, n);
 
     allocate(IWORK, 8 * nmin);
-    allocate(WORK, LWORK);
     allocate(s, nmin);
 
     char mode[] = "N";
 
+    dgesdd_(mode, &m, &n, arr, &m, s, u, &ldu, vt, &ldvt,
+            &work_query, &LWORK, IWORK, &INFO);
+    LWORK = static_cast<int>(work_query);
+    allocate(WORK, LWORK);
+
     dgesdd_(mode, &m, &n, arr, &m, s, u, &ldu, vt, &ldvt,
             WORK, &LWORK, IWORK, &INFO);
 
@@ -1015,3 +6112,466 @@ int Fitting::rankSVD2(const int m_in,
 
     return rank;
 }
+
+
+DesignMatrix::DesignMatrix()
+{
+    nrow = 0;
+    ncol = 0;
+    capacity = 0;
+    capacity_vec = 0;
+    amat = nullptr;
+    bvec = nullptr;
+    bvec_orig = nullptr;
+}
+
+
+DesignMatrix::~DesignMatrix()
+{
+    if (amat) deallocate(amat);
+    if (bvec) deallocate(bvec);
+    if (bvec_orig) deallocate(bvec_orig);
+}
+
+
+void DesignMatrix::resize(const long nrow_in,
+                          const int ncol_in)
+{
+    // The buffers are reused when they are large enough.
+    // The dense matrix is passed to LAPACK, so that fitmain forms it only
+    // when nrow_in fits in int.
+
+    const unsigned long nelem = static_cast<unsigned long>(nrow_in) * ncol_in;
+    const unsigned long nvec = std::max<long>(nrow_in, ncol_in);
+
+    if (nelem > capacity) {
+        if (amat) deallocate(amat);
+        capacity = nelem;
+        allocate(amat, capacity);
+    }
+    if (nvec > capacity_vec) {
+        if (bvec) deallocate(bvec);
+        if (bvec_orig) deallocate(bvec_orig);
+        capacity_vec = nvec;
+        allocate(bvec, capacity_vec);
+        allocate(bvec_orig, capacity_vec);
+    }
+    nrow = nrow_in;
+    ncol = ncol_in;
+}
+
+
+void DesignMatrix::multiply(const double *x,
+                            double *y) const
+{
+    int m = static_cast<int>(nrow), n = ncol, inc = 1;
+    double one = 1.0, zero = 0.0;
+
+    dgemv_("N", &m, &n, &one, amat, &m, const_cast<double *>(x), &inc, &zero, y, &inc);
+}
+
+
+void DesignMatrix::multiply_transpose(const double *x,
+                                      double *y) const
+{
+    int m = static_cast<int>(nrow), n = ncol, inc = 1;
+    double one = 1.0, zero = 0.0;
+
+    dgemv_("T", &m, &n, &one, amat, &m, const_cast<double *>(x), &inc, &zero, y, &inc);
+}
+
+
+void DesignMatrix::column_norms(double *cnorm) const
+{
+    int j;
+    long i;
+    double tmp;
+
+    for (j = 0; j < ncol; ++j) {
+        tmp = 0.0;
+        for (i = 0; i < nrow; ++i) {
+            tmp += amat[i + nrow * j] * amat[i + nrow * j];
+        }
+        cnorm[j] = std::sqrt(tmp);
+    }
+}
+
+
+void SparseDesignMatrix::multiply(const double *x,
+                                  double *y) const
+{
+    long i;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+    for (i = 0; i < nrow; ++i) {
+        double tmp = 0.0;
+        for (size_t k = rowptr[i]; k < rowptr[i + 1]; ++k) {
+            tmp += val[k] * x[colind[k]];
+        }
+        y[i] = tmp;
+    }
+}
+
+
+void SparseDesignMatrix::multiply_transpose(const double *x,
+                                            double *y) const
+{
+    int i;
+
+    for (i = 0; i < ncol; ++i) y[i] = 0.0;
+
+#ifdef _OPENMP
+#pragma omp parallel private(i)
+#endif
+    {
+        std::vector<double> y_omp(ncol, 0.0);
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for (long irow = 0; irow < nrow; ++irow) {
+            for (size_t k = rowptr[irow]; k < rowptr[irow + 1]; ++k) {
+                y_omp[colind[k]] += val[k] * x[irow];
+            }
+        }
+
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+        for (i = 0; i < ncol; ++i) y[i] += y_omp[i];
+    }
+}
+
+
+void SparseDesignMatrix::column_norms(double *cnorm) const
+{
+    int i;
+
+    for (i = 0; i < ncol; ++i) cnorm[i] = 0.0;
+    for (size_t k = 0; k < val.size(); ++k) {
+        cnorm[colind[k]] += val[k] * val[k];
+    }
+    for (i = 0; i < ncol; ++i) cnorm[i] = std::sqrt(cnorm[i]);
+}
+
+
+MatrixFreeDesignMatrix::MatrixFreeDesignMatrix(const int maxorder_in,
+                                               const MatrixElementPlan *plan_in,
+                                               const int nat_in,
+                                               const int natmin_in,
+                                               const int ndata_in,
+                                               const int ntran_in,
+                                               double **u_in,
+                                               const std::vector<int> &map_tran_in,
+                                               const int ncol_in)
+{
+    maxorder = maxorder_in;
+    plan = plan_in;
+    nat = nat_in;
+    natmin = natmin_in;
+    ndata = ndata_in;
+    ntran = ntran_in;
+    u = u_in;
+    map_tran = map_tran_in;
+    nrow = 3L * natmin * ndata * ntran;
+    ncol = ncol_in;
+}
+
+
+void MatrixFreeDesignMatrix::get_snapshot(const int icycle,
+                                          double **src,
+                                          double *dst) const
+{
+    // The snapshot icycle = idata * ntran + itran, i.e. the data idata
+    // shifted by the pure translation itran (see Fitting::setup_translation_map).
+
+    const int idata = icycle / ntran;
+    const int *map = map_tran.data() + (icycle % ntran) * nat;
+
+    for (int j = 0; j < nat; ++j) {
+        for (int k = 0; k < 3; ++k) {
+            dst[3 * map[j] + k] = src[idata][3 * j + k];
+        }
+    }
+}
+
+
+void MatrixFreeDesignMatrix::get_snapshot_chunk(const int icycle0,
+                                                const int nsnap,
+                                                double **src,
+                                                double *usoa) const
+{
+    // Snapshots icycle0 .. icycle0+nsnap-1 in the SoA layout usoa[ix * nsnap + isnap].
+
+    const int *map;
+    int idata;
+
+    for (int is = 0; is < nsnap; ++is) {
+        idata = (icycle0 + is) / ntran;
+        map = map_tran.data() + ((icycle0 + is) % ntran) * nat;
+        for (int j = 0; j < nat; ++j) {
+            for (int k = 0; k < 3; ++k) {
+                usoa[(3 * map[j] + k) * nsnap + is] = src[idata][3 * j + k];
+            }
+        }
+    }
+}
+
+
+void MatrixFreeDesignMatrix::multiply(const double *x,
+                                      double *y) const
+{
+    // The snapshots are processed by chunks of nsnap_chunk with the SIMD kernel.
+    // Since all the terms of a row are summed up, the kernel is called with
+    // lda = 0 and the coefficients multiplied by x[col].
+
+    int ichunk, order;
+    const int ncycle = ndata * ntran;
+    const int nchunk = (ncycle + nsnap_chunk - 1) / nsnap_chunk;
+    std::string str_kernel;
+    std::vector<std::vector<double>> coefx(maxorder);
+
+    static const MatrixKernel kernel = select_matrix_kernel(str_kernel);
+
+    for (order = 0; order < maxorder; ++order) {
+        const MatrixElementPlan &p = plan[order];
+        coefx[order].resize(p.nterm_amat);
+        for (unsigned int k = 0; k < p.nterm_amat; ++k) {
+            coefx[order][k] = p.coef[k] * x[p.col[k]];
+        }
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel private(order)
+#endif
+    {
+        int i, is, icycle0, nsnap;
+        std::vector<double> usoa(3 * nat * nsnap_chunk);
+        std::vector<double> yblock(3 * natmin * nsnap_chunk);
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for (ichunk = 0; ichunk < nchunk; ++ichunk) {
+
+            icycle0 = ichunk * nsnap_chunk;
+            nsnap = std::min<int>(nsnap_chunk, ncycle - icycle0);
+            get_snapshot_chunk(icycle0, nsnap, u, usoa.data());
+
+            for (i = 0; i < 3 * natmin * nsnap; ++i) yblock[i] = 0.0;
+
+            for (order = 0; order < maxorder; ++order) {
+                const MatrixElementPlan &p = plan[order];
+                kernel(p.nelem, p.nterm_amat, p.row.data(), p.col.data(),
+                       coefx[order].data(), p.disp.data(),
+                       usoa.data(), nsnap, yblock.data(), 0);
+            }
+
+            for (is = 0; is < nsnap; ++is) {
+                for (i = 0; i < 3 * natmin; ++i) {
+                    y[3L * natmin * (icycle0 + is) + i] = yblock[i * nsnap + is];
+                }
+            }
+        }
+    }
+}
+
+
+void MatrixFreeDesignMatrix::multiply_transpose(const double *x,
+                                                double *y) const
+{
+    int i, ichunk;
+    const int ncycle = ndata * ntran;
+    const int nchunk = (ncycle + nsnap_chunk - 1) / nsnap_chunk;
+    std::string str_kernel;
+
+    static const MatrixKernelTranspose kernel = select_matrix_kernel_transpose(str_kernel);
+
+    for (i = 0; i < ncol; ++i) y[i] = 0.0;
+
+#ifdef _OPENMP
+#pragma omp parallel private(i)
+#endif
+    {
+        int is, order, icycle0, nsnap;
+        std::vector<double> usoa(3 * nat * nsnap_chunk);
+        std::vector<double> xblock(3 * natmin * nsnap_chunk);
+        std::vector<double> y_omp(ncol, 0.0);
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for (ichunk = 0; ichunk < nchunk; ++ichunk) {
+
+            icycle0 = ichunk * nsnap_chunk;
+            nsnap = std::min<int>(nsnap_chunk, ncycle - icycle0);
+            get_snapshot_chunk(icycle0, nsnap, u, usoa.data());
+
+            for (is = 0; is < nsnap; ++is) {
+                for (i = 0; i < 3 * natmin; ++i) {
+                    xblock[i * nsnap + is] = x[3L * natmin * (icycle0 + is) + i];
+                }
+            }
+
+            for (order = 0; order < maxorder; ++order) {
+                const MatrixElementPlan &p = plan[order];
+                kernel(p.nelem, p.nterm_amat, p.row.data(), p.col.data(),
+                       p.coef.data(), p.disp.data(),
+                       usoa.data(), nsnap, xblock.data(), y_omp.data());
+            }
+        }
+
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+        for (i = 0; i < ncol; ++i) y[i] += y_omp[i];
+    }
+}
+
+
+void MatrixFreeDesignMatrix::column_norms(double *cnorm) const
+{
+    // Terms sharing the same (row, col) are adjacent in the plan,
+    // and they are summed up before squaring.
+
+    int i, icycle;
+    const int ncycle = ndata * ntran;
+
+    for (i = 0; i < ncol; ++i) cnorm[i] = 0.0;
+
+#ifdef _OPENMP
+#pragma omp parallel private(i)
+#endif
+    {
+        int j, order;
+        double prod, sum;
+        std::vector<double> usnap(3 * nat);
+        std::vector<double> c_omp(ncol, 0.0);
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for (icycle = 0; icycle < ncycle; ++icycle) {
+
+            get_snapshot(icycle, u, usnap.data());
+
+            for (order = 0; order < maxorder; ++order) {
+                const MatrixElementPlan &p = plan[order];
+                const int *disp = p.disp.data();
+                sum = 0.0;
+                for (unsigned int k = 0; k < p.nterm_amat; ++k) {
+                    prod = p.coef[k];
+                    for (j = 0; j < p.nelem; ++j) prod *= usnap[disp[j]];
+                    disp += p.nelem;
+                    sum += prod;
+                    if (k + 1 == p.nterm_amat
+                        || p.row[k + 1] != p.row[k] || p.col[k + 1] != p.col[k]) {
+                        c_omp[p.col[k]] += sum * sum;
+                        sum = 0.0;
+                    }
+                }
+            }
+        }
+
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+        for (i = 0; i < ncol; ++i) cnorm[i] += c_omp[i];
+    }
+
+    for (i = 0; i < ncol; ++i) cnorm[i] = std::sqrt(cnorm[i]);
+}
+
+
+void MatrixFreeDesignMatrix::calc_rhs(double **f,
+                                      const int *iat_prim,
+                                      double *bvec,
+                                      double *bvec_orig) const
+{
+    // bvec = f - (contribution of the fixed parameters), and bvec_orig = f.
+
+    int icycle;
+    const int ncycle = ndata * ntran;
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+        int i, j, order;
+        double prod;
+        double *brow;
+        std::vector<double> usnap(3 * nat), fsnap(3 * nat);
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+        for (icycle = 0; icycle < ncycle; ++icycle) {
+
+            get_snapshot(icycle, u, usnap.data());
+            get_snapshot(icycle, f, fsnap.data());
+            brow = bvec + 3L * natmin * icycle;
+
+            for (i = 0; i < natmin; ++i) {
+                for (j = 0; j < 3; ++j) {
+                    brow[3 * i + j] = fsnap[3 * iat_prim[i] + j];
+                    bvec_orig[3L * natmin * icycle + 3 * i + j] = brow[3 * i + j];
+                }
+            }
+
+            for (order = 0; order < maxorder; ++order) {
+                const MatrixElementPlan &p = plan[order];
+                const unsigned int nterm = p.row.size();
+                const int *disp = p.disp.data() + static_cast<long>(p.nterm_amat) * p.nelem;
+                for (unsigned int k = p.nterm_amat; k < nterm; ++k) {
+                    prod = p.coef[k];
+                    for (j = 0; j < p.nelem; ++j) prod *= usnap[disp[j]];
+                    disp += p.nelem;
+                    brow[p.row[k]] += prod;
+                }
+            }
+        }
+    }
+}
+
+
+PreconditionedOperator::PreconditionedOperator(const LinearOperator &op_in,
+                                               const double *rmat_in,
+                                               const int ldr_in) :
+    op(op_in), rmat(rmat_in), ldr(ldr_in)
+{
+    nrow = op.nrow;
+    ncol = op.ncol;
+    work.resize(ncol);
+}
+
+
+void PreconditionedOperator::multiply(const double *x,
+                                      double *y) const
+{
+    int n = ncol, lda = ldr, inc = 1;
+
+    for (int i = 0; i < n; ++i) work[i] = x[i];
+    dtrsv_("U", "N", "N", &n, const_cast<double *>(rmat), &lda, work.data(), &inc);
+    op.multiply(work.data(), y);
+}
+
+
+void PreconditionedOperator::multiply_transpose(const double *x,
+                                                double *y) const
+{
+    int n = ncol, lda = ldr, inc = 1;
+
+    op.multiply_transpose(x, y);
+    dtrsv_("U", "T", "N", &n, const_cast<double *>(rmat), &lda, y, &inc);
+}
+
+
+void PreconditionedOperator::column_norms(double *cnorm) const
+{
+    // The columns of A R^{-1} have nearly unit norm, and LSQR needs no
+    // further scaling.
+
+    for (int j = 0; j < ncol; ++j) cnorm[j] = 1.0;
+}
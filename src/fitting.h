@@ -20,6 +20,138 @@
 
 namespace ALM_NS
 {
+    class MatrixElementPlan
+    {
+    public:
+        // Flattened list of the terms of the design matrix for one order.
+        // The k-th term adds
+        //   coef[k] * u[disp[nelem * k]] * ... * u[disp[nelem * k + nelem - 1]]
+        // to the element (row[k], col[k]) of the 3*natmin x N block of a snapshot.
+        // Terms with k >= nterm_amat have col[k] = -1 and are added to
+        // the r.h.s. vector instead (fixed parameters of the algebraic constraint).
+
+        int nelem;
+        unsigned int nterm_amat;
+        std::vector<int> row;
+        std::vector<int> col;
+        std::vector<double> coef;
+        std::vector<int> disp;
+
+        MatrixElementPlan()
+        {
+            nelem = 0;
+            nterm_amat = 0;
+        };
+    };
+
+    class LinearOperator
+    {
+    public:
+        // Linear map from R^ncol to R^nrow used by the iterative solvers.
+        // nrow may exceed the range of int for the large data sets.
+
+        long nrow;
+        int ncol;
+
+        virtual ~LinearOperator() {};
+        virtual void multiply(const double *x, double *y) const = 0; // y = A x
+        virtual void multiply_transpose(const double *x, double *y) const = 0; // y = A^T x
+        virtual void column_norms(double *cnorm) const = 0;
+    };
+
+    class DesignMatrix: public LinearOperator
+    {
+    public:
+        // M x N design matrix in the column-major layout of LAPACK, i.e.,
+        // the element (i, j) is amat[i + nrow * j], and the r.h.s. vectors.
+        // The solvers factorize amat in place. bvec has max(M, N) elements
+        // as required by DGELSS. bvec_orig holds the forces before the
+        // contribution of the fixed parameters is subtracted.
+
+        double *amat;
+        double *bvec;
+        double *bvec_orig;
+
+        DesignMatrix();
+        ~DesignMatrix();
+
+        void resize(const long, const int);
+        void multiply(const double *, double *) const;
+        void multiply_transpose(const double *, double *) const;
+        void column_norms(double *) const;
+
+    private:
+        unsigned long capacity, capacity_vec;
+    };
+
+    class SparseDesignMatrix: public LinearOperator
+    {
+    public:
+        // Design matrix in the compressed sparse row (CSR) format.
+        // The nonzero elements of the row i are val[rowptr[i] .. rowptr[i+1]-1]
+        // located at the columns colind[rowptr[i] .. rowptr[i+1]-1].
+
+        std::vector<size_t> rowptr;
+        std::vector<int> colind;
+        std::vector<double> val;
+
+        SparseDesignMatrix()
+        {
+            nrow = 0;
+            ncol = 0;
+        };
+
+        void multiply(const double *, double *) const;
+        void multiply_transpose(const double *, double *) const;
+        void column_norms(double *) const;
+    };
+
+    class MatrixFreeDesignMatrix: public LinearOperator
+    {
+    public:
+        // Design matrix defined implicitly by the row plan and the snapshots.
+        // The elements are recomputed from the displacements at every product,
+        // and the pure translations of the supercell are applied on the fly,
+        // so that only the original ndata x 3*nat displacements are kept.
+
+        MatrixFreeDesignMatrix(const int, const MatrixElementPlan *,
+                               const int, const int, const int, const int,
+                               double **, const std::vector<int> &, const int);
+
+        void multiply(const double *, double *) const;
+        void multiply_transpose(const double *, double *) const;
+        void column_norms(double *) const;
+        void calc_rhs(double **, const int *, double *, double *) const;
+
+    private:
+        int maxorder, nat, natmin, ndata, ntran;
+        const MatrixElementPlan *plan;
+        double **u;
+        std::vector<int> map_tran; // map_tran[itran * nat + iat]
+
+        void get_snapshot(const int, double **, double *) const;
+        void get_snapshot_chunk(const int, const int, double **, double *) const;
+    };
+
+    class PreconditionedOperator: public LinearOperator
+    {
+    public:
+        // A R^{-1} for the N x N upper triangular matrix R in the column-major
+        // layout with the leading dimension ldr.
+
+        PreconditionedOperator(const LinearOperator &, const double *, const int);
+
+        void multiply(const double *, double *) const;
+        void multiply_transpose(const double *, double *) const;
+        void column_norms(double *) const;
+
+    private:
+        const LinearOperator &op;
+        const double *rmat;
+        int ldr;
+        mutable std::vector<double> work;
+    };
+
     class Fitting: protected Pointers
     {
     public:
@@ -27,39 +159,183 @@ namespace ALM_NS
         ~Fitting();
 
         void fitmain();
+        void plan();
 
         double *params;
         double **u_in;
         double **f_in;
+        int nset; // number of force sets for the same displacements
+        double **f_in_extra; // force sets 2 .. nset, (nset - 1) * ndata x 3*nat
+        double **params_set; // force constants of each force set, nset x N
+
+        std::string solver; // SVD (default), SVD_DC, QRP, SKETCH, AUTO, CHOLESKY, TSQR, LSQR, or CGLS
+        int nblock; // number of snapshots processed at once in the streaming mode
+        int use_sparse; // store the design matrix in the CSR format
+        std::string sparse_solver; // LSQR (default) or QR
+        double tol_iter; // convergence threshold of the iterative solvers
+        int maxiter; // maximum number of iterations (0: automatic)
+        int warm_start; // start the iterative solvers from the current params
+        std::string scratch_dir; // directory of the scratch file for the out-of-core mode
+        double maxmem; // memory budget of a row panel in MB (0: automatic)
+        int cross_validation; // number of folds of the cross validation (0: off)
+        double cv_minalpha, cv_maxalpha; // range of the ridge parameters
+        int cv_nalpha; // number of the ridge parameters
+        std::string lmodel; // LS (default) or ENET
+        double l1_alpha; // penalty of the elastic net
+        double l1_ratio; // fraction of the L1 penalty (1: LASSO)
+        int hierarchical; // fit the force constants order by order
+        std::vector<int> nstart_order, nend_order; // data range of each order
+        std::string precision; // DOUBLE (default) or MIXED
+        double memlimit; // memory budget of the whole job in MB for choosing SOLVER (0: off)
+        std::string selection; // NONE (default) or DOPT: selection of the snapshots
+        double select_cond; // allowed growth of the condition number by the selection
+        int parity; // split the fitting by the parity for the pairs of +u and -u
+        int pin_threads; // bind the OpenMP threads to the CPUs
+        int online; // snapshots per update of the online fitting (0: off)
+        double online_wait; // seconds to wait for new snapshots in the online fitting
+        int nprocs, my_rank; // MPI processes sharing the snapshots (1 without MPI)
+        bool snapshots_distributed; // u_in and f_in hold only the block of this process
+
+        // Results of the cross validation: ridge parameters, fitting errors (%)
+        // of the training and validation sets, and the standard deviation of
+        // the validation error over the folds.
+        std::vector<double> cv_alphas;
+        std::vector<double> cv_error_train, cv_error_valid, cv_error_valid_std;
+        double cv_alpha_opt;
+
+        // Rank of the design matrix (-1 if not computed) and the fitting
+        // error (%) of the last fit. With multiple force sets, the error is
+        // that of the first set.
+        int fit_rank;
+        double fit_error;
+
+        // Indices (from 1) of the data used by the last fit with SELECT = DOPT
+        std::vector<int> snapshots_selected;
+
+        MatrixElementPlan *matrix_plan;
 
         void set_displacement_and_force(const double * const *u_in,
                                         const double * const *f_in,
                                         const int nat,
                                         const int ndata_used);
-        void calc_matrix_elements_algebraic_constraint(const int, const int, const int, const int,
-                                                       const int, const int, const int, const int,
-                                                       double **, double **, double **, double *, double *);
+        void set_extra_force_sets(const double * const *f_in,
+                                  const int nat,
+                                  const int ndata_used,
+                                  const int nset_extra);
+        void append_displacement_and_force(const double * const *u_in,
+                                           const double * const *f_in,
+                                           const int nat,
+                                           const int ndata_add);
+        static void snapshot_block(const int, const int, const int, int &, int &);
         double gamma(const int, const int *);
+        void build_matrix_element_plan(const int, const int, const double *);
 
     private:
+        // Triangular factor (R c; 0 rho) of the augmented matrix (A b) of the
+        // data fitted so far, kept for append_displacement_and_force.
+        double *rfactor;
+        int ncol_rfactor;
+        double f_square_rfactor;
+        int ndata_capacity; // rows allocated for u_in and f_in
+        bool threads_pinned;
+
         void set_default_variables();
         void deallocate_variables();
-        void data_multiplier(double **u,
-                             double **f,
-                             const int nat,
-                             const int ndata_used,
-                             const int nmulti);
+        std::vector<int> map_tran; // map_tran[itran * nat + iat]: iat shifted by itran
+        std::vector<int> map_tran_inv; // inverse of map_tran for each itran
+
+        void setup_translation_map(const int, const int);
+        void bind_threads_to_cpus();
         int inprim_index(const int);
-        void fit_without_constraints(int, int, double **, double *, double *);
-        void fit_algebraic_constraints(int, int, double **, double *,
-                                       double *, double *, const int);
+        void fit_without_constraints(int, int, DesignMatrix &, double *, const std::string);
+        void fit_algebraic_constraints(int, int, DesignMatrix &, double *, const int,
+                                       const std::string);
+        int solve_least_squares(const std::string, DesignMatrix &, double *, double &);
+        bool solve_sketch_preconditioned(DesignMatrix &, double *);
+        std::string resolve_dense_solver(DesignMatrix &);
+        std::string select_solver(DesignMatrix &);
+        std::string solver_name(const std::string) const;
+        double setup_memory(double *) const;
+        double fitting_memory(const std::string, const long, const int, const int) const;
+        double lapack_workspace(const std::string, const int, const int) const;
+        std::string select_solver_for_memory(const long, const int, const int);
+        bool use_out_of_core() const;
+        void select_snapshots(const int, const int, const int, const int,
+                              const int, const int, std::vector<int> &);
+        double information_gain(const int, const int, double *, const double *) const;
+        void fit_multiple_force_sets(const int, int, const int, const int,
+                                     const int, const int, const int, const int,
+                                     DesignMatrix &, double **);
+        void recover_original_forceconstants(const int, const double *, double *);
+
+        void fit_normal_equation(const int, const int, const int, const int,
+                                 const int, const int, const int, double *);
+        void accumulate_normal_equation(int, const int, const int, const int,
+                                        const int, const int, const int,
+                                        double *, double *, double &, double &);
+        int solve_normal_equation(const int, const double *, const double *, double *);
+        int solve_normal_equation_with_constraints(const int, const int,
+                                                   const double *, const double *,
+                                                   double **, double *, double *);
 
-        void fit_with_constraints(int, int, int, double **, double *,
+        void fit_cross_validation(const int, const int, const int, const int,
+                                  const int, const int, const int, double *);
+
+        void fit_order_by_order(const int, const int, const int, const int,
+                                const int, const int, double *);
+        void fit_elastic_net(const int, const int, const int, const int,
+                             const int, const int, const int, double *);
+        int coordinate_descent(const int, const double *, const double,
+                               const double, double *, double *);
+
+        void fit_sparse(const int, const int, const int, const int,
+                        const int, const int, const int, double *);
+        void fit_out_of_core(const int, const int, const int, const int,
+                             const int, const int, const int, double *);
+        int solve_triangular_factor(const int, const double *, const int,
+                                    double *, double &);
+        void add_rows_to_triangular_factor(const int, const int, double *, double *);
+        void update_triangular_factor(const int, const int, const int,
+                                      const int, const int, double *, double &);
+        void fit_tsqr(const int, const int, const int, const int,
+                      const int, const int, const int, double *);
+        void merge_triangular_factors(const int, double *, double *);
+        void reduce_triangular_factor(const int, double *, double &);
+        int snapshots_per_panel(const int, const int, const int) const;
+        void fit_mixed_precision(const int, const int, const int, const int,
+                                 const int, const int, const int, double *);
+        void fit_matrix_free(const int, const int, const int, const int,
+                             const int, const int, const int, double *,
+                             const std::string);
+        int lsqr(const LinearOperator &, const double *, double *,
+                 const double, const int, const bool);
+        int cgls(const LinearOperator &, const double *, double *,
+                 const double, const int, const bool);
+        int run_iterative_solver(const LinearOperator &, const double *, double *,
+                                 const std::string, const int);
+
+        void fit_with_constraints(int, int, int, DesignMatrix &,
                                   double *, double **, double *);
+        int solve_constrained_least_squares(DesignMatrix &, int, double *,
+                                            double *, double *, double &);
+
+        bool fit_harmonic_direct(const int, const int, const int, const int,
+                                 const int, const int, double *);
+        bool find_displacement_pairs(const int, const int,
+                                     std::vector<std::pair<int, int>> &);
+        bool fit_parity_split(const int, const int, const int, const int,
+                              const int, const int, const int, double *);
 
-        void calc_matrix_elements(const int, const int, const int,
-                                  const int, const int, const int, const int,
-                                  double **, double **, double **, double *);
+        void calc_matrix_elements(const int, const int, const int, const int,
+                                  const int, const int, const int, DesignMatrix &);
+        void gather_forces_chunk(const int, const int, const int, const int,
+                                 double **, double *);
+        void calc_matrix_elements_sparse(const int, const int, const int,
+                                         const int, const int,
+                                         SparseDesignMatrix &, double *, double *);
+        void calc_matrix_elements_chunk(const int, const int, const int, const int,
+                                        const int, const int,
+                                        double *, const int, double *, double *);
 
         int factorial(const int);
         int rankSVD(const int, const int, double *, const double);
@@ -73,6 +349,10 @@ namespace ALM_NS
                      double *b, int *ldb, double *s, double *rcond, int *rank,
                      double *work, int *lwork, int *info);
 
+        void dgelsd_(int *m, int *n, int *nrhs, double *a, int *lda,
+                     double *b, int *ldb, double *s, double *rcond, int *rank,
+                     double *work, int *lwork, int *iwork, int *info);
+
         void dgglse_(int *m, int *n, int *p, double *a, int *lda,
                      double *b, int *ldb, double *c, double *d, double *x,
                      double *work, int *lwork, int *info);
@@ -84,7 +364,50 @@ namespace ALM_NS
         void dgeqrf_(int *m, int *n, double *a, int *lda, double *tau,
                      double *work, int *lwork, int *info);
 
+        void sgeqrf_(int *m, int *n, float *a, int *lda, float *tau,
+                     float *work, int *lwork, int *info);
+
         void dgeqp3_(int *m, int *n, double *a, int *lda, int *jpvt,
                      double *tau, double *work, int *lwork, int *info);
+
+        void dorgqr_(int *m, int *n, int *k, double *a, int *lda, double *tau,
+                     double *work, int *lwork, int *info);
+
+        void dormqr_(const char *side, const char *trans, int *m, int *n, int *k,
+                     double *a, int *lda, double *tau, double *c, int *ldc,
+                     double *work, int *lwork, int *info);
+
+        void dtpqrt_(int *m, int *n, int *l, int *nb, double *a, int *lda,
+                     double *b, int *ldb, double *t, int *ldt, double *work, int *info);
+
+        void dtrtrs_(const char *uplo, const char *trans, const char *diag, int *n, int *nrhs,
+                     double *a, int *lda, double *b, int *ldb, int *info);
+
+        void dposv_(const char *uplo, int *n, int *nrhs, double *a, int *lda,
+                    double *b, int *ldb, int *info);
+
+        void dsyev_(const char *jobz, const char *uplo, int *n, double *a, int *lda,
+                    double *w, double *work, int *lwork, int *info);
+
+        void dpotrf_(const char *uplo, int *n, double *a, int *lda, int *info);
+
+        void dtrsm_(const char *side, const char *uplo, const char *transa, const char *diag,
+                    int *m, int *n, double *alpha, double *a, int *lda, double *b, int *ldb);
+
+        void dsyrk_(const char *uplo, const char *trans, int *n, int *k, double *alpha,
+                    double *a, int *lda, double *beta, double *c, int *ldc);
+
+        void dgemm_(const char *transa, const char *transb, int *m, int *n, int *k,
+                    double *alpha, double *a, int *lda, double *b, int *ldb,
+                    double *beta, double *c, int *ldc);
+
+        void dgemv_(const char *trans, int *m, int *n, double *alpha, double *a, int *lda,
+                    double *x, int *incx, double *beta, double *y, int *incy);
+
+        void dtrsv_(const char *uplo, const char *trans, const char *diag, int *n,
+                    double *a, int *lda, double *x, int *incx);
+
+        void dsymv_(const char *uplo, int *n, double *alpha, double *a, int *lda,
+                    double *x, int *incx, double *beta, double *y, int *incy);
     }
 }
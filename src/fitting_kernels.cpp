@@ -0,0 +1,255 @@
+/*
+ fitting_kernels.cpp
+
+ Copyright (c) 2014, 2015, 2016 Terumasa Tadano
+
+ This file is distributed under the terms of the MIT license.
+ Please see the file 'LICENCE.txt' in the root directory 
+ or http://opensource.org/licenses/mit-license.php for information.
+*/
+
+#include <string>
+#include "fitting_kernels.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define _SIMD_DISPATCH
+#include <immintrin.h>
+#endif
+
+
+using namespace ALM_NS;
+
+static void matrix_kernel_scalar(const int nelem,
+                                 const unsigned int nterm,
+                                 const int *row,
+                                 const int *col,
+                                 const double *coef,
+                                 const int *disp,
+                                 const double *usoa,
+                                 const int nsnap,
+                                 double *amat,
+                                 const int lda)
+{
+    int j, is;
+    double *dst;
+
+    for (unsigned int k = 0; k < nterm; ++k) {
+        dst = amat + static_cast<long>(col[k]) * lda + row[k] * nsnap;
+        for (is = 0; is < nsnap; ++is) {
+            double prod = coef[k];
+            for (j = 0; j < nelem; ++j) prod *= usoa[disp[j] * nsnap + is];
+            dst[is] += prod;
+        }
+        disp += nelem;
+    }
+}
+
+#ifdef _SIMD_DISPATCH
+__attribute__((target("avx2")))
+static void matrix_kernel_avx2(const int nelem,
+                               const unsigned int nterm,
+                               const int *row,
+                               const int *col,
+                               const double *coef,
+                               const int *disp,
+                               const double *usoa,
+                               const int nsnap,
+                               double *amat,
+                               const int lda)
+{
+    int j, is;
+    double *dst;
+    __m256d prod;
+
+    for (unsigned int k = 0; k < nterm; ++k) {
+        dst = amat + static_cast<long>(col[k]) * lda + row[k] * nsnap;
+        for (is = 0; is + 4 <= nsnap; is += 4) {
+            prod = _mm256_set1_pd(coef[k]);
+            for (j = 0; j < nelem; ++j) {
+                prod = _mm256_mul_pd(prod, _mm256_loadu_pd(usoa + disp[j] * nsnap + is));
+            }
+            _mm256_storeu_pd(dst + is, _mm256_add_pd(_mm256_loadu_pd(dst + is), prod));
+        }
+        for (; is < nsnap; ++is) {
+            double prod_s = coef[k];
+            for (j = 0; j < nelem; ++j) prod_s *= usoa[disp[j] * nsnap + is];
+            dst[is] += prod_s;
+        }
+        disp += nelem;
+    }
+}
+
+__attribute__((target("avx512f")))
+static void matrix_kernel_avx512(const int nelem,
+                                 const unsigned int nterm,
+                                 const int *row,
+                                 const int *col,
+                                 const double *coef,
+                                 const int *disp,
+                                 const double *usoa,
+                                 const int nsnap,
+                                 double *amat,
+                                 const int lda)
+{
+    int j, is;
+    double *dst;
+    __m512d prod;
+
+    for (unsigned int k = 0; k < nterm; ++k) {
+        dst = amat + static_cast<long>(col[k]) * lda + row[k] * nsnap;
+        for (is = 0; is + 8 <= nsnap; is += 8) {
+            prod = _mm512_set1_pd(coef[k]);
+            for (j = 0; j < nelem; ++j) {
+                prod = _mm512_mul_pd(prod, _mm512_loadu_pd(usoa + disp[j] * nsnap + is));
+            }
+            _mm512_storeu_pd(dst + is, _mm512_add_pd(_mm512_loadu_pd(dst + is), prod));
+        }
+        for (; is < nsnap; ++is) {
+            double prod_s = coef[k];
+            for (j = 0; j < nelem; ++j) prod_s *= usoa[disp[j] * nsnap + is];
+            dst[is] += prod_s;
+        }
+        disp += nelem;
+    }
+}
+#endif
+
+MatrixKernel ALM_NS::select_matrix_kernel(std::string &name)
+{
+#ifdef _SIMD_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        name = "AVX-512";
+        return matrix_kernel_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        name = "AVX2";
+        return matrix_kernel_avx2;
+    }
+#endif
+    name = "scalar";
+    return matrix_kernel_scalar;
+}
+
+static void matrix_kernel_transpose_scalar(const int nelem,
+                                           const unsigned int nterm,
+                                           const int *row,
+                                           const int *col,
+                                           const double *coef,
+                                           const int *disp,
+                                           const double *usoa,
+                                           const int nsnap,
+                                           const double *x,
+                                           double *y)
+{
+    int j, is;
+    const double *src;
+
+    for (unsigned int k = 0; k < nterm; ++k) {
+        src = x + row[k] * nsnap;
+        double sum = 0.0;
+        for (is = 0; is < nsnap; ++is) {
+            double prod = src[is];
+            for (j = 0; j < nelem; ++j) prod *= usoa[disp[j] * nsnap + is];
+            sum += prod;
+        }
+        y[col[k]] += coef[k] * sum;
+        disp += nelem;
+    }
+}
+
+#ifdef _SIMD_DISPATCH
+__attribute__((target("avx2")))
+static void matrix_kernel_transpose_avx2(const int nelem,
+                                         const unsigned int nterm,
+                                         const int *row,
+                                         const int *col,
+                                         const double *coef,
+                                         const int *disp,
+                                         const double *usoa,
+                                         const int nsnap,
+                                         const double *x,
+                                         double *y)
+{
+    int j, is;
+    const double *src;
+    __m256d prod, sum;
+    double buf[4];
+
+    for (unsigned int k = 0; k < nterm; ++k) {
+        src = x + row[k] * nsnap;
+        sum = _mm256_setzero_pd();
+        for (is = 0; is + 4 <= nsnap; is += 4) {
+            prod = _mm256_loadu_pd(src + is);
+            for (j = 0; j < nelem; ++j) {
+                prod = _mm256_mul_pd(prod, _mm256_loadu_pd(usoa + disp[j] * nsnap + is));
+            }
+            sum = _mm256_add_pd(sum, prod);
+        }
+        _mm256_storeu_pd(buf, sum);
+        double sum_s = buf[0] + buf[1] + buf[2] + buf[3];
+        for (; is < nsnap; ++is) {
+            double prod_s = src[is];
+            for (j = 0; j < nelem; ++j) prod_s *= usoa[disp[j] * nsnap + is];
+            sum_s += prod_s;
+        }
+        y[col[k]] += coef[k] * sum_s;
+        disp += nelem;
+    }
+}
+
+__attribute__((target("avx512f")))
+static void matrix_kernel_transpose_avx512(const int nelem,
+                                           const unsigned int nterm,
+                                           const int *row,
+                                           const int *col,
+                                           const double *coef,
+                                           const int *disp,
+                                           const double *usoa,
+                                           const int nsnap,
+                                           const double *x,
+                                           double *y)
+{
+    int j, is;
+    const double *src;
+    __m512d prod, sum;
+    double buf[8];
+
+    for (unsigned int k = 0; k < nterm; ++k) {
+        src = x + row[k] * nsnap;
+        sum = _mm512_setzero_pd();
+        for (is = 0; is + 8 <= nsnap; is += 8) {
+            prod = _mm512_loadu_pd(src + is);
+            for (j = 0; j < nelem; ++j) {
+                prod = _mm512_mul_pd(prod, _mm512_loadu_pd(usoa + disp[j] * nsnap + is));
+            }
+            sum = _mm512_add_pd(sum, prod);
+        }
+        _mm512_storeu_pd(buf, sum);
+        double sum_s = buf[0] + buf[1] + buf[2] + buf[3] + buf[4] + buf[5] + buf[6] + buf[7];
+        for (; is < nsnap; ++is) {
+            double prod_s = src[is];
+            for (j = 0; j < nelem; ++j) prod_s *= usoa[disp[j] * nsnap + is];
+            sum_s += prod_s;
+        }
+        y[col[k]] += coef[k] * sum_s;
+        disp += nelem;
+    }
+}
+#endif
+
+MatrixKernelTranspose ALM_NS::select_matrix_kernel_transpose(std::string &name)
+{
+#ifdef _SIMD_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        name = "AVX-512";
+        return matrix_kernel_transpose_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        name = "AVX2";
+        return matrix_kernel_transpose_avx2;
+    }
+#endif
+    name = "scalar";
+    return matrix_kernel_transpose_scalar;
+}
@@ -0,0 +1,42 @@
+/*
+ fitting_kernels.h
+
+ Copyright (c) 2014, 2015, 2016 Terumasa Tadano
+
+ This file is distributed under the terms of the MIT license.
+ Please see the file 'LICENCE.txt' in the root directory 
+ or http://opensource.org/licenses/mit-license.php for information.
+*/
+
+#pragma once
+
+#include <string>
+
+namespace ALM_NS
+{
+    // Number of snapshots processed together by the SIMD kernel
+    const int nsnap_chunk = 16;
+
+    // Kernels adding the terms [0, nterm) of a MatrixElementPlan to a block whose
+    // rows are ordered as (row[k] * nsnap + isnap). The displacements are given in
+    // the snapshot-innermost (SoA) layout usoa[ix * nsnap + isnap] so that the
+    // product of the displacements is evaluated for several snapshots at once
+    // and stored to a contiguous segment of column col[k].
+
+    typedef void (*MatrixKernel)(const int, const unsigned int,
+                                 const int *, const int *, const double *, const int *,
+                                 const double *, const int, double *, const int);
+
+    // Kernels of the transposed product: for the terms [0, nterm),
+    //   y[col[k]] += coef[k] * sum_isnap (product of displacements) * x[row[k] * nsnap + isnap]
+
+    typedef void (*MatrixKernelTranspose)(const int, const unsigned int,
+                                          const int *, const int *, const double *, const int *,
+                                          const double *, const int, const double *, double *);
+
+    // The fastest kernels supported by the CPU (AVX-512, AVX2, or scalar).
+    // name is set to the instruction set of the kernel.
+
+    MatrixKernel select_matrix_kernel(std::string &name);
+    MatrixKernelTranspose select_matrix_kernel_transpose(std::string &name);
+}
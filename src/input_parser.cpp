@@ -23,13 +23,33 @@
 #include <algorithm>
 #include <map>
 #include <set>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <sys/stat.h>
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
 
+#ifdef _USE_MPI
+#include <mpi.h>
+#endif
+
 using namespace ALM_NS;
 
+static bool is_named_pipe(const std::string &filename)
+{
+#ifdef S_ISFIFO
+    struct stat st;
+    if (stat(filename.c_str(), &st) == 0) return S_ISFIFO(st.st_mode);
+#endif
+    return false;
+}
+
 InputParser::InputParser()
 {
+    end_of_online = false;
+    pipe_disp_online = false;
+    pipe_force_online = false;
 }
 
 InputParser::~InputParser()
@@ -68,15 +88,105 @@ void InputParser::parse_displacement_and_force(ALMCore *alm)
     double **u;
     double **f;
 
+    double **f_extra;
+    std::vector<std::string> file_force_v;
+
     // Read displacement-force training data set from files
     std::string file_disp = alm->files->file_disp;
     std::string file_force = alm->files->file_force;
 
-    allocate(u, ndata_used, 3 * nat);
-    allocate(f, ndata_used, 3 * nat);
-    parse_displacement_and_force_files(alm->error, u, f, nat, ndata, nstart, nend,
-                                       file_disp, file_force);
-    alm->fitting->set_displacement_and_force(u, f, nat, ndata_used);
+    // FFILE may contain several files of the forces for the same displacements.
+    boost::split(file_force_v, file_force, boost::is_space(), boost::token_compress_on);
+    file_force_v.erase(std::remove(file_force_v.begin(), file_force_v.end(), ""),
+                       file_force_v.end());
+    const int nset_extra = file_force_v.size() - 1;
+
+    if (alm->fitting->online > 0) {
+
+        // In the online fitting, DFILE and FFILE stay open after the first
+        // NDATA snapshots, and the rest are read by parse_next_snapshots.
+        // They may be files still growing or named pipes. The writer of the
+        // pipes must open DFILE before FFILE and write the snapshots one by one.
+
+        if (nset_extra > 0) {
+            alm->error->exit("parse_displacement_and_force",
+                             "ONLINE > 0 supports a single FFILE only.");
+        }
+
+        pipe_disp_online = is_named_pipe(file_disp);
+        pipe_force_online = is_named_pipe(file_force_v[0]);
+
+        ifs_disp_online.open(file_disp.c_str(), std::ios::in);
+        if (!ifs_disp_online) alm->error->exit("openfiles", "cannot open disp file");
+        ifs_force_online.open(file_force_v[0].c_str(), std::ios::in);
+        if (!ifs_force_online) alm->error->exit("openfiles", "cannot open force file");
+
+        allocate(u, ndata, 3 * nat);
+        allocate(f, ndata, 3 * nat);
+
+        for (int i = 0; i < ndata; ++i) {
+            if (!read_snapshot_online(ifs_disp_online, line_disp_online, val_disp_online,
+                                      pipe_disp_online,
+                                      3 * nat, alm->fitting->online_wait)
+                || !read_snapshot_online(ifs_force_online, line_force_online, val_force_online,
+                                         pipe_force_online,
+                                         3 * nat, alm->fitting->online_wait)) {
+                alm->error->exit("parse_displacement_and_force",
+                                 "DFILE or FFILE ended before NDATA snapshots were read. NDATA = ",
+                                 ndata);
+            }
+            pop_snapshot_online(val_disp_online, 3 * nat, u[i]);
+            pop_snapshot_online(val_force_online, 3 * nat, f[i]);
+        }
+        alm->fitting->set_displacement_and_force(u, f, nat, ndata);
+
+        deallocate(u);
+        deallocate(f);
+        return;
+    }
+
+    // With more than one MPI process, each process reads and keeps only
+    // its own block of the snapshots, which is fitted by TSQR or CHOLESKY.
+
+    int idata_begin = 0;
+    int idata_end = ndata_used;
+    bool distributed = false;
+
+#ifdef _USE_MPI
+    int mpi_initialized, nprocs = 1, my_rank = 0;
+    MPI_Initialized(&mpi_initialized);
+    if (mpi_initialized) {
+        MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+        MPI_Comm_rank(MPI_COMM_WORLD, &my_rank);
+    }
+    if (nprocs > 1) {
+        Fitting::snapshot_block(ndata_used, nprocs, my_rank, idata_begin, idata_end);
+        distributed = true;
+    }
+#endif
+
+    const int ndata_local = idata_end - idata_begin;
+
+    allocate(u, ndata_local, 3 * nat);
+    allocate(f, ndata_local, 3 * nat);
+    parse_displacement_and_force_files(alm->error, u, f, nat, ndata,
+                                       nstart + idata_begin, nstart + idata_end - 1,
+                                       file_disp, file_force_v[0]);
+    alm->fitting->set_displacement_and_force(u, f, nat, ndata_local);
+    alm->fitting->snapshots_distributed = distributed;
+
+    if (nset_extra > 0) {
+        allocate(f_extra, nset_extra * ndata_local, 3 * nat);
+        for (int iset = 0; iset < nset_extra; ++iset) {
+            parse_displacement_and_force_files(alm->error, u, f_extra + iset * ndata_local,
+                                               nat, ndata,
+                                               nstart + idata_begin, nstart + idata_end - 1,
+                                               file_disp, file_force_v[iset + 1]);
+        }
+        alm->fitting->set_extra_force_sets(f_extra, nat, ndata_local, nset_extra);
+        deallocate(f_extra);
+    }
+
     deallocate(u);
     deallocate(f);
 }
@@ -91,11 +201,11 @@ void InputParser::parse_displacement_and_force_files(Error *error,
                                                      const std::string file_disp,
                                                      const std::string file_force)
 {
-    int i, j, k;
-    int idata;
     double u_in, f_in;
-    unsigned int nline_f, nline_u;
-    unsigned int nreq;
+    size_t nline_f, nline_u;
+    size_t nreq;
+    long idata;
+    const size_t nval = 3 * nat;
 
     std::ifstream ifs_disp, ifs_force;
 
@@ -104,16 +214,20 @@ void InputParser::parse_displacement_and_force_files(Error *error,
     ifs_force.open(file_force.c_str(), std::ios::in);
     if (!ifs_force) error->exit("openfiles", "cannot open force file");
 
-    nreq = 3 * nat * ndata;
+    nreq = nval * ndata;
 
-    std::vector<double> u_tmp(nreq), f_tmp(nreq);
+    // Only the snapshots nstart .. nend are kept while the files are read,
+    // so that no copy of the whole data is made.
 
     // Read displacements from DFILE
 
     nline_u = 0;
-    while (ifs_disp >> u_in) {
-        u_tmp[nline_u++] = u_in;
-        if (nline_u == nreq) break;
+    while (nline_u < nreq && ifs_disp >> u_in) {
+        idata = static_cast<long>(nline_u / nval);
+        if (idata >= nstart - 1 && idata <= nend - 1) {
+            u[idata - nstart + 1][nline_u % nval] = u_in;
+        }
+        ++nline_u;
     }
     if (nline_u < nreq)
         error->exit("data_multiplier",
@@ -123,32 +237,130 @@ void InputParser::parse_displacement_and_force_files(Error *error,
     // Read forces from FFILE
 
     nline_f = 0;
-    while (ifs_force >> f_in) {
-        f_tmp[nline_f++] = f_in;
-        if (nline_f == nreq) break;
+    while (nline_f < nreq && ifs_force >> f_in) {
+        idata = static_cast<long>(nline_f / nval);
+        if (idata >= nstart - 1 && idata <= nend - 1) {
+            f[idata - nstart + 1][nline_f % nval] = f_in;
+        }
+        ++nline_f;
     }
     if (nline_f < nreq)
         error->exit("data_multiplier",
                     "The number of lines in FFILE is too small for the given NDATA = ",
                     ndata);
 
-    idata = 0;
-    for (i = 0; i < ndata; ++i) {
-        if (i < nstart - 1) continue;
-        if (i > nend - 1) break;
+    ifs_disp.close();
+    ifs_force.close();
+}
 
-        for (j = 0; j < nat; ++j) {
-            for (k = 0; k < 3; ++k) {
-                u[idata][3 * j + k] = u_tmp[3 * nat * i + 3 * j + k];
-                f[idata][3 * j + k] = f_tmp[3 * nat * i + 3 * j + k];
+int InputParser::parse_next_snapshots(ALMCore *alm,
+                                      const int nmax,
+                                      std::vector<double> &u,
+                                      std::vector<double> &f)
+{
+    // Read at most nmax snapshots following those read so far in the online
+    // fitting. Returns the number of snapshots read, which is less than nmax
+    // only at the end of the data.
+
+    const int nat = alm->system->nat;
+    const size_t nval = 3 * nat;
+    int nread = 0;
+
+    u.resize(nval * nmax);
+    f.resize(nval * nmax);
+
+    while (nread < nmax && !end_of_online) {
+        // The displacements of a snapshot are kept pending until its forces
+        // have been read as well.
+        if (read_snapshot_online(ifs_disp_online, line_disp_online, val_disp_online,
+                                 pipe_disp_online,
+                                 3 * nat, alm->fitting->online_wait)
+            && read_snapshot_online(ifs_force_online, line_force_online, val_force_online,
+                                    pipe_force_online,
+                                    3 * nat, alm->fitting->online_wait)) {
+            pop_snapshot_online(val_disp_online, 3 * nat, &u[nval * nread]);
+            pop_snapshot_online(val_force_online, 3 * nat, &f[nval * nread]);
+            ++nread;
+        } else {
+            end_of_online = true;
+            if (!val_disp_online.empty() || !val_force_online.empty()
+                || !line_disp_online.empty() || !line_force_online.empty()) {
+                alm->error->warn("parse_next_snapshots",
+                                 "The incomplete snapshot at the end of DFILE or FFILE is ignored.");
             }
+            ifs_disp_online.close();
+            ifs_force_online.close();
         }
-        ++idata;
     }
-    u_tmp.clear();
-    f_tmp.clear();
-    ifs_disp.close();
-    ifs_force.close();
+
+    u.resize(nval * nread);
+    f.resize(nval * nread);
+
+    return nread;
+}
+
+bool InputParser::read_snapshot_online(std::ifstream &ifs,
+                                       std::string &line_partial,
+                                       std::deque<double> &val,
+                                       const bool is_pipe,
+                                       const int nval,
+                                       const double wait)
+{
+    // Read from a file that may still be written until val holds nval
+    // values. At the end of the data written so far, the incomplete last
+    // line is kept and a regular file is polled until no new data arrive
+    // for wait seconds. The writer may have stopped in the middle of a
+    // number, so the incomplete line is used only at the end of a named
+    // pipe, where the writer has closed it. The values stay in val until
+    // they are taken by pop_snapshot_online.
+
+    double val_in;
+    std::string line;
+    auto t_last = std::chrono::steady_clock::now();
+
+    while (val.size() < static_cast<size_t>(nval)) {
+
+        if (std::getline(ifs, line) && !ifs.eof()) {
+            std::istringstream is(line_partial + line);
+            line_partial.clear();
+            while (is >> val_in) val.push_back(val_in);
+            t_last = std::chrono::steady_clock::now();
+            continue;
+        }
+
+        if (!line.empty()) {
+            line_partial += line;
+            t_last = std::chrono::steady_clock::now();
+        }
+        ifs.clear();
+
+        const double t_idle = std::chrono::duration<double>(std::chrono::steady_clock::now()
+                                                            - t_last).count();
+        if (!is_pipe && t_idle < wait) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+
+        // No more data. The last line of a closed pipe may not end with a
+        // newline.
+        if (!is_pipe) return false;
+        std::istringstream is(line_partial);
+        line_partial.clear();
+        while (is >> val_in) val.push_back(val_in);
+        return val.size() >= static_cast<size_t>(nval);
+    }
+
+    return true;
+}
+
+void InputParser::pop_snapshot_online(std::deque<double> &val,
+                                      const int nval,
+                                      double *snapshot)
+{
+    for (int i = 0; i < nval; ++i) {
+        snapshot[i] = val.front();
+        val.pop_front();
+    }
 }
 
 void InputParser::parse_input(ALMCore *alm)
@@ -195,7 +407,7 @@ void InputParser::parse_input(ALMCore *alm)
     }
     parse_cutoff_radii(alm);
 
-    if (mode == "fitting") {
+    if (mode == "fitting" || mode == "plan") {
         if (!locate_tag("&fitting")) {
             alm->error->exit("parse_input",
                              "&fitting entry not found in the input file");
@@ -251,7 +463,7 @@ void InputParser::parse_general_vars(ALMCore *alm)
     mode = general_var_dict["MODE"];
 
     std::transform(mode.begin(), mode.end(), mode.begin(), tolower);
-    if (mode != "fitting" && mode != "suggest") {
+    if (mode != "fitting" && mode != "suggest" && mode != "plan") {
         alm->error->exit("parse_general_vars", "Invalid MODE variable");
     }
 
@@ -640,8 +852,37 @@ void InputParser::parse_fitting_vars(ALMCore *alm)
     int constraint_flag;
     std::string rotation_axis;
     std::string fc2_file, fc3_file;
-
-    std::string str_allowed_list = "NDATA NSTART NEND DFILE FFILE ICONST ROTAXIS FC2XML FC3XML";
+    std::string solver;
+    int nblock;
+    int use_sparse;
+    std::string sparse_solver;
+    double tol_iter;
+    int maxiter;
+    std::string scratch_dir;
+    double maxmem;
+    int cross_validation;
+    double cv_minalpha, cv_maxalpha;
+    int cv_nalpha;
+    std::string lmodel;
+    double l1_alpha, l1_ratio;
+    int hierarchical;
+    std::vector<int> nstart_order, nend_order;
+    std::vector<std::string> str_v;
+    std::string precision;
+    double memlimit;
+    std::string selection;
+    double select_cond;
+    int parity;
+    int pin_threads;
+    int online;
+    double online_wait;
+
+    std::string str_allowed_list = "NDATA NSTART NEND DFILE FFILE ICONST ROTAXIS FC2XML FC3XML \
+                                   SOLVER NBLOCK SPARSE SPARSESOLVER TOL_ITER MAXITER \
+                                   SCRATCH MAXMEM CV CV_MINALPHA CV_MAXALPHA CV_NALPHA \
+                                   LMODEL L1_ALPHA L1_RATIO HIERARCHICAL NSTART_ORDER NEND_ORDER \
+                                   PRECISION MEMLIMIT SELECT SELECT_COND PARITY PIN_THREADS \
+                                   ONLINE ONLINE_WAIT";
     std::string str_no_defaults = "NDATA DFILE FFILE";
     std::vector<std::string> no_defaults;
 
@@ -718,6 +959,253 @@ void InputParser::parse_fitting_vars(ALMCore *alm)
         }
     }
 
+    if (fitting_var_dict["SOLVER"].empty()) {
+        solver = "SVD";
+    } else {
+        solver = fitting_var_dict["SOLVER"];
+        std::transform(solver.begin(), solver.end(), solver.begin(), toupper);
+        if (solver != "SVD" && solver != "SVD_DC" && solver != "QRP" && solver != "SKETCH"
+            && solver != "AUTO"
+            && solver != "CHOLESKY" && solver != "TSQR"
+            && solver != "LSQR" && solver != "CGLS") {
+            alm->error->exit("parse_fitting_vars", "Invalid SOLVER");
+        }
+    }
+
+    if (fitting_var_dict["NBLOCK"].empty()) {
+        nblock = 0;
+    } else {
+        assign_val(nblock, "NBLOCK", fitting_var_dict, alm->error);
+        if (nblock < 0) {
+            alm->error->exit("parse_fitting_vars", "NBLOCK must not be negative");
+        }
+    }
+
+    if (fitting_var_dict["SPARSE"].empty()) {
+        use_sparse = 0;
+    } else {
+        assign_val(use_sparse, "SPARSE", fitting_var_dict, alm->error);
+    }
+
+    if (fitting_var_dict["SPARSESOLVER"].empty()) {
+        sparse_solver = "LSQR";
+    } else {
+        sparse_solver = fitting_var_dict["SPARSESOLVER"];
+        std::transform(sparse_solver.begin(), sparse_solver.end(), sparse_solver.begin(), toupper);
+        if (sparse_solver != "LSQR" && sparse_solver != "QR") {
+            alm->error->exit("parse_fitting_vars", "Invalid SPARSESOLVER");
+        }
+    }
+
+    if (fitting_var_dict["TOL_ITER"].empty()) {
+        tol_iter = 1.0e-10;
+    } else {
+        assign_val(tol_iter, "TOL_ITER", fitting_var_dict, alm->error);
+        if (tol_iter <= 0.0) {
+            alm->error->exit("parse_fitting_vars", "TOL_ITER must be positive");
+        }
+    }
+
+    if (fitting_var_dict["MAXITER"].empty()) {
+        maxiter = 0;
+    } else {
+        assign_val(maxiter, "MAXITER", fitting_var_dict, alm->error);
+        if (maxiter < 0) {
+            alm->error->exit("parse_fitting_vars", "MAXITER must not be negative");
+        }
+    }
+
+    scratch_dir = fitting_var_dict["SCRATCH"];
+
+    if (fitting_var_dict["MAXMEM"].empty()) {
+        maxmem = 0.0;
+    } else {
+        assign_val(maxmem, "MAXMEM", fitting_var_dict, alm->error);
+        if (maxmem < 0.0) {
+            alm->error->exit("parse_fitting_vars", "MAXMEM must not be negative");
+        }
+    }
+
+    if (fitting_var_dict["CV"].empty()) {
+        cross_validation = 0;
+    } else {
+        assign_val(cross_validation, "CV", fitting_var_dict, alm->error);
+        if (cross_validation < 0 || cross_validation == 1) {
+            alm->error->exit("parse_fitting_vars", "CV must be 0 or larger than 1");
+        }
+    }
+
+    if (fitting_var_dict["CV_MINALPHA"].empty()) {
+        cv_minalpha = 1.0e-8;
+    } else {
+        assign_val(cv_minalpha, "CV_MINALPHA", fitting_var_dict, alm->error);
+    }
+    if (fitting_var_dict["CV_MAXALPHA"].empty()) {
+        cv_maxalpha = 1.0e-2;
+    } else {
+        assign_val(cv_maxalpha, "CV_MAXALPHA", fitting_var_dict, alm->error);
+    }
+    if (fitting_var_dict["CV_NALPHA"].empty()) {
+        cv_nalpha = 20;
+    } else {
+        assign_val(cv_nalpha, "CV_NALPHA", fitting_var_dict, alm->error);
+    }
+    if (cv_minalpha <= 0.0 || cv_maxalpha < cv_minalpha || cv_nalpha <= 0) {
+        alm->error->exit("parse_fitting_vars",
+                         "CV_MINALPHA, CV_MAXALPHA, and CV_NALPHA are not consistent");
+    }
+
+    if (fitting_var_dict["LMODEL"].empty()) {
+        lmodel = "LS";
+    } else {
+        lmodel = fitting_var_dict["LMODEL"];
+        std::transform(lmodel.begin(), lmodel.end(), lmodel.begin(), toupper);
+        if (lmodel != "LS" && lmodel != "ENET") {
+            alm->error->exit("parse_fitting_vars", "Invalid LMODEL");
+        }
+    }
+
+    if (fitting_var_dict["L1_ALPHA"].empty()) {
+        l1_alpha = 0.0;
+    } else {
+        assign_val(l1_alpha, "L1_ALPHA", fitting_var_dict, alm->error);
+        if (l1_alpha < 0.0) {
+            alm->error->exit("parse_fitting_vars", "L1_ALPHA must not be negative");
+        }
+    }
+
+    if (fitting_var_dict["L1_RATIO"].empty()) {
+        l1_ratio = 1.0;
+    } else {
+        assign_val(l1_ratio, "L1_RATIO", fitting_var_dict, alm->error);
+        if (l1_ratio <= 0.0 || l1_ratio > 1.0) {
+            alm->error->exit("parse_fitting_vars", "L1_RATIO must be in the range 0 < L1_RATIO <= 1");
+        }
+    }
+
+    if (fitting_var_dict["HIERARCHICAL"].empty()) {
+        hierarchical = 0;
+    } else {
+        assign_val(hierarchical, "HIERARCHICAL", fitting_var_dict, alm->error);
+    }
+
+    nstart_order.clear();
+    nend_order.clear();
+
+    if (!fitting_var_dict["NSTART_ORDER"].empty()) {
+        boost::split(str_v, fitting_var_dict["NSTART_ORDER"], boost::is_space());
+        for (auto it = str_v.begin(); it != str_v.end(); ++it) {
+            if ((*it).empty()) continue;
+            try {
+                nstart_order.push_back(boost::lexical_cast<int>(*it));
+            }
+            catch (std::exception &e) {
+                std::cout << e.what() << std::endl;
+                alm->error->exit("parse_fitting_vars", "NSTART_ORDER must be integers.");
+            }
+        }
+    }
+    if (!fitting_var_dict["NEND_ORDER"].empty()) {
+        boost::split(str_v, fitting_var_dict["NEND_ORDER"], boost::is_space());
+        for (auto it = str_v.begin(); it != str_v.end(); ++it) {
+            if ((*it).empty()) continue;
+            try {
+                nend_order.push_back(boost::lexical_cast<int>(*it));
+            }
+            catch (std::exception &e) {
+                std::cout << e.what() << std::endl;
+                alm->error->exit("parse_fitting_vars", "NEND_ORDER must be integers.");
+            }
+        }
+    }
+
+    if (fitting_var_dict["PRECISION"].empty()) {
+        precision = "DOUBLE";
+    } else {
+        precision = fitting_var_dict["PRECISION"];
+        std::transform(precision.begin(), precision.end(), precision.begin(), toupper);
+        if (precision != "DOUBLE" && precision != "MIXED") {
+            alm->error->exit("parse_fitting_vars", "Invalid PRECISION");
+        }
+    }
+
+    if (fitting_var_dict["MEMLIMIT"].empty()) {
+        memlimit = 0.0;
+    } else {
+        assign_val(memlimit, "MEMLIMIT", fitting_var_dict, alm->error);
+        if (memlimit < 0.0) {
+            alm->error->exit("parse_fitting_vars", "MEMLIMIT must not be negative");
+        }
+    }
+
+    if (fitting_var_dict["SELECT"].empty()) {
+        selection = "NONE";
+    } else {
+        selection = fitting_var_dict["SELECT"];
+        std::transform(selection.begin(), selection.end(), selection.begin(), toupper);
+        if (selection != "NONE" && selection != "DOPT") {
+            alm->error->exit("parse_fitting_vars", "Invalid SELECT");
+        }
+    }
+
+    if (fitting_var_dict["SELECT_COND"].empty()) {
+        select_cond = 1.5;
+    } else {
+        assign_val(select_cond, "SELECT_COND", fitting_var_dict, alm->error);
+        if (select_cond < 1.0) {
+            alm->error->exit("parse_fitting_vars", "SELECT_COND must be 1 or larger");
+        }
+    }
+
+    if (fitting_var_dict["PARITY"].empty()) {
+        parity = 0;
+    } else {
+        assign_val(parity, "PARITY", fitting_var_dict, alm->error);
+    }
+
+    if (fitting_var_dict["PIN_THREADS"].empty()) {
+        pin_threads = 0;
+    } else {
+        assign_val(pin_threads, "PIN_THREADS", fitting_var_dict, alm->error);
+    }
+
+    if (fitting_var_dict["ONLINE"].empty()) {
+        online = 0;
+    } else {
+        assign_val(online, "ONLINE", fitting_var_dict, alm->error);
+        if (online < 0) {
+            alm->error->exit("parse_fitting_vars", "ONLINE must not be negative");
+        }
+    }
+
+    // DFILE and FFILE of the online fitting are regular files that may still
+    // grow. They are polled for 60 seconds by default before the data are
+    // regarded as finished. Named pipes end when the writer closes them.
+    if (fitting_var_dict["ONLINE_WAIT"].empty()) {
+        online_wait = 60.0;
+    } else {
+        assign_val(online_wait, "ONLINE_WAIT", fitting_var_dict, alm->error);
+        if (online_wait < 0.0) {
+            alm->error->exit("parse_fitting_vars", "ONLINE_WAIT must not be negative");
+        }
+    }
+
+    // The online fitting updates the least-squares solution of the first
+    // NDATA snapshots with those appended to DFILE and FFILE afterwards.
+
+    if (online > 0) {
+        if (nstart != 1 || nend != ndata) {
+            alm->error->exit("parse_fitting_vars",
+                             "NSTART and NEND cannot be given when ONLINE > 0");
+        }
+        if (cross_validation > 0 || lmodel != "LS" || hierarchical
+            || selection != "NONE" || use_sparse) {
+            alm->error->exit("parse_fitting_vars",
+                             "ONLINE > 0 cannot be combined with CV, LMODEL = ENET, "
+                             "HIERARCHICAL, SELECT, or SPARSE.");
+        }
+    }
+
     InputSetter *input_setter = new InputSetter();
     input_setter->set_fitting_vars(alm,
                                    ndata,
@@ -730,7 +1218,33 @@ void InputParser::parse_fitting_vars(ALMCore *alm)
                                    fc2_file,
                                    fc3_file,
                                    fix_harmonic,
-                                   fix_cubic);
+                                   fix_cubic,
+                                   solver,
+                                   nblock,
+                                   use_sparse,
+                                   sparse_solver,
+                                   tol_iter,
+                                   maxiter,
+                                   scratch_dir,
+                                   maxmem,
+                                   cross_validation,
+                                   cv_minalpha,
+                                   cv_maxalpha,
+                                   cv_nalpha,
+                                   lmodel,
+                                   l1_alpha,
+                                   l1_ratio,
+                                   hierarchical,
+                                   nstart_order,
+                                   nend_order,
+                                   precision,
+                                   memlimit,
+                                   selection,
+                                   select_cond,
+                                   parity,
+                                   pin_threads,
+                                   online,
+                                   online_wait);
     delete input_setter;
 
     fitting_var_dict.clear();
@@ -11,6 +11,7 @@
 #pragma once
 
 #include <fstream>
+#include <deque>
 #include <string>
 #include <map>
 #include <vector>
@@ -39,6 +40,10 @@ namespace ALM_NS
                                                 const int nend,
                                                 const std::string file_disp,
                                                 const std::string file_force);
+        int parse_next_snapshots(ALMCore *alm,
+                                 const int nmax,
+                                 std::vector<double> &u,
+                                 std::vector<double> &f);
         std::string str_magmom;
 
     private:
@@ -50,6 +55,15 @@ namespace ALM_NS
         int nat;
         int nkd;
 
+        // DFILE and FFILE kept open in the online fitting, whether they are
+        // named pipes, the incomplete last lines, and the values read but
+        // not used yet.
+        std::ifstream ifs_disp_online, ifs_force_online;
+        bool pipe_disp_online, pipe_force_online;
+        std::string line_disp_online, line_force_online;
+        std::deque<double> val_disp_online, val_force_online;
+        bool end_of_online;
+
         void parse_input(ALMCore *alm);
         void parse_general_vars(ALMCore *alm);
         void parse_cell_parameter(ALMCore *alm);
@@ -70,6 +84,15 @@ namespace ALM_NS
                         const std::string,
                         std::map<std::string, std::string>,
                         Error *);
+        bool read_snapshot_online(std::ifstream &,
+                                  std::string &,
+                                  std::deque<double> &,
+                                  const bool,
+                                  const int,
+                                  const double);
+        void pop_snapshot_online(std::deque<double> &,
+                                 const int,
+                                 double *);
         void set_displacement_and_force(ALMCore *alm,
                                         const double * const *u,
                                         const double * const *f,
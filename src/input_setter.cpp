@@ -170,7 +170,33 @@ void InputSetter::set_fitting_vars(ALMCore *alm_core,
                                    const std::string fc2_file,
                                    const std::string fc3_file,
                                    const bool fix_harmonic,
-                                   const bool fix_cubic)
+                                   const bool fix_cubic,
+                                   const std::string solver,
+                                   const int nblock,
+                                   const int use_sparse,
+                                   const std::string sparse_solver,
+                                   const double tol_iter,
+                                   const int maxiter,
+                                   const std::string scratch_dir,
+                                   const double maxmem,
+                                   const int cross_validation,
+                                   const double cv_minalpha,
+                                   const double cv_maxalpha,
+                                   const int cv_nalpha,
+                                   const std::string lmodel,
+                                   const double l1_alpha,
+                                   const double l1_ratio,
+                                   const int hierarchical,
+                                   const std::vector<int> &nstart_order,
+                                   const std::vector<int> &nend_order,
+                                   const std::string precision,
+                                   const double memlimit,
+                                   const std::string selection,
+                                   const double select_cond,
+                                   const int parity,
+                                   const int pin_threads,
+                                   const int online,
+                                   const double online_wait)
 {
     alm_core->system->ndata = ndata;
     alm_core->system->nstart = nstart;
@@ -184,6 +210,32 @@ void InputSetter::set_fitting_vars(ALMCore *alm_core,
     alm_core->constraint->fix_harmonic = fix_harmonic;
     alm_core->constraint->fc3_file = fc3_file;
     alm_core->constraint->fix_cubic = fix_cubic;
+    alm_core->fitting->solver = solver;
+    alm_core->fitting->nblock = nblock;
+    alm_core->fitting->use_sparse = use_sparse;
+    alm_core->fitting->sparse_solver = sparse_solver;
+    alm_core->fitting->tol_iter = tol_iter;
+    alm_core->fitting->maxiter = maxiter;
+    alm_core->fitting->scratch_dir = scratch_dir;
+    alm_core->fitting->maxmem = maxmem;
+    alm_core->fitting->cross_validation = cross_validation;
+    alm_core->fitting->cv_minalpha = cv_minalpha;
+    alm_core->fitting->cv_maxalpha = cv_maxalpha;
+    alm_core->fitting->cv_nalpha = cv_nalpha;
+    alm_core->fitting->lmodel = lmodel;
+    alm_core->fitting->l1_alpha = l1_alpha;
+    alm_core->fitting->l1_ratio = l1_ratio;
+    alm_core->fitting->hierarchical = hierarchical;
+    alm_core->fitting->nstart_order = nstart_order;
+    alm_core->fitting->nend_order = nend_order;
+    alm_core->fitting->precision = precision;
+    alm_core->fitting->memlimit = memlimit;
+    alm_core->fitting->selection = selection;
+    alm_core->fitting->select_cond = select_cond;
+    alm_core->fitting->parity = parity;
+    alm_core->fitting->pin_threads = pin_threads;
+    alm_core->fitting->online = online;
+    alm_core->fitting->online_wait = online_wait;
 }
 
 void InputSetter::set_atomic_positions(ALMCore *alm_core,
@@ -12,6 +12,7 @@
 
 #include "alm_core.h"
 #include <string>
+#include <vector>
 
 namespace ALM_NS
 {
@@ -62,7 +63,33 @@ namespace ALM_NS
                               const std::string fc2_file,
                               const std::string fc3_file,
                               const bool fix_harmonic,
-                              const bool fix_cubic);
+                              const bool fix_cubic,
+                              const std::string solver,
+                              const int nblock,
+                              const int use_sparse,
+                              const std::string sparse_solver,
+                              const double tol_iter,
+                              const int maxiter,
+                              const std::string scratch_dir,
+                              const double maxmem,
+                              const int cross_validation,
+                              const double cv_minalpha,
+                              const double cv_maxalpha,
+                              const int cv_nalpha,
+                              const std::string lmodel,
+                              const double l1_alpha,
+                              const double l1_ratio,
+                              const int hierarchical,
+                              const std::vector<int> &nstart_order,
+                              const std::vector<int> &nend_order,
+                              const std::string precision,
+                              const double memlimit,
+                              const std::string selection,
+                              const double select_cond,
+                              const int parity,
+                              const int pin_threads,
+                              const int online,
+                              const double online_wait);
         void set_atomic_positions(ALMCore *alm_core,
                                   const int nat,
                                   const int *kd,
@@ -10,16 +10,27 @@
 
 #include <stdlib.h>
 #include "alm_cui.h"
+#ifdef _USE_MPI
+#include <mpi.h>
+#endif
 
 using namespace ALM_NS;
 
 int main(int argc, char **argv)
 {
+#ifdef _USE_MPI
+    MPI_Init(&argc, &argv);
+#endif
+
     ALMCUI *alm_cui = new ALMCUI();
 
     alm_cui->run(argc, argv);
 
     delete alm_cui;
 
+#ifdef _USE_MPI
+    MPI_Finalize();
+#endif
+
     return EXIT_SUCCESS;
 }
@@ -11,40 +11,43 @@
 #pragma once
 
 #include <iostream>
+#include <cstddef>
 
 // memsize calculator
+// The sizes are size_t so that arrays of more than 2^32 elements can be
+// allocated; the products of the dimensions are taken in 64 bits.
 
-inline unsigned long memsize_in_MB(const int size_of_one,
-                                   const unsigned int n1)
+inline size_t memsize_in_MB(const size_t size_of_one,
+                            const size_t n1)
 {
-    unsigned long n = n1 * size_of_one;
+    size_t n = n1 * size_of_one;
     return n / 1000000;
 }
 
-inline unsigned long memsize_in_MB(const int size_of_one,
-                                   const unsigned int n1,
-                                   const unsigned int n2)
+inline size_t memsize_in_MB(const size_t size_of_one,
+                            const size_t n1,
+                            const size_t n2)
 {
-    unsigned long n = n1 * n2 * size_of_one;
+    size_t n = n1 * n2 * size_of_one;
     return n / 1000000;
 }
 
-inline unsigned long memsize_in_MB(const int size_of_one,
-                                   const unsigned int n1,
-                                   const unsigned int n2,
-                                   const unsigned int n3)
+inline size_t memsize_in_MB(const size_t size_of_one,
+                            const size_t n1,
+                            const size_t n2,
+                            const size_t n3)
 {
-    unsigned long n = n1 * n2 * n3 * size_of_one;
+    size_t n = n1 * n2 * n3 * size_of_one;
     return n / 1000000;
 }
 
-inline unsigned long memsize_in_MB(const int size_of_one,
-                                   const unsigned int n1,
-                                   const unsigned int n2,
-                                   const unsigned int n3,
-                                   const unsigned int n4)
+inline size_t memsize_in_MB(const size_t size_of_one,
+                            const size_t n1,
+                            const size_t n2,
+                            const size_t n3,
+                            const size_t n4)
 {
-    unsigned long n = n1 * n2 * n3 * n4 * size_of_one;
+    size_t n = n1 * n2 * n3 * n4 * size_of_one;
     return n / 1000000;
 }
 
@@ -54,7 +57,7 @@ inline unsigned long memsize_in_MB(const int size_of_one,
 
 template <typename T>
 T* allocate(T *&arr,
-            const unsigned int n1)
+            const size_t n1)
 {
     try {
         arr = new T[n1];
@@ -70,13 +73,13 @@ T* allocate(T *&arr,
 
 template <typename T>
 inline T** allocate(T **&arr,
-                    const unsigned int n1,
-                    const unsigned int n2)
+                    const size_t n1,
+                    const size_t n2)
 {
     try {
         arr = new T *[n1];
         arr[0] = new T[n1 * n2];
-        for (unsigned int i = 1; i < n1; ++i) {
+        for (size_t i = 1; i < n1; ++i) {
             arr[i] = arr[0] + i * n2;
         }
     }
@@ -91,17 +94,17 @@ inline T** allocate(T **&arr,
 
 template <typename T>
 inline T*** allocate(T ***&arr,
-                     const unsigned int n1,
-                     const unsigned int n2,
-                     const unsigned int n3)
+                     const size_t n1,
+                     const size_t n2,
+                     const size_t n3)
 {
     try {
         arr = new T **[n1];
         arr[0] = new T *[n1 * n2];
         arr[0][0] = new T[n1 * n2 * n3];
-        for (unsigned int i = 0; i < n1; ++i) {
+        for (size_t i = 0; i < n1; ++i) {
             arr[i] = arr[0] + i * n2;
-            for (unsigned int j = 0; j < n2; ++j) {
+            for (size_t j = 0; j < n2; ++j) {
                 arr[i][j] = arr[0][0] + i * n2 * n3 + j * n3;
             }
         }
@@ -117,10 +120,10 @@ inline T*** allocate(T ***&arr,
 
 template <typename T>
 inline T**** allocate(T ****&arr,
-                      const unsigned int n1,
-                      const unsigned int n2,
-                      const unsigned int n3,
-                      const unsigned int n4)
+                      const size_t n1,
+                      const size_t n2,
+                      const size_t n3,
+                      const size_t n4)
 {
     try {
         arr = new T ***[n1];
@@ -128,11 +131,11 @@ inline T**** allocate(T ****&arr,
         arr[0][0] = new T *[n1 * n2 * n3];
         arr[0][0][0] = new T[n1 * n2 * n3 * n4];
 
-        for (unsigned int i = 0; i < n1; ++i) {
+        for (size_t i = 0; i < n1; ++i) {
             arr[i] = arr[0] + i * n2;
-            for (unsigned int j = 0; j < n2; ++j) {
+            for (size_t j = 0; j < n2; ++j) {
                 arr[i][j] = arr[0][0] + i * n2 * n3 + j * n3;
-                for (unsigned int k = 0; k < n3; ++k) {
+                for (size_t k = 0; k < n3; ++k) {
                     arr[i][j][k] = arr[0][0][0] + i * n2 * n3 * n4 + j * n3 * n4 + k * n4;
                 }
             }
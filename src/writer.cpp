@@ -81,7 +81,7 @@ void Writer::write_input_vars(ALM *alm)
         std::cout << "  DBASIS = " << alm_core->displace->disp_basis << std::endl;
         std::cout << std::endl;
 
-    } else if (alm_core->mode == "fitting") {
+    } else if (alm_core->mode == "fitting" || alm_core->mode == "plan") {
         std::cout << " Fitting:" << std::endl;
         std::cout << "  DFILE = " << alm_core->files->file_disp << std::endl;
         std::cout << "  FFILE = " << alm_core->files->file_force << std::endl;
@@ -91,6 +91,42 @@ void Writer::write_input_vars(ALM *alm)
         std::cout << "  ROTAXIS = " << alm_core->constraint->rotation_axis << std::endl;
         std::cout << "  FC2XML = " << alm_core->constraint->fc2_file << std::endl;
         std::cout << "  FC3XML = " << alm_core->constraint->fc3_file << std::endl;
+        std::cout << "  SOLVER = " << alm_core->fitting->solver
+            << "; NBLOCK = " << alm_core->fitting->nblock << std::endl;
+        std::cout << "  SPARSE = " << alm_core->fitting->use_sparse
+            << "; SPARSESOLVER = " << alm_core->fitting->sparse_solver << std::endl;
+        std::cout << "  TOL_ITER = " << alm_core->fitting->tol_iter
+            << "; MAXITER = " << alm_core->fitting->maxiter << std::endl;
+        std::cout << "  SCRATCH = " << alm_core->fitting->scratch_dir
+            << "; MAXMEM = " << alm_core->fitting->maxmem << std::endl;
+        std::cout << "  CV = " << alm_core->fitting->cross_validation
+            << "; CV_MINALPHA = " << alm_core->fitting->cv_minalpha
+            << "; CV_MAXALPHA = " << alm_core->fitting->cv_maxalpha
+            << "; CV_NALPHA = " << alm_core->fitting->cv_nalpha << std::endl;
+        std::cout << "  LMODEL = " << alm_core->fitting->lmodel
+            << "; L1_ALPHA = " << alm_core->fitting->l1_alpha
+            << "; L1_RATIO = " << alm_core->fitting->l1_ratio << std::endl;
+        std::cout << "  HIERARCHICAL = " << alm_core->fitting->hierarchical
+            << "; PRECISION = " << alm_core->fitting->precision
+            << "; MEMLIMIT = " << alm_core->fitting->memlimit << std::endl;
+        std::cout << "  SELECT = " << alm_core->fitting->selection
+            << "; SELECT_COND = " << alm_core->fitting->select_cond
+            << "; PARITY = " << alm_core->fitting->parity
+            << "; PIN_THREADS = " << alm_core->fitting->pin_threads << std::endl;
+        std::cout << "  ONLINE = " << alm_core->fitting->online
+            << "; ONLINE_WAIT = " << alm_core->fitting->online_wait << std::endl;
+        if (!alm_core->fitting->nstart_order.empty()) {
+            std::cout << "  NSTART_ORDER =";
+            for (auto it = alm_core->fitting->nstart_order.begin();
+                 it != alm_core->fitting->nstart_order.end(); ++it) std::cout << " " << *it;
+            std::cout << std::endl;
+        }
+        if (!alm_core->fitting->nend_order.empty()) {
+            std::cout << "  NEND_ORDER =";
+            for (auto it = alm_core->fitting->nend_order.begin();
+                 it != alm_core->fitting->nend_order.end(); ++it) std::cout << " " << *it;
+            std::cout << std::endl;
+        }
         std::cout << std::endl;
     }
     std::cout << " -------------------------------------------------------------------" << std::endl;
@@ -106,9 +142,10 @@ void Writer::writeall(ALM *alm)
 
     std::cout << " The following files are created:" << std::endl << std::endl;
     write_force_constants(alm);
-    // write_misc_xml breaks data in fcs.
+    if (alm_core->fitting->nset > 1) write_force_constant_sets(alm);
     write_misc_xml(alm);
     if (alm_core->files->print_hessian) write_hessian(alm);
+    if (alm_core->fitting->cross_validation > 0) write_cvscore(alm);
     //   write_in_QEformat(alm);
     std::cout << std::endl;
 
@@ -511,10 +548,13 @@ void Writer::write_misc_xml(ALM *alm)
 
     int ip, ishift;
 
-    std::sort(alm_core->fcs->fc_table[0].begin(), alm_core->fcs->fc_table[0].end());
+    // fc_table is sorted in a copy, since the other writers and the
+    // incremental fitting rely on its grouping by nequiv.
 
-    for (auto it = alm_core->fcs->fc_table[0].begin();
-         it != alm_core->fcs->fc_table[0].end(); ++it) {
+    std::vector<FcProperty> fc_sorted = alm_core->fcs->fc_table[0];
+    std::sort(fc_sorted.begin(), fc_sorted.end());
+
+    for (auto it = fc_sorted.begin(); it != fc_sorted.end(); ++it) {
         FcProperty fctmp = *it;
         ip = fctmp.mother;
 
@@ -546,10 +586,10 @@ void Writer::write_misc_xml(ALM *alm)
     std::string elementname;
     for (order = 1; order < alm_core->interaction->maxorder; ++order) {
 
-        std::sort(alm_core->fcs->fc_table[order].begin(), alm_core->fcs->fc_table[order].end());
+        fc_sorted = alm_core->fcs->fc_table[order];
+        std::sort(fc_sorted.begin(), fc_sorted.end());
 
-        for (auto it = alm_core->fcs->fc_table[order].begin();
-             it != alm_core->fcs->fc_table[order].end(); ++it) {
+        for (auto it = fc_sorted.begin(); it != fc_sorted.end(); ++it) {
             FcProperty fctmp = *it;
             ip = fctmp.mother + ishift;
 
@@ -674,6 +714,74 @@ void Writer::write_hessian(ALM *alm)
     std::cout << " Complete Hessian matrix                    : " << alm_core->files->file_hes << std::endl;
 }
 
+void Writer::write_force_constant_sets(ALM *alm)
+{
+    int order, iset;
+    unsigned int iuniq;
+    std::ofstream ofs_sets;
+
+    ALMCore *alm_core = alm->get_alm_core();
+    Fitting *fitting = alm_core->fitting;
+    int maxorder = alm_core->interaction->maxorder;
+
+    ofs_sets.open(alm_core->files->file_fcsets.c_str(), std::ios::out);
+    if (!ofs_sets) alm_core->error->exit("write_force_constant_sets", "cannot create fcsets file");
+
+    ofs_sets << "# Irreducible force constants of " << fitting->nset
+        << " force sets in Rydberg atomic units" << std::endl;
+    ofs_sets << "# FCs of the force sets 1 .. " << fitting->nset << std::endl;
+
+    int ip = 0;
+
+    for (order = 0; order < maxorder; ++order) {
+        for (iuniq = 0; iuniq < alm_core->fcs->nequiv[order].size(); ++iuniq) {
+            ofs_sets << "  FC" << std::setw(1) << order + 2 << "_" << std::left
+                << std::setw(8) << iuniq + 1 << std::right;
+            for (iset = 0; iset < fitting->nset; ++iset) {
+                ofs_sets << std::setw(16) << std::scientific
+                    << std::setprecision(7) << fitting->params_set[iset][ip];
+            }
+            ofs_sets << std::endl;
+            ++ip;
+        }
+    }
+    ofs_sets.close();
+
+    std::cout << " Force constants of all force sets          : " << alm_core->files->file_fcsets << std::endl;
+}
+
+void Writer::write_cvscore(ALM *alm)
+{
+    unsigned int ui;
+    std::ofstream ofs_cv;
+
+    ALMCore *alm_core = alm->get_alm_core();
+    Fitting *fitting = alm_core->fitting;
+
+    ofs_cv.open(alm_core->files->file_cvscore.c_str(), std::ios::out);
+    if (!ofs_cv) alm_core->error->exit("write_cvscore", "cannot create cvscore file");
+
+    ofs_cv << "# " << fitting->cross_validation << "-fold cross validation of ";
+    if (fitting->lmodel == "ENET") {
+        ofs_cv << "elastic net (L1_RATIO = " << fitting->l1_ratio << ")" << std::endl;
+    } else {
+        ofs_cv << "ridge regression" << std::endl;
+    }
+    ofs_cv << "# Optimal alpha = " << std::scientific << std::setprecision(6)
+        << fitting->cv_alpha_opt << std::endl;
+    ofs_cv << "# alpha, fitting error (%) of training set, validation set, std. dev. of validation" << std::endl;
+    for (ui = 0; ui < fitting->cv_alphas.size(); ++ui) {
+        ofs_cv << std::setw(15) << fitting->cv_alphas[ui];
+        ofs_cv << std::setw(15) << fitting->cv_error_train[ui];
+        ofs_cv << std::setw(15) << fitting->cv_error_valid[ui];
+        ofs_cv << std::setw(15) << fitting->cv_error_valid_std[ui];
+        ofs_cv << std::endl;
+    }
+    ofs_cv.close();
+
+    std::cout << " Cross validation scores                    : " << alm_core->files->file_cvscore << std::endl;
+}
+
 std::string Writer::double2string(const double d, const int nprec)
 {
     std::string rt;
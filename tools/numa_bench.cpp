@@ -0,0 +1,123 @@
+/*
+ numa_bench.cpp
+
+ This file is distributed under the terms of the MIT license.
+ Please see the file 'LICENCE.txt' in the root directory
+ or http://opensource.org/licenses/mit-license.php for information.
+*/
+
+// Memory bandwidth of the access pattern of the design matrix in the fitting
+// for two placements of the pages:
+//
+//  serial : the matrix is zeroed by the master thread, so that all the pages
+//           are placed on its NUMA node (the old behavior).
+//  static : the matrix is first touched by the thread that later processes
+//           the rows with the static schedule (PIN_THREADS / first touch).
+//
+// The column-major M x N matrix is divided into chunks of rows as in
+// Fitting::calc_matrix_elements. Each pass writes the matrix and then
+// reads it to compute the column norms, both with the static schedule.
+//
+// Usage:
+//   g++ -O2 -fopenmp numa_bench.cpp -o numa_bench
+//   OMP_PROC_BIND=spread OMP_PLACES=cores ./numa_bench [M] [N] [npass]
+//
+// On a multi-socket machine, the static placement should give a bandwidth
+// close to the sum of those of the sockets, and the serial one that of a
+// single socket.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <omp.h>
+
+static const long nrow_chunk = 3 * 16 * 8;
+
+double run_passes(double *a, const long m, const long n, const int npass)
+{
+    const long nchunk = (m + nrow_chunk - 1) / nrow_chunk;
+    std::vector<double> cnorm(n);
+
+    auto t_start = std::chrono::steady_clock::now();
+
+    for (int ipass = 0; ipass < npass; ++ipass) {
+
+#pragma omp parallel
+        {
+            std::vector<double> cnorm_omp(n, 0.0);
+
+#pragma omp for schedule(static)
+            for (long ichunk = 0; ichunk < nchunk; ++ichunk) {
+                const long i0 = ichunk * nrow_chunk;
+                const long i1 = std::min<long>(i0 + nrow_chunk, m);
+                for (long j = 0; j < n; ++j) {
+                    for (long i = i0; i < i1; ++i) {
+                        a[i + m * j] = 1.0e-3 * static_cast<double>((i + j + ipass) % 7);
+                    }
+                }
+            }
+
+#pragma omp for schedule(static)
+            for (long ichunk = 0; ichunk < nchunk; ++ichunk) {
+                const long i0 = ichunk * nrow_chunk;
+                const long i1 = std::min<long>(i0 + nrow_chunk, m);
+                for (long j = 0; j < n; ++j) {
+                    for (long i = i0; i < i1; ++i) {
+                        cnorm_omp[j] += a[i + m * j] * a[i + m * j];
+                    }
+                }
+            }
+
+#pragma omp critical
+            for (long j = 0; j < n; ++j) cnorm[j] += cnorm_omp[j];
+        }
+    }
+
+    const double time = std::chrono::duration<double>(std::chrono::steady_clock::now()
+                                                      - t_start).count();
+
+    // one write and one read of the matrix per pass
+    return 2.0 * npass * m * n * sizeof(double) / time * 1.0e-9;
+}
+
+int main(int argc, char **argv)
+{
+    const long m = (argc > 1) ? std::atol(argv[1]) : 2000000;
+    const long n = (argc > 2) ? std::atol(argv[2]) : 200;
+    const int npass = (argc > 3) ? std::atoi(argv[3]) : 5;
+    const long nchunk = (m + nrow_chunk - 1) / nrow_chunk;
+
+    std::cout << " NUMA_BENCH: " << m << " x " << n << " matrix ("
+        << m * n * sizeof(double) / 1000000 << " MB), "
+        << omp_get_max_threads() << " threads" << std::endl;
+
+    // serial first touch
+
+    double *a = new double[m * n];
+    for (long k = 0; k < m * n; ++k) a[k] = 0.0;
+    const double bw_serial = run_passes(a, m, n, npass);
+    delete[] a;
+
+    // first touch by the owner of the rows
+
+    a = new double[m * n];
+#pragma omp parallel for schedule(static)
+    for (long ichunk = 0; ichunk < nchunk; ++ichunk) {
+        const long i0 = ichunk * nrow_chunk;
+        const long i1 = std::min<long>(i0 + nrow_chunk, m);
+        for (long j = 0; j < n; ++j) {
+            for (long i = i0; i < i1; ++i) a[i + m * j] = 0.0;
+        }
+    }
+    const double bw_static = run_passes(a, m, n, npass);
+    delete[] a;
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "  Bandwidth (GB/s), serial first touch : " << bw_serial << std::endl;
+    std::cout << "  Bandwidth (GB/s), static first touch : " << bw_static << std::endl;
+    std::cout << "  Ratio                                : " << bw_static / bw_serial << std::endl;
+
+    return 0;
+}